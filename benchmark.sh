@@ -71,6 +71,17 @@ test_basic_functionality() {
         echo -e "${RED}❌ FAILED${NC}"
     fi
     
+    # Test an empty file, then a second request on the same connection
+    echo -n "Testing empty file... "
+    : > empty-bench.txt
+    if curl -s -m 5 -o /dev/null -o /dev/null -w "%{http_code} " \
+            http://localhost:8080/empty-bench.txt http://localhost:8080/ | grep -q "^200 200 $"; then
+        echo -e "${GREEN}✅ OK${NC}"
+    else
+        echo -e "${RED}❌ FAILED${NC}"
+    fi
+    rm -f empty-bench.txt
+    
     # Test 404 handling
     echo -n "Testing 404 handling... "
     if curl -s -o /dev/null -w "%{http_code}" http://localhost:8080/nonexistent | grep -q "404"; then
@@ -170,7 +181,7 @@ show_metrics() {
     echo "-------------------"
     
     echo "Fetching current metrics..."
-    curl -s http://localhost:8080/metrics | grep -E "(Total Requests|Cache Hits|Cache Misses|Cache Hit Rate|Average Response Time|Cache Size)" | head -6
+    curl -s -H "Accept: text/html" http://localhost:8080/metrics | grep -E "(Total Requests|Cache Hits|Cache Misses|Cache Hit Rate|Average Response Time|Cache Size)" | head -6
 }
 
 # Main benchmark function
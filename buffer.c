@@ -0,0 +1,52 @@
+#include "server.h"
+
+int buffer_append(Buffer *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t new_cap = buf->cap ? buf->cap : 1024;
+        while (new_cap < buf->len + len) {
+            new_cap *= 2;
+        }
+        
+        char *new_data = realloc(buf->data, new_cap);
+        if (!new_data) {
+            return -1;
+        }
+        buf->data = new_data;
+        buf->cap = new_cap;
+    }
+    
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+// Append formatted text, growing the buffer as needed
+int buffer_printf(Buffer *buf, const char *fmt, ...) {
+    va_list args;
+    char small[256];
+    
+    va_start(args, fmt);
+    int len = vsnprintf(small, sizeof(small), fmt, args);
+    va_end(args);
+    if (len < 0) return -1;
+    
+    if ((size_t)len < sizeof(small)) {
+        return buffer_append(buf, small, len);
+    }
+    
+    char *large = malloc(len + 1);
+    if (!large) return -1;
+    va_start(args, fmt);
+    vsnprintf(large, len + 1, fmt, args);
+    va_end(args);
+    
+    int result = buffer_append(buf, large, len);
+    free(large);
+    return result;
+}
+
+void buffer_free(Buffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
@@ -1,114 +1,458 @@
 #include "server.h"
 
-// Global cache variables (defined here, declared in server.h)
-CacheEntry *cache_head = NULL;
-CacheEntry *cache_tail = NULL;
-int cache_size = 0;
-pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-CacheEntry* get_from_cache(const char *filename) {
-    pthread_mutex_lock(&cache_mutex);
-    
-    CacheEntry *curr = cache_head;
-    while (curr) {
-        if (strcmp(curr->filename, filename) == 0) {
-            // Update last accessed time
-            curr->last_accessed = time(NULL);
-            // Move to front (most recently used)
-            move_to_front(curr);
-            pthread_mutex_unlock(&cache_mutex);
-            return curr;
+// The cache is split into CACHE_SHARDS independently locked shards. Each
+// shard has an open-addressing (linear probing) index keyed by filename and
+// its own LRU list, and holds at most 1/CACHE_SHARDS of the byte budget.
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry **slots;      // Hash index, num_slots is a power of two
+    size_t num_slots;
+    size_t used_slots;       // Live entries plus tombstones
+    CacheEntry *head;        // Most recently used
+    CacheEntry *tail;        // Least recently used
+    size_t bytes;
+    size_t capacity;
+    int entries;
+    unsigned long long evictions;
+} CacheShard;
+
+static CacheShard cache_shards[CACHE_SHARDS];
+
+// Marks a deleted slot so probe chains stay intact
+static CacheEntry cache_tombstone;
+#define TOMBSTONE (&cache_tombstone)
+
+// FNV-1a
+static unsigned long long hash_filename(const char *filename) {
+    unsigned long long hash = 14695981039346656037ULL;
+    while (*filename) {
+        hash ^= (unsigned char)*filename++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Allocate a blob with room for size body bytes followed by extra bytes
+// (prebuilt headers) in the same allocation
+CacheBlob *blob_alloc(size_t size, size_t extra) {
+    CacheBlob *blob = malloc(sizeof(CacheBlob) + size + extra);
+    if (!blob) return NULL;
+    
+    blob->refcount = 1;
+    blob->size = size;
+    blob->total_size = size + extra;
+    memset(blob->header, 0, sizeof(blob->header));
+    memset(blob->header_len, 0, sizeof(blob->header_len));
+    blob->etag[0] = '\0';
+    blob->mtime = 0;
+    blob->encoding = ENCODING_IDENTITY;
+    return blob;
+}
+
+void blob_retain(CacheBlob *blob) {
+    __atomic_fetch_add(&blob->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void blob_release(CacheBlob *blob) {
+    if (__atomic_sub_fetch(&blob->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(blob);
+    }
+}
+
+// Pick the best encoding the client accepts. Brotli beats gzip beats
+// identity, which is always present.
+CacheBlob *select_variant(CacheBlob *variants[ENCODING_COUNT], int accept_encoding) {
+    if (variants[ENCODING_BROTLI] && (accept_encoding & (1 << ENCODING_BROTLI))) {
+        return variants[ENCODING_BROTLI];
+    }
+    if (variants[ENCODING_GZIP] && (accept_encoding & (1 << ENCODING_GZIP))) {
+        return variants[ENCODING_GZIP];
+    }
+    return variants[ENCODING_IDENTITY];
+}
+
+static size_t variants_size(CacheBlob *variants[ENCODING_COUNT]) {
+    size_t total = 0;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        if (variants[i]) {
+            total += variants[i]->total_size;
         }
-        curr = curr->next;
     }
+    return total;
+}
+
+static CacheShard *shard_for(unsigned long long hash) {
+    // High bits pick the shard, low bits pick the slot inside it
+    return &cache_shards[(hash >> 56) % CACHE_SHARDS];
+}
+
+void cache_init(size_t capacity_bytes) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache_shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->slots = NULL;
+        shard->num_slots = shard->used_slots = 0;
+        shard->head = shard->tail = NULL;
+        shard->bytes = 0;
+        shard->capacity = capacity_bytes / CACHE_SHARDS;
+        shard->entries = 0;
+        shard->evictions = 0;
+    }
+}
+
+// Returns the slot holding filename, or NULL
+static CacheEntry **find_slot(CacheShard *shard, const char *filename, unsigned long long hash) {
+    if (!shard->slots) return NULL;
     
-    pthread_mutex_unlock(&cache_mutex);
-    return NULL;
+    size_t mask = shard->num_slots - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        CacheEntry *entry = shard->slots[i];
+        if (!entry) return NULL;
+        if (entry != TOMBSTONE && entry->hash == hash && strcmp(entry->filename, filename) == 0) {
+            return &shard->slots[i];
+        }
+    }
 }
 
-void add_to_cache(const char *filename, const char *data, size_t size) {
-    pthread_mutex_lock(&cache_mutex);
+static void insert_slot(CacheShard *shard, CacheEntry *entry) {
+    size_t mask = shard->num_slots - 1;
+    size_t i = entry->hash & mask;
+    while (shard->slots[i] && shard->slots[i] != TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (!shard->slots[i]) {
+        shard->used_slots++;
+    }
+    shard->slots[i] = entry;
+}
+
+// Grow (or just clean out tombstones) once the table is 3/4 full
+static int ensure_capacity(CacheShard *shard) {
+    if (shard->slots && (shard->used_slots + 1) * 4 <= shard->num_slots * 3) {
+        return 0;
+    }
     
-    // Check if we need to remove LRU entry
-    if (cache_size >= MAX_CACHE_SIZE) {
-        remove_lru_entry();
+    size_t new_size = 64;
+    while (new_size < (size_t)(shard->entries + 1) * 2) {
+        new_size *= 2;
+    }
+    
+    CacheEntry **new_slots = calloc(new_size, sizeof(CacheEntry *));
+    if (!new_slots) return -1;
+    
+    free(shard->slots);
+    shard->slots = new_slots;
+    shard->num_slots = new_size;
+    shard->used_slots = 0;
+    
+    for (CacheEntry *curr = shard->head; curr; curr = curr->next) {
+        insert_slot(shard, curr);
+    }
+    return 0;
+}
+
+static void move_to_front(CacheShard *shard, CacheEntry *entry) {
+    if (entry == shard->head) return;
+    
+    // Remove from current position
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        shard->tail = entry->prev;
+    }
+    
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    }
+    
+    // Move to front
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head) {
+        shard->head->prev = entry;
+    }
+    shard->head = entry;
+    
+    if (!shard->tail) {
+        shard->tail = entry;
+    }
+}
+
+static void release_entry_variants(CacheEntry *entry) {
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        if (entry->variants[i]) {
+            blob_release(entry->variants[i]);
+            entry->variants[i] = NULL;
+        }
+    }
+}
+
+// Take an entry out of the index and the LRU list and free it. Requests
+// still sending its blobs keep them alive until they finish.
+static void remove_entry(CacheShard *shard, CacheEntry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        shard->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        shard->tail = entry->prev;
+    }
+    
+    CacheEntry **slot = find_slot(shard, entry->filename, entry->hash);
+    if (slot) {
+        *slot = TOMBSTONE;
+    }
+    
+    shard->bytes -= entry->size;
+    shard->entries--;
+    release_entry_variants(entry);
+    free(entry);
+}
+
+static void remove_lru_entry(CacheShard *shard) {
+    CacheEntry *lru = shard->tail;
+    if (!lru) return;
+    
+    log_debug("Evicting '%s' from cache", lru->filename);
+    shard->evictions++;
+    remove_entry(shard, lru);
+}
+
+// Returns the cached variant best matching accept_encoding, pinned for the
+// caller, who must blob_release() it
+CacheBlob *cache_lookup(const char *filename, int accept_encoding) {
+    unsigned long long hash = hash_filename(filename);
+    CacheShard *shard = shard_for(hash);
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    CacheEntry **slot = find_slot(shard, filename, hash);
+    if (!slot) {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    
+    CacheEntry *entry = *slot;
+    entry->last_accessed = time(NULL);
+    move_to_front(shard, entry);
+    CacheBlob *blob = select_variant(entry->variants, accept_encoding);
+    blob_retain(blob);
+    
+    pthread_mutex_unlock(&shard->lock);
+    return blob;
+}
+
+// Adopt every encoding of a file into the cache. The cache takes its own
+// references, the caller keeps theirs. Older entries are evicted to make
+// room only if evict is set. Returns 1 if the file is cached, 0 if it
+// does not fit.
+static int insert_entry(const char *filename, CacheBlob *variants[ENCODING_COUNT], int evict) {
+    size_t size = variants_size(variants);
+    unsigned long long hash = hash_filename(filename);
+    CacheShard *shard = shard_for(hash);
+    
+    if (size > shard->capacity || strlen(filename) >= MAX_FILENAME) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    // Another worker may have filled it while we were reading the file
+    if (find_slot(shard, filename, hash)) {
+        pthread_mutex_unlock(&shard->lock);
+        return 1;
+    }
+    
+    if (!evict && shard->bytes + size > shard->capacity) {
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    
+    // Evict least recently used entries until the new file fits
+    while (shard->bytes + size > shard->capacity) {
+        remove_lru_entry(shard);
+    }
+    
+    if (ensure_capacity(shard) < 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
     }
     
     // Create new entry
     CacheEntry *entry = malloc(sizeof(CacheEntry));
     if (!entry) {
-        pthread_mutex_unlock(&cache_mutex);
-        return;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
     }
     
     strcpy(entry->filename, filename);
-    entry->content = malloc(size);
-    if (!entry->content) {
-        free(entry);
-        pthread_mutex_unlock(&cache_mutex);
-        return;
-    }
-    
-    memcpy(entry->content, data, size);
+    entry->hash = hash;
     entry->size = size;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        entry->variants[i] = variants[i];
+        if (variants[i]) {
+            blob_retain(variants[i]);
+        }
+    }
     entry->last_accessed = time(NULL);
     entry->prev = NULL;
-    entry->next = cache_head;
+    entry->next = shard->head;
     
     // Insert at head
-    if (cache_head) {
-        cache_head->prev = entry;
+    if (shard->head) {
+        shard->head->prev = entry;
     } else {
-        cache_tail = entry;
+        shard->tail = entry;
     }
-    cache_head = entry;
-    cache_size++;
+    shard->head = entry;
+    insert_slot(shard, entry);
+    shard->bytes += size;
+    shard->entries++;
     
-    printf("Added '%s' to cache (size: %zu bytes)\n", filename, size);
-    pthread_mutex_unlock(&cache_mutex);
+    log_debug("Added '%s' to cache (size: %zu bytes)", filename, size);
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+int cache_insert(const char *filename, CacheBlob *variants[ENCODING_COUNT]) {
+    return insert_entry(filename, variants, 1);
+}
+
+// Like cache_insert(), but only into free space: used by the startup
+// warm-up, where files loaded earlier are the more important ones
+int cache_preload(const char *filename, CacheBlob *variants[ENCODING_COUNT]) {
+    return insert_entry(filename, variants, 0);
 }
 
-void remove_lru_entry() {
-    if (!cache_tail) return;
+int cache_contains(const char *filename) {
+    unsigned long long hash = hash_filename(filename);
+    CacheShard *shard = shard_for(hash);
     
-    CacheEntry *lru = cache_tail;
+    pthread_mutex_lock(&shard->lock);
+    int found = find_slot(shard, filename, hash) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+// Drop a file from the cache. Returns 1 if it was cached.
+int cache_remove(const char *filename) {
+    unsigned long long hash = hash_filename(filename);
+    CacheShard *shard = shard_for(hash);
     
-    if (lru->prev) {
-        lru->prev->next = NULL;
-        cache_tail = lru->prev;
-    } else {
-        cache_head = cache_tail = NULL;
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry **slot = find_slot(shard, filename, hash);
+    if (slot) {
+        remove_entry(shard, *slot);
     }
-    
-    printf("Evicting '%s' from cache\n", lru->filename);
-    free(lru->content);
-    free(lru);
-    cache_size--;
+    pthread_mutex_unlock(&shard->lock);
+    return slot != NULL;
 }
 
-void move_to_front(CacheEntry *entry) {
-    if (entry == cache_head) return;
+// Swap in a new version of a cached file. Readers see either the old or
+// the new blobs, never a mix. Returns 1 if the file was cached and has
+// been replaced, 0 if it was not cached (or no longer fits and was
+// dropped).
+int cache_replace(const char *filename, CacheBlob *variants[ENCODING_COUNT]) {
+    size_t size = variants_size(variants);
+    unsigned long long hash = hash_filename(filename);
+    CacheShard *shard = shard_for(hash);
     
-    // Remove from current position
-    if (entry->next) {
-        entry->next->prev = entry->prev;
-    } else {
-        cache_tail = entry->prev;
+    pthread_mutex_lock(&shard->lock);
+    
+    CacheEntry **slot = find_slot(shard, filename, hash);
+    if (!slot) {
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
     }
     
-    if (entry->prev) {
-        entry->prev->next = entry->next;
+    CacheEntry *entry = *slot;
+    if (size > shard->capacity) {
+        remove_entry(shard, entry);
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
     }
     
-    // Move to front
-    entry->prev = NULL;
-    entry->next = cache_head;
-    if (cache_head) {
-        cache_head->prev = entry;
+    release_entry_variants(entry);
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        entry->variants[i] = variants[i];
+        if (variants[i]) {
+            blob_retain(variants[i]);
+        }
+    }
+    shard->bytes = shard->bytes - entry->size + size;
+    entry->size = size;
+    move_to_front(shard, entry);
+    
+    // A grown file may push older entries out
+    while (shard->bytes > shard->capacity && shard->tail != entry) {
+        remove_lru_entry(shard);
     }
-    cache_head = entry;
     
-    if (!cache_tail) {
-        cache_tail = entry;
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+// Largest file a shard will accept
+size_t cache_max_entry_size() {
+    return cache_shards[0].capacity;
+}
+
+int cache_entry_count() {
+    int total = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache_shards[i].lock);
+        total += cache_shards[i].entries;
+        pthread_mutex_unlock(&cache_shards[i].lock);
+    }
+    return total;
+}
+
+size_t cache_capacity() {
+    return cache_shards[0].capacity * CACHE_SHARDS;
+}
+
+unsigned long long cache_eviction_count() {
+    unsigned long long total = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache_shards[i].lock);
+        total += cache_shards[i].evictions;
+        pthread_mutex_unlock(&cache_shards[i].lock);
     }
-}
\ No newline at end of file
+    return total;
+}
+
+size_t cache_bytes_used() {
+    size_t total = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache_shards[i].lock);
+        total += cache_shards[i].bytes;
+        pthread_mutex_unlock(&cache_shards[i].lock);
+    }
+    return total;
+}
+
+void cache_destroy() {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        
+        CacheEntry *curr = shard->head;
+        while (curr) {
+            CacheEntry *next = curr->next;
+            release_entry_variants(curr);
+            free(curr);
+            curr = next;
+        }
+        free(shard->slots);
+        shard->slots = NULL;
+        shard->num_slots = shard->used_slots = 0;
+        shard->head = shard->tail = NULL;
+        shard->bytes = 0;
+        shard->entries = 0;
+        
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,273 @@
+#include "server.h"
+#include <sys/sendfile.h>
+
+// Maximum segments gathered into one sendmsg() call
+#define FLUSH_IOV_MAX 16
+
+void conn_init(Connection *conn, int fd, int nonblocking) {
+    conn->fd = fd;
+    conn->nonblocking = nonblocking;
+    conn->deferred = 0;
+    conn->in_len = 0;
+    http_parser_init(&conn->parser);
+    conn->out.data = NULL;
+    conn->out.len = conn->out.cap = 0;
+    conn->segments = NULL;
+    conn->num_segments = conn->segment_cap = 0;
+    conn->segment_pos = 0;
+    conn->segment_sent = 0;
+    conn->close_after_write = 0;
+    conn->requests_served = 0;
+    conn->bytes_out = 0;
+    strcpy(conn->peer, "-");
+    conn->last_active = time(NULL);
+    conn->prev = conn->next = NULL;
+}
+
+static void release_segment(OutputSegment *seg) {
+    if (seg->blob) {
+        blob_release(seg->blob);
+    }
+    if (seg->file_fd >= 0) {
+        close(seg->file_fd);
+    }
+}
+
+void conn_free(Connection *conn) {
+    // Unpin anything that never made it onto the wire
+    for (int i = conn->segment_pos; i < conn->num_segments; i++) {
+        release_segment(&conn->segments[i]);
+    }
+    free(conn->segments);
+    conn->segments = NULL;
+    conn->num_segments = conn->segment_cap = 0;
+    conn->segment_pos = 0;
+    conn->segment_sent = 0;
+    buffer_free(&conn->out);
+}
+
+int conn_has_pending_output(Connection *conn) {
+    return conn->segment_pos < conn->num_segments;
+}
+
+static OutputSegment *new_segment(Connection *conn) {
+    if (conn->num_segments == conn->segment_cap) {
+        int new_cap = conn->segment_cap ? conn->segment_cap * 2 : 4;
+        OutputSegment *segments = realloc(conn->segments, new_cap * sizeof(OutputSegment));
+        if (!segments) return NULL;
+        conn->segments = segments;
+        conn->segment_cap = new_cap;
+    }
+    
+    OutputSegment *seg = &conn->segments[conn->num_segments];
+    seg->blob = NULL;
+    seg->data = NULL;
+    seg->offset = 0;
+    seg->file_fd = -1;
+    seg->file_offset = 0;
+    seg->len = 0;
+    return seg;
+}
+
+static int push_segment(Connection *conn, CacheBlob *blob, const char *data, size_t len) {
+    // An empty segment would never be popped: sending it makes no progress
+    if (len == 0) return 0;
+    
+    // Consecutive copied bytes just grow the previous buffer segment
+    if (!blob && conn->num_segments > conn->segment_pos) {
+        OutputSegment *last = &conn->segments[conn->num_segments - 1];
+        if (!last->blob && last->file_fd < 0 && last->offset + last->len == conn->out.len) {
+            if (buffer_append(&conn->out, data, len) < 0) return -1;
+            last->len += len;
+            return 0;
+        }
+    }
+    
+    OutputSegment *seg = new_segment(conn);
+    if (!seg) return -1;
+    seg->blob = blob;
+    seg->len = len;
+    
+    if (blob) {
+        blob_retain(blob);
+        seg->data = data;
+    } else {
+        seg->offset = conn->out.len;
+        if (buffer_append(&conn->out, data, len) < 0) return -1;
+    }
+    
+    conn->num_segments++;
+    return 0;
+}
+
+static const char *segment_data(Connection *conn, OutputSegment *seg) {
+    return seg->blob ? seg->data : conn->out.data + seg->offset;
+}
+
+// Send directly while nothing is queued. Returns how many bytes the
+// socket accepted, or -1 on error.
+static ssize_t send_now(Connection *conn, const char *data, size_t len) {
+    size_t total = 0;
+    
+    while (total < len) {
+        ssize_t sent = send(conn->fd, data + total, len - total, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (conn->nonblocking) break;
+                continue;
+            }
+            return -1;
+        }
+        total += sent;
+    }
+    
+    return total;
+}
+
+// Drop `sent` bytes from the front of the queue, releasing whatever the
+// completed segments held, including any with nothing left at sent == 0.
+// Once everything is out the queue is reused for the next response.
+void conn_advance(Connection *conn, size_t sent) {
+    while (conn->segment_pos < conn->num_segments) {
+        OutputSegment *seg = &conn->segments[conn->segment_pos];
+        size_t left = seg->len - conn->segment_sent;
+        if (sent < left) {
+            conn->segment_sent += sent;
+            return;
+        }
+        sent -= left;
+        release_segment(seg);
+        conn->segment_pos++;
+        conn->segment_sent = 0;
+    }
+    
+    if (conn->segment_pos == conn->num_segments) {
+        conn->num_segments = 0;
+        conn->segment_pos = 0;
+        conn->segment_sent = 0;
+        conn->out.len = 0;
+    }
+}
+
+// Point iov at the queued memory segments, up to the first file segment.
+// Returns how many entries were filled (0 if a file segment is next) and
+// sets *more if a file segment follows them.
+int conn_gather(Connection *conn, struct iovec *iov, int max_iov, int *more) {
+    int iovcnt = 0;
+    *more = 0;
+    
+    for (int i = conn->segment_pos; i < conn->num_segments && iovcnt < max_iov; i++) {
+        OutputSegment *next = &conn->segments[i];
+        if (next->file_fd >= 0) {
+            *more = 1;
+            break;
+        }
+        size_t skip = (i == conn->segment_pos) ? conn->segment_sent : 0;
+        iov[iovcnt].iov_base = (char *)segment_data(conn, next) + skip;
+        iov[iovcnt].iov_len = next->len - skip;
+        iovcnt++;
+    }
+    return iovcnt;
+}
+
+// Write as much of the queued output as the socket accepts. Memory
+// segments are gathered into one sendmsg() call, file segments go out with
+// sendfile(). Returns 1 when everything has been sent, 0 if the socket
+// would block (epoll mode, or always for deferred connections, whose
+// output the io_uring loop sends) and -1 on error.
+int conn_flush(Connection *conn) {
+    if (conn->deferred) {
+        return conn_has_pending_output(conn) ? 0 : 1;
+    }
+    
+    while (conn->segment_pos < conn->num_segments) {
+        OutputSegment *seg = &conn->segments[conn->segment_pos];
+        ssize_t sent;
+        
+        if (seg->file_fd >= 0) {
+            off_t offset = seg->file_offset + conn->segment_sent;
+            sent = sendfile(conn->fd, seg->file_fd, &offset, seg->len - conn->segment_sent);
+            if (sent == 0) {
+                return -1;  // File shrank under us, Content-Length can't be met
+            }
+        } else {
+            // Hold the header back for the file data that follows it
+            struct iovec iov[FLUSH_IOV_MAX];
+            int more;
+            int iovcnt = conn_gather(conn, iov, FLUSH_IOV_MAX, &more);
+            
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            
+            sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        }
+        
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (conn->nonblocking) return 0;
+                continue;
+            }
+            return -1;
+        }
+        
+        conn_advance(conn, sent);
+    }
+    
+    return 1;
+}
+
+// Queue bytes without sending them yet, so they can be combined with
+// what follows. The caller is expected to conn_flush().
+int conn_queue(Connection *conn, const void *data, size_t len) {
+    conn->bytes_out += len;
+    return push_segment(conn, NULL, data, len);
+}
+
+// Queue len bytes of an open file starting at offset. The connection owns
+// fd from here on and closes it once the data is sent.
+int conn_queue_file(Connection *conn, int fd, off_t offset, size_t len) {
+    // sendfile() returns 0 for an empty range, which looks like a truncated file
+    if (len == 0) {
+        close(fd);
+        return 0;
+    }
+    
+    OutputSegment *seg = new_segment(conn);
+    if (!seg) {
+        close(fd);
+        return -1;
+    }
+    
+    conn->bytes_out += len;
+    seg->file_fd = fd;
+    seg->file_offset = offset;
+    seg->len = len;
+    conn->num_segments++;
+    return 0;
+}
+
+int conn_send(Connection *conn, const void *data, size_t len) {
+    conn->bytes_out += len;
+    
+    // Keep ordering: if older output is still queued, append behind it
+    if (!conn_has_pending_output(conn) && !conn->deferred) {
+        ssize_t sent = send_now(conn, data, len);
+        if (sent < 0) return -1;
+        data = (const char *)data + sent;
+        len -= sent;
+    }
+    
+    if (len == 0) return 0;
+    return push_segment(conn, NULL, data, len);
+}
+
+// Queue part of a blob by reference, pinning it until it has been sent.
+// The caller is expected to conn_flush().
+int conn_queue_blob(Connection *conn, CacheBlob *blob, const char *data, size_t len) {
+    conn->bytes_out += len;
+    return push_segment(conn, blob, data, len);
+}
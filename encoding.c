@@ -0,0 +1,101 @@
+#include "server.h"
+#include <zlib.h>
+
+// Content-Encoding token and precompressed sibling extension per encoding
+static const char *encoding_names[ENCODING_COUNT] = { "identity", "gzip", "br" };
+static const char *encoding_extensions[ENCODING_COUNT] = { "", ".gz", ".br" };
+
+const char *encoding_name(int encoding) {
+    return encoding_names[encoding];
+}
+
+const char *encoding_extension(int encoding) {
+    return encoding_extensions[encoding];
+}
+
+// Text formats worth compressing; images are already compressed
+int is_compressible(const char *content_type) {
+    return strncmp(content_type, "text/", 5) == 0 ||
+           strcmp(content_type, "application/javascript") == 0 ||
+           strcmp(content_type, "application/json") == 0;
+}
+
+// Turn an Accept-Encoding header into a bitmask of (1 << ENCODING_*).
+// Identity is always acceptable; codings with q=0 are excluded.
+int parse_accept_encoding(const char *value, size_t len) {
+    int mask = 1 << ENCODING_IDENTITY;
+    const char *p = value;
+    const char *end = value + len;
+    
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) p++;
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ') p++;
+        size_t token_len = p - token;
+        
+        // Look for a q=0 parameter before the next coding
+        int rejected = 0;
+        while (p < end && *p != ',') {
+            if (*p == 'q' && end - p > 2 && p[1] == '=') {
+                // The value is not NUL-terminated, so copy the qvalue out
+                char qvalue[8];
+                size_t qlen = 0;
+                while (p + 2 + qlen < end && qlen < sizeof(qvalue) - 1 &&
+                       p[2 + qlen] != ',' && p[2 + qlen] != ' ') {
+                    qvalue[qlen] = p[2 + qlen];
+                    qlen++;
+                }
+                qvalue[qlen] = '\0';
+                rejected = strtod(qvalue, NULL) == 0.0;
+            }
+            p++;
+        }
+        if (rejected || token_len == 0) continue;
+        
+        for (int i = ENCODING_IDENTITY + 1; i < ENCODING_COUNT; i++) {
+            if (strlen(encoding_names[i]) == token_len &&
+                strncasecmp(token, encoding_names[i], token_len) == 0) {
+                mask |= 1 << i;
+            }
+        }
+        if (token_len == 1 && *token == '*') {
+            mask |= (1 << ENCODING_COUNT) - 1;
+        }
+    }
+    
+    return mask;
+}
+
+// Gzip data into a newly malloc'd buffer. Returns NULL on failure.
+char *gzip_compress(const char *data, size_t size, size_t *out_size) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    
+    // windowBits 15 + 16 selects the gzip wrapper instead of raw zlib
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    
+    size_t bound = deflateBound(&stream, size);
+    char *out = malloc(bound);
+    if (!out) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = size;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = bound;
+    
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        free(out);
+        return NULL;
+    }
+    
+    *out_size = stream.total_out;
+    deflateEnd(&stream);
+    return out;
+}
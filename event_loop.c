@@ -0,0 +1,294 @@
+#include "server.h"
+
+// One epoll reactor per CPU. Each loop owns its own SO_REUSEPORT listener,
+// so the kernel spreads new connections across loops and no thread ever
+// blocks on a single client.
+typedef struct {
+    int id;
+    int port;
+    int listen_fd;
+    int epoll_fd;
+    time_t now;
+    Connection *idle_head;   // least recently active connection
+    Connection *idle_tail;
+} EventLoop;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int create_listener(int port, int reuseport) {
+    struct sockaddr_in server_addr;
+    
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt failed");
+        close(fd);
+        return -1;
+    }
+    
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT failed");
+        close(fd);
+        return -1;
+    }
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(fd);
+        return -1;
+    }
+    
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("Listen failed");
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+// Connections are kept in last-activity order, so the idle sweep only has
+// to look at the head of the list
+static void idle_list_remove(EventLoop *loop, Connection *conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->idle_head = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    } else {
+        loop->idle_tail = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+}
+
+static void idle_list_append(EventLoop *loop, Connection *conn) {
+    conn->prev = loop->idle_tail;
+    conn->next = NULL;
+    if (loop->idle_tail) {
+        loop->idle_tail->next = conn;
+    } else {
+        loop->idle_head = conn;
+    }
+    loop->idle_tail = conn;
+}
+
+static void touch_connection(EventLoop *loop, Connection *conn) {
+    conn->last_active = loop->now;
+    if (loop->idle_tail != conn) {
+        idle_list_remove(loop, conn);
+        idle_list_append(loop, conn);
+    }
+}
+
+static void close_connection(EventLoop *loop, Connection *conn) {
+    idle_list_remove(loop, conn);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn_free(conn);
+    free(conn);
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+static void accept_connections(EventLoop *loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_sock = accept4(loop->listen_fd, (struct sockaddr *)&client_addr,
+                                  &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && server_running) {
+                perror("Accept failed");
+            }
+            return;
+        }
+        
+        Connection *conn = malloc(sizeof(Connection));
+        if (!conn) {
+            close(client_sock);
+            continue;
+        }
+        conn_init(conn, client_sock, 1);
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->peer, sizeof(conn->peer));
+        log_debug("New client connected: %s:%d (socket %d, loop %d)", conn->peer,
+                  ntohs(client_addr.sin_port), client_sock, loop->id);
+        
+        // Edge-triggered: we are told once per readiness change, so every
+        // handler below drains the socket until EAGAIN
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close(client_sock);
+            free(conn);
+            continue;
+        }
+        conn->last_active = loop->now;
+        idle_list_append(loop, conn);
+        __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Read until the socket is drained or the input buffer is full.
+// Returns the number of bytes read, or -1 on error.
+static int fill_input(Connection *conn, int *peer_closed) {
+    int total = 0;
+    
+    while (conn->in_len < BUFFER_SIZE - 1) {
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+                         BUFFER_SIZE - 1 - conn->in_len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        if (n == 0) {
+            *peer_closed = 1;
+            break;
+        }
+        conn->in_len += n;
+        total += n;
+    }
+    
+    return total;
+}
+
+static void handle_event(EventLoop *loop, Connection *conn, uint32_t events) {
+    if (events & EPOLLERR) {
+        close_connection(loop, conn);
+        return;
+    }
+    
+    touch_connection(loop, conn);
+    
+    // Alternate between flushing, reading and serving until the socket
+    // would block in both directions. A full input buffer stops reading
+    // without EAGAIN, so we come back for the rest once it has been served.
+    while (1) {
+        int flushed = conn_flush(conn);
+        if (flushed < 0) break;
+        if (flushed == 0) return;   // Resume on EPOLLOUT
+        if (conn->close_after_write) break;
+        
+        int peer_closed = 0;
+        int bytes_read = fill_input(conn, &peer_closed);
+        if (bytes_read < 0) break;
+        
+        // A half-closed client still gets answers to what it already sent
+        int served = process_requests(conn);
+        if (served == 0 && !conn->close_after_write) {
+            if (peer_closed || (events & EPOLLHUP)) break;
+            if (bytes_read == 0 || conn->in_len < BUFFER_SIZE - 1) return;
+        }
+    }
+    
+    close_connection(loop, conn);
+}
+
+// Close connections that have been idle (or stalled writing) too long
+static void sweep_idle_connections(EventLoop *loop) {
+    while (loop->idle_head &&
+           loop->now - loop->idle_head->last_active >= KEEPALIVE_TIMEOUT) {
+        close_connection(loop, loop->idle_head);
+    }
+}
+
+void *event_loop_thread(void *arg) {
+    EventLoop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    
+    printf("Event loop %d started (listener %d)\n", loop->id, loop->listen_fd);
+    
+    while (server_running) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        
+        loop->now = time(NULL);
+        
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(loop);
+            } else {
+                handle_event(loop, events[i].data.ptr, events[i].events);
+            }
+        }
+        
+        sweep_idle_connections(loop);
+    }
+    
+    printf("Event loop %d stopping\n", loop->id);
+    close(loop->listen_fd);
+    close(loop->epoll_fd);
+    free(loop);
+    return NULL;
+}
+
+int start_event_loops(int port, int num_loops, int pin_loops, pthread_t *threads) {
+    for (int i = 0; i < num_loops; i++) {
+        EventLoop *loop = malloc(sizeof(EventLoop));
+        if (!loop) return -1;
+        
+        loop->id = i;
+        loop->port = port;
+        loop->now = time(NULL);
+        loop->idle_head = loop->idle_tail = NULL;
+        loop->listen_fd = create_listener(port, 1);
+        if (loop->listen_fd < 0) {
+            free(loop);
+            return -1;
+        }
+        set_nonblocking(loop->listen_fd);
+        
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            close(loop->listen_fd);
+            free(loop);
+            return -1;
+        }
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;  // NULL marks the listener
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev);
+        
+        if (pthread_create(&threads[i], NULL, event_loop_thread, loop) != 0) {
+            perror("Failed to create event loop thread");
+            close(loop->listen_fd);
+            close(loop->epoll_fd);
+            free(loop);
+            return -1;
+        }
+        
+        // Keep each loop on its own core so its connections stay cache-warm
+        if (pin_loops) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % CPU_SETSIZE, &cpus);
+            pthread_setaffinity_np(threads[i], sizeof(cpus), &cpus);
+        }
+    }
+    
+    return 0;
+}
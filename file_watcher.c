@@ -0,0 +1,163 @@
+#include "server.h"
+#include <sys/inotify.h>
+#include <limits.h>
+
+// Keeps the cache in step with the files on disk. Every directory that
+// holds a cached file is watched with inotify: deleted or moved-away files
+// are dropped from the cache, and files that were rewritten or moved into
+// place are reloaded here, off the request path, then swapped in whole.
+// Plain IN_MODIFY is ignored so a half-written file is never cached; the
+// old version keeps being served until the writer closes it.
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+#define MAX_WATCHES 256
+
+typedef struct {
+    int wd;
+    char dir[MAX_FILENAME];  // "" for the document root
+} Watch;
+
+static int inotify_fd = -1;
+static Watch watches[MAX_WATCHES];
+static int num_watches = 0;
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static Watch *find_watch_by_dir(const char *dir) {
+    for (int i = 0; i < num_watches; i++) {
+        if (strcmp(watches[i].dir, dir) == 0) {
+            return &watches[i];
+        }
+    }
+    return NULL;
+}
+
+// Start watching the directory that holds filename (a path relative to
+// the document root), if it is not watched already
+void watch_cached_file(const char *filename) {
+    if (inotify_fd < 0) return;
+    
+    char dir[MAX_FILENAME] = "";
+    const char *slash = strrchr(filename, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - filename), filename);
+    }
+    
+    pthread_mutex_lock(&watch_mutex);
+    
+    if (!find_watch_by_dir(dir) && num_watches < MAX_WATCHES) {
+        int wd = inotify_add_watch(inotify_fd, dir[0] ? dir : ".", WATCH_MASK);
+        if (wd < 0) {
+            perror("inotify_add_watch failed");
+        } else {
+            watches[num_watches].wd = wd;
+            strcpy(watches[num_watches].dir, dir);
+            num_watches++;
+        }
+    }
+    
+    pthread_mutex_unlock(&watch_mutex);
+}
+
+// Reload every encoding of a cached file and swap the new version in.
+// Files that are no longer cached are left alone.
+static void refresh_file(const char *filename) {
+    if (!cache_contains(filename)) return;
+    
+    CacheBlob *variants[ENCODING_COUNT];
+    if (load_file_variants(filename, variants) < 0) {
+        cache_remove(filename);
+        return;
+    }
+    
+    if (cache_replace(filename, variants)) {
+        log_info("Refreshed '%s' in cache", filename);
+    }
+    release_variants(variants);
+}
+
+static void handle_watch_event(const struct inotify_event *event) {
+    if (event->len == 0) return;
+    
+    char dir[MAX_FILENAME];
+    pthread_mutex_lock(&watch_mutex);
+    Watch *watch = NULL;
+    for (int i = 0; i < num_watches; i++) {
+        if (watches[i].wd == event->wd) {
+            watch = &watches[i];
+            break;
+        }
+    }
+    if (watch) {
+        strcpy(dir, watch->dir);
+    }
+    pthread_mutex_unlock(&watch_mutex);
+    if (!watch) return;
+    
+    char filename[MAX_FILENAME];
+    int len = snprintf(filename, sizeof(filename), "%s%s%s", dir, dir[0] ? "/" : "", event->name);
+    if (len < 0 || len >= MAX_FILENAME) return;
+    
+    // A changed .gz/.br sibling changes what we serve for the original
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODING_COUNT; i++) {
+        size_t ext_len = strlen(encoding_extension(i));
+        if ((size_t)len > ext_len && strcmp(filename + len - ext_len, encoding_extension(i)) == 0) {
+            filename[len - ext_len] = '\0';
+            refresh_file(filename);
+            return;
+        }
+    }
+    
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (cache_remove(filename)) {
+            log_info("Invalidated '%s' in cache", filename);
+        }
+    } else {
+        refresh_file(filename);
+    }
+}
+
+void *file_watcher_thread(void *arg) {
+    (void)arg; // Suppress unused parameter warning
+    // Large enough for many events with maximum-length names
+    char events[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    
+    while (server_running) {
+        // Wake up regularly to notice shutdown
+        struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, 1000);
+        if (ready <= 0) continue;
+        
+        ssize_t n = read(inotify_fd, events, sizeof(events));
+        if (n <= 0) continue;
+        
+        for (char *p = events; p < events + n; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            handle_watch_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    
+    close(inotify_fd);
+    inotify_fd = -1;
+    return NULL;
+}
+
+// Returns 0 if the watcher is running, -1 if inotify is unavailable (the
+// server then runs without invalidation)
+int start_file_watcher(pthread_t *thread) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1 failed");
+        return -1;
+    }
+    
+    if (pthread_create(thread, NULL, file_watcher_thread, NULL) != 0) {
+        perror("Failed to create file watcher thread");
+        close(inotify_fd);
+        inotify_fd = -1;
+        return -1;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,315 @@
+#include "server.h"
+#include <stddef.h>
+
+// Incremental HTTP/1.x request parser. It works directly on the
+// connection's input buffer: nothing is copied except the method, path and
+// protocol, and every header is recorded as a slice of the buffer. Each
+// call picks up at the first line it has not finished yet, so a request
+// arriving a few bytes at a time is scanned once rather than from the
+// start on every read. Malformed or oversized requests stop the parser
+// with the status code to answer them with.
+
+#define PARSE_REQUEST_LINE 0
+#define PARSE_HEADERS 1
+#define PARSE_BODY 2
+#define PARSE_DONE 3
+#define PARSE_ERROR 4
+
+// RFC 9110 token characters, used for methods and header names. The
+// upper half of the table (bytes >= 0x80) is all zero.
+static const unsigned char token_chars[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+};
+
+#define is_token_char(c) token_chars[(unsigned char)(c)]
+
+void http_parser_init(HttpParser *parser) {
+    parser->state = PARSE_REQUEST_LINE;
+    parser->pos = 0;
+    parser->body_len = 0;
+    parser->error_status = 0;
+    
+    // headers[] is filled up to num_headers, so it need not be cleared
+    HttpRequest *req = &parser->req;
+    memset(req, 0, offsetof(HttpRequest, headers));
+    memset(&req->num_headers, 0, sizeof(*req) - offsetof(HttpRequest, num_headers));
+}
+
+static int parse_error(HttpParser *parser, int status) {
+    parser->state = PARSE_ERROR;
+    parser->error_status = status;
+    return -1;
+}
+
+// Case-insensitive comparison of a slice with a string
+int slice_equals(Slice slice, const char *str) {
+    return strlen(str) == slice.len && strncasecmp(slice.data, str, slice.len) == 0;
+}
+
+// Whether a comma-separated header value such as "Connection: keep-alive,
+// Upgrade" lists token, ignoring case, whitespace and ;parameters
+int slice_contains_token(Slice slice, const char *token) {
+    const char *p = slice.data;
+    const char *end = slice.data + slice.len;
+    
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *start = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        
+        Slice item = { start, p - start };
+        if (item.len > 0 && slice_equals(item, token)) return 1;
+        while (p < end && *p != ',') p++;
+    }
+    return 0;
+}
+
+// Find the end of the line starting at p. Returns the offset of the '\n',
+// or -1 if it has not arrived yet. glibc's memchr() is vectorised, which
+// makes it the fastest way through long header lines.
+static ssize_t find_line_end(const char *buf, size_t pos, size_t len) {
+    const char *eol = memchr(buf + pos, '\n', len - pos);
+    return eol ? eol - buf : -1;
+}
+
+// Strip the optional CR before the LF (a bare LF is tolerated)
+static size_t line_length(const char *buf, size_t start, size_t eol) {
+    return (eol > start && buf[eol - 1] == '\r') ? eol - 1 - start : eol - start;
+}
+
+// "GET /path?query HTTP/1.1"
+static int parse_request_line(HttpParser *parser, const char *line, size_t len) {
+    HttpRequest *req = &parser->req;
+    const char *end = line + len;
+    const char *p = line;
+    
+    // Method
+    while (p < end && is_token_char(*p)) p++;
+    size_t method_len = p - line;
+    if (method_len == 0 || method_len >= sizeof(req->method) || p == end || *p != ' ') {
+        return parse_error(parser, 400);
+    }
+    memcpy(req->method, line, method_len);
+    req->method[method_len] = '\0';
+    
+    // Request target
+    const char *target = ++p;
+    while (p < end && *p != ' ') {
+        unsigned char c = *p;
+        if (c < 0x21 || c == 0x7f) return parse_error(parser, 400);
+        p++;
+    }
+    const char *target_end = p;
+    if (target == target_end || p == end) return parse_error(parser, 400);
+    
+    // Absolute form (as sent to proxies): drop the scheme and authority
+    if (target_end - target > 7 && strncasecmp(target, "http://", 7) == 0) {
+        target += 7;
+        while (target < target_end && *target != '/') target++;
+        if (target == target_end) {
+            target = "/";
+            target_end = target + 1;
+        }
+    } else if (*target != '/' && !(target_end - target == 1 && *target == '*')) {
+        return parse_error(parser, 400);
+    }
+    
+    const char *query = memchr(target, '?', target_end - target);
+    const char *path_end = query ? query : target_end;
+    if ((size_t)(path_end - target) >= sizeof(req->path)) {
+        return parse_error(parser, 414);
+    }
+    // Repeated slashes are merged, so "//etc/passwd" can't turn into an
+    // absolute file name once the router strips the leading one
+    size_t path_len = 0;
+    for (const char *c = target; c < path_end; c++) {
+        if (*c == '/' && path_len > 0 && req->path[path_len - 1] == '/') continue;
+        req->path[path_len++] = *c;
+    }
+    req->path[path_len] = '\0';
+    if (query) {
+        req->query.data = query + 1;
+        req->query.len = target_end - query - 1;
+    }
+    
+    // Protocol version
+    const char *version = p + 1;
+    size_t version_len = end - version;
+    if (version_len != 8 || strncmp(version, "HTTP/", 5) != 0 || version[6] != '.' ||
+        version[5] < '0' || version[5] > '9' || version[7] < '0' || version[7] > '9') {
+        return parse_error(parser, 400);
+    }
+    if (version[5] != '1' || (version[7] != '0' && version[7] != '1')) {
+        return parse_error(parser, 505);
+    }
+    memcpy(req->protocol, version, version_len);
+    req->protocol[version_len] = '\0';
+    
+    // HTTP/1.1 defaults to persistent connections, HTTP/1.0 must ask for it
+    req->keep_alive = version[7] == '1';
+    return 0;
+}
+
+// Record a header the server acts on. Repeats of list-valued headers
+// keep the first value; repeats that would make the request ambiguous
+// are rejected.
+static int store_known_header(HttpParser *parser, Slice name, Slice value) {
+    HttpRequest *req = &parser->req;
+    Slice *slot = NULL;
+    
+    switch (name.len) {
+    case 4:
+        if (slice_equals(name, "Host")) {
+            if (req->host.data) return parse_error(parser, 400);
+            slot = &req->host;
+        }
+        break;
+    case 5:
+        if (slice_equals(name, "Range")) slot = &req->range;
+        break;
+    case 6:
+        if (slice_equals(name, "Accept")) slot = &req->accept;
+        break;
+    case 8:
+        if (slice_equals(name, "If-Range")) slot = &req->if_range;
+        break;
+    case 10:
+        if (slice_equals(name, "Connection")) slot = &req->connection;
+        break;
+    case 13:
+        if (slice_equals(name, "If-None-Match")) slot = &req->if_none_match;
+        break;
+    case 14:
+        if (slice_equals(name, "Content-Length")) {
+            // Digits only, and repeats must agree, or framing is ambiguous
+            size_t body_len = 0;
+            if (value.len == 0 || value.len > 9) return parse_error(parser, value.len ? 413 : 400);
+            for (size_t i = 0; i < value.len; i++) {
+                if (value.data[i] < '0' || value.data[i] > '9') return parse_error(parser, 400);
+                body_len = body_len * 10 + (value.data[i] - '0');
+            }
+            if (parser->body_len && parser->body_len != body_len) return parse_error(parser, 400);
+            parser->body_len = body_len;
+        }
+        break;
+    case 15:
+        if (slice_equals(name, "Accept-Encoding")) slot = &req->accept_encoding;
+        break;
+    case 17:
+        if (slice_equals(name, "If-Modified-Since")) slot = &req->if_modified_since;
+        // Chunked bodies are not supported
+        if (slice_equals(name, "Transfer-Encoding")) return parse_error(parser, 501);
+        break;
+    }
+    
+    if (slot && !slot->data) {
+        *slot = value;
+    }
+    return 0;
+}
+
+// "Name: value" with optional whitespace around the value
+static int parse_header_line(HttpParser *parser, const char *line, size_t len) {
+    HttpRequest *req = &parser->req;
+    const char *end = line + len;
+    const char *p = line;
+    
+    // The name must be followed directly by ':', which also rejects
+    // obsolete line folding (RFC 9112 section 5.2)
+    while (p < end && is_token_char(*p)) p++;
+    if (p == line || p == end || *p != ':') {
+        return parse_error(parser, 400);
+    }
+    Slice name = { line, p - line };
+    
+    p++;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    const char *value_end = end;
+    while (value_end > p && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+    for (const char *c = p; c < value_end; c++) {
+        if (((unsigned char)*c < 0x20 && *c != '\t') || *c == 0x7f) {
+            return parse_error(parser, 400);
+        }
+    }
+    Slice value = { p, value_end - p };
+    
+    if (req->num_headers == MAX_HEADERS) {
+        return parse_error(parser, 431);
+    }
+    req->headers[req->num_headers].name = name;
+    req->headers[req->num_headers].value = value;
+    req->num_headers++;
+    
+    return store_known_header(parser, name, value);
+}
+
+// Checks that need the whole header block
+static int finish_headers(HttpParser *parser) {
+    HttpRequest *req = &parser->req;
+    
+    if (req->keep_alive && !req->host.data) {
+        return parse_error(parser, 400);  // Host is mandatory in HTTP/1.1
+    }
+    
+    if (req->connection.data) {
+        if (slice_contains_token(req->connection, "close")) {
+            req->keep_alive = 0;
+        } else if (slice_contains_token(req->connection, "keep-alive")) {
+            req->keep_alive = 1;
+        }
+    }
+    
+    // The body must fit in the input buffer behind the headers
+    if (parser->body_len > BUFFER_SIZE - 1 - parser->pos) {
+        return parse_error(parser, 413);
+    }
+    req->length = parser->pos + parser->body_len;
+    return 0;
+}
+
+// Parse the request at the front of buf, which holds len bytes. Call again
+// with the same buffer after more bytes were appended. Returns 1 when the
+// request (headers plus any body) is complete, 0 when more bytes are
+// needed and -1 on a bad request, with parser->error_status set.
+int http_parse(HttpParser *parser, const char *buf, size_t len) {
+    while (parser->state == PARSE_REQUEST_LINE || parser->state == PARSE_HEADERS) {
+        ssize_t eol = find_line_end(buf, parser->pos, len);
+        if (eol < 0) {
+            // A line that cannot fit in the buffer will never complete
+            if (len >= BUFFER_SIZE - 1) {
+                return parse_error(parser, parser->state == PARSE_REQUEST_LINE ? 414 : 431);
+            }
+            return 0;
+        }
+        
+        size_t start = parser->pos;
+        size_t line_len = line_length(buf, start, eol);
+        parser->pos = eol + 1;
+        
+        if (parser->state == PARSE_REQUEST_LINE) {
+            // Empty lines before the request line are ignored
+            if (line_len == 0) continue;
+            if (parse_request_line(parser, buf + start, line_len) < 0) return -1;
+            parser->state = PARSE_HEADERS;
+        } else if (line_len == 0) {
+            if (finish_headers(parser) < 0) return -1;
+            parser->state = PARSE_BODY;
+        } else if (parse_header_line(parser, buf + start, line_len) < 0) {
+            return -1;
+        }
+    }
+    
+    if (parser->state == PARSE_BODY) {
+        if (len < parser->req.length) return 0;
+        parser->state = PARSE_DONE;
+    }
+    
+    return parser->state == PARSE_DONE ? 1 : -1;
+}
@@ -0,0 +1,360 @@
+#include "load_balancer.h"
+
+// Response micro-cache shared by every proxy loop. Cacheable GET 200s are
+// stored whole, keyed by path plus the Accept-Encoding the backends vary
+// on, and answered from memory until their max-age runs out. A stale
+// entry with an ETag or Last-Modified is revalidated: the next request for
+// it is forwarded as a conditional one, and a 304 from the backend renews
+// the entry and is answered from it. Shards are bounded by a byte budget
+// and evict least recently used entries.
+
+typedef struct {
+    pthread_mutex_t lock;
+    LbCacheEntry *buckets[LB_CACHE_BUCKETS];
+    LbCacheEntry *lru_head;   // Most recently used
+    LbCacheEntry *lru_tail;
+    size_t bytes;
+} LbCacheShard;
+
+static LbCacheShard *cache_shards;
+static size_t shard_budget;
+
+static long cache_hits;
+static long cache_misses;
+static long cache_revalidated;
+
+int lb_cache_init(size_t budget) {
+    if (budget == 0) return 0;
+    
+    cache_shards = calloc(LB_CACHE_SHARDS, sizeof(LbCacheShard));
+    if (!cache_shards) return -1;
+    
+    for (int i = 0; i < LB_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+    }
+    shard_budget = budget / LB_CACHE_SHARDS;
+    return 0;
+}
+
+int lb_cache_enabled() {
+    return cache_shards != NULL;
+}
+
+static uint64_t key_hash(const char *key, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int header_present(const char *head, size_t head_len, const char *name) {
+    const char *value;
+    size_t len;
+    return lb_find_header(head, head_len, name, &value, &len);
+}
+
+// Value of a `name=N` Cache-Control directive, or -1
+static long directive_seconds(const char *value, size_t len, const char *name) {
+    size_t name_len = strlen(name);
+    const char *end = value + len;
+    
+    for (const char *p = value; p + name_len < end; p++) {
+        if ((p == value || p[-1] == ',' || p[-1] == ' ') &&
+            strncasecmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            long seconds = 0;
+            const char *digit = p + name_len + 1;
+            if (digit == end || *digit < '0' || *digit > '9') return -1;
+            while (digit < end && *digit >= '0' && *digit <= '9' && seconds < 100000000) {
+                seconds = seconds * 10 + (*digit++ - '0');
+            }
+            return seconds;
+        }
+    }
+    return -1;
+}
+
+// Build the cache key for the request at head. Returns its length, or 0
+// if the request must go to a backend: anything but a plain GET, or one
+// carrying credentials, ranges, its own validators or asking not to be
+// served from a cache.
+int lb_cache_request_key(const char *head, const LbRequest *req, char *key, size_t size) {
+    const char *value;
+    size_t len;
+    
+    if (strcmp(req->method, "GET") != 0 || req->length != req->head_len) return 0;
+    
+    static const char *bypass[] = {
+        "Authorization", "Range", "If-None-Match", "If-Modified-Since",
+        "If-Match", "If-Unmodified-Since", "If-Range"
+    };
+    for (size_t i = 0; i < sizeof(bypass) / sizeof(bypass[0]); i++) {
+        if (header_present(head, req->head_len, bypass[i])) return 0;
+    }
+    if (lb_find_header(head, req->head_len, "Cache-Control", &value, &len) &&
+        (lb_header_has_token(value, len, "no-cache") || lb_header_has_token(value, len, "no-store"))) {
+        return 0;
+    }
+    if (lb_find_header(head, req->head_len, "Pragma", &value, &len) &&
+        lb_header_has_token(value, len, "no-cache")) {
+        return 0;
+    }
+    
+    // Backends vary on Accept-Encoding, so it is part of the key verbatim
+    if (!lb_find_header(head, req->head_len, "Accept-Encoding", &value, &len)) {
+        value = "";
+        len = 0;
+    }
+    int key_len = snprintf(key, size, "%s\n%.*s", req->path, (int)len, value);
+    return key_len > 0 && (size_t)key_len < size ? key_len : 0;
+}
+
+// How long the response at head may be served from the cache, or -1 if
+// it must not be stored (RFC 9111 section 3, for a shared cache)
+long lb_cache_response_ttl(const char *head, const LbResponse *resp) {
+    const char *value;
+    size_t len;
+    
+    if (resp->status != 200 || !resp->has_body || resp->until_close) return -1;
+    if (resp->head_len + resp->content_length > LB_CACHE_MAX_OBJECT) return -1;
+    if (resp->head_len + LB_CACHE_HEAD_ROOM > LB_BUFFER_SIZE) return -1;
+    if (header_present(head, resp->head_len, "Set-Cookie")) return -1;
+    
+    if (lb_find_header(head, resp->head_len, "Vary", &value, &len)) {
+        // Only Accept-Encoding is part of the key
+        for (const char *p = value; p < value + len; ) {
+            while (p < value + len && (*p == ' ' || *p == ',')) p++;
+            const char *start = p;
+            while (p < value + len && *p != ',' && *p != ' ') p++;
+            if (p > start && !((size_t)(p - start) == 15 && strncasecmp(start, "Accept-Encoding", 15) == 0)) {
+                return -1;
+            }
+        }
+    }
+    
+    long seconds = -1;
+    if (lb_find_header(head, resp->head_len, "Cache-Control", &value, &len)) {
+        if (lb_header_has_token(value, len, "no-store") || lb_header_has_token(value, len, "private") ||
+            lb_header_has_token(value, len, "no-cache")) {
+            return -1;
+        }
+        seconds = directive_seconds(value, len, "s-maxage");
+        if (seconds < 0) seconds = directive_seconds(value, len, "max-age");
+    }
+    
+    if (seconds > 0) return seconds * 1000000000L;
+    if (seconds < 0 && header_present(head, resp->head_len, "Last-Modified")) {
+        return LB_CACHE_HEURISTIC_TTL_NS;
+    }
+    return -1;
+}
+
+static void free_entry(LbCacheEntry *entry) {
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+}
+
+void lb_cache_release(LbCacheEntry *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_entry(entry);
+    }
+}
+
+int lb_cache_fresh(LbCacheEntry *entry, long now) {
+    long stored = __atomic_load_n(&entry->stored_ns, __ATOMIC_RELAXED);
+    return now - stored < __atomic_load_n(&entry->ttl_ns, __ATOMIC_RELAXED);
+}
+
+// Returns a referenced entry, or NULL. Fresh entries count as hits;
+// missing and stale ones as misses.
+LbCacheEntry *lb_cache_lookup(const char *key, size_t key_len) {
+    uint64_t hash = key_hash(key, key_len);
+    LbCacheShard *shard = &cache_shards[hash % LB_CACHE_SHARDS];
+    LbCacheEntry *entry;
+    
+    pthread_mutex_lock(&shard->lock);
+    for (entry = shard->buckets[(hash / LB_CACHE_SHARDS) % LB_CACHE_BUCKETS]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            break;
+        }
+    }
+    
+    if (entry) {
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+        
+        // Move to the front of the LRU list
+        if (entry != shard->lru_head) {
+            entry->lru_prev->lru_next = entry->lru_next;
+            if (entry->lru_next) {
+                entry->lru_next->lru_prev = entry->lru_prev;
+            } else {
+                shard->lru_tail = entry->lru_prev;
+            }
+            entry->lru_prev = NULL;
+            entry->lru_next = shard->lru_head;
+            shard->lru_head->lru_prev = entry;
+            shard->lru_head = entry;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    
+    if (entry && lb_cache_fresh(entry, lb_now_ns())) {
+        __atomic_add_fetch(&cache_hits, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED);
+    }
+    return entry;
+}
+
+// Start capturing a response of size bytes. Takes ownership of key.
+LbCacheEntry *lb_cache_entry_new(char *key, size_t key_len, size_t size, long ttl_ns) {
+    LbCacheEntry *entry = calloc(1, sizeof(LbCacheEntry));
+    if (!entry) {
+        free(key);
+        return NULL;
+    }
+    
+    entry->data = malloc(size);
+    if (!entry->data) {
+        free(key);
+        free(entry);
+        return NULL;
+    }
+    entry->key = key;
+    entry->key_len = key_len;
+    entry->hash = key_hash(key, key_len);
+    entry->size = size;
+    entry->ttl_ns = ttl_ns;
+    entry->refs = 1;
+    return entry;
+}
+
+void lb_cache_capture(LbCacheEntry *entry, const char *data, size_t len) {
+    if (len > entry->size - entry->filled) len = entry->size - entry->filled;
+    memcpy(entry->data + entry->filled, data, len);
+    entry->filled += len;
+}
+
+static void unlink_entry(LbCacheShard *shard, LbCacheEntry *entry) {
+    LbCacheEntry **link = &shard->buckets[(entry->hash / LB_CACHE_SHARDS) % LB_CACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    
+    shard->bytes -= entry->size + entry->key_len;
+    lb_cache_release(entry);
+}
+
+// The conditional header line that revalidates this response, preferring
+// the ETag
+static void set_validator(LbCacheEntry *entry) {
+    const char *value;
+    size_t len;
+    
+    entry->validator[0] = '\0';
+    if (lb_find_header(entry->data, entry->head_len, "ETag", &value, &len) &&
+        len + 20 < sizeof(entry->validator)) {
+        snprintf(entry->validator, sizeof(entry->validator), "If-None-Match: %.*s\r\n", (int)len, value);
+    } else if (lb_find_header(entry->data, entry->head_len, "Last-Modified", &value, &len) &&
+               len + 24 < sizeof(entry->validator)) {
+        snprintf(entry->validator, sizeof(entry->validator), "If-Modified-Since: %.*s\r\n", (int)len, value);
+    }
+}
+
+// Store a completely captured response, replacing any entry for its key.
+// The caller's reference passes to the cache.
+void lb_cache_insert(LbCacheEntry *entry) {
+    const char *head_end = memmem(entry->data, entry->filled, "\r\n\r\n", 4);
+    if (entry->filled != entry->size || !head_end) {
+        lb_cache_release(entry);
+        return;
+    }
+    entry->head_len = head_end + 4 - entry->data;
+    
+    // Persistence is between the client and us, not part of the response
+    static const char *hop_by_hop[] = {"Connection", "Keep-Alive"};
+    for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++) {
+        size_t removed = lb_strip_header(entry->data, entry->size, entry->head_len, hop_by_hop[i]);
+        entry->head_len -= removed;
+        entry->size -= removed;
+    }
+    entry->filled = entry->size;
+    entry->stored_ns = lb_now_ns();
+    set_validator(entry);
+    
+    LbCacheShard *shard = &cache_shards[entry->hash % LB_CACHE_SHARDS];
+    size_t bytes = entry->size + entry->key_len;
+    if (bytes > shard_budget) {
+        lb_cache_release(entry);
+        return;
+    }
+    
+    pthread_mutex_lock(&shard->lock);
+    LbCacheEntry **bucket = &shard->buckets[(entry->hash / LB_CACHE_SHARDS) % LB_CACHE_BUCKETS];
+    for (LbCacheEntry *old = *bucket; old; old = old->hash_next) {
+        if (old->hash == entry->hash && old->key_len == entry->key_len &&
+            memcmp(old->key, entry->key, entry->key_len) == 0) {
+            unlink_entry(shard, old);
+            break;
+        }
+    }
+    
+    while (shard->bytes + bytes > shard_budget && shard->lru_tail) {
+        unlink_entry(shard, shard->lru_tail);
+    }
+    
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+    if (!shard->lru_tail) shard->lru_tail = entry;
+    shard->bytes += bytes;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// The backend answered a revalidation with 304: the entry is fresh again,
+// for the max-age the 304 gives or else as long as before
+void lb_cache_refresh(LbCacheEntry *entry, const char *head, size_t head_len) {
+    const char *value;
+    size_t len;
+    
+    if (lb_find_header(head, head_len, "Cache-Control", &value, &len)) {
+        long seconds = directive_seconds(value, len, "s-maxage");
+        if (seconds < 0) seconds = directive_seconds(value, len, "max-age");
+        if (seconds > 0) {
+            __atomic_store_n(&entry->ttl_ns, seconds * 1000000000L, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&entry->stored_ns, lb_now_ns(), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cache_revalidated, 1, __ATOMIC_RELAXED);
+}
+
+void lb_cache_print_stats() {
+    if (!lb_cache_enabled()) return;
+    
+    size_t bytes = 0;
+    for (int i = 0; i < LB_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache_shards[i].lock);
+        bytes += cache_shards[i].bytes;
+        pthread_mutex_unlock(&cache_shards[i].lock);
+    }
+    printf("Cache: %ld hits - %ld misses - %ld revalidated - %zu of %zu bytes\n",
+           __atomic_load_n(&cache_hits, __ATOMIC_RELAXED),
+           __atomic_load_n(&cache_misses, __ATOMIC_RELAXED),
+           __atomic_load_n(&cache_revalidated, __ATOMIC_RELAXED),
+           bytes, shard_budget * LB_CACHE_SHARDS);
+}
@@ -0,0 +1,211 @@
+#include "load_balancer.h"
+
+// Backend health. Active probes send GET LB_HEALTH_PATH to every backend
+// at once each HEALTH_CHECK_INTERVAL, so a backend that accepts
+// connections but answers with errors, or not at all, is taken out of
+// rotation. Between probes the proxy loops report how each request went;
+// a backend that keeps failing or stalling is ejected for a while, for
+// longer each time it happens again.
+
+char lb_health_path[LB_MAX_PATH] = LB_HEALTH_PATH;
+
+// Probe states
+#define PROBE_CONNECTING 0
+#define PROBE_READING 1
+#define PROBE_DONE 2
+
+typedef struct {
+    int fd;
+    int state;
+    int healthy;
+    int status;
+    char response[32];        // Enough for the status line
+    size_t response_len;
+} Probe;
+
+static void finish_probe(Probe *probe, int healthy) {
+    if (probe->fd >= 0) close(probe->fd);
+    probe->fd = -1;
+    probe->state = PROBE_DONE;
+    probe->healthy = healthy;
+}
+
+static void start_probe(Probe *probe, int idx) {
+    memset(probe, 0, sizeof(Probe));
+    probe->state = PROBE_CONNECTING;
+    probe->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (probe->fd < 0) {
+        finish_probe(probe, 0);
+        return;
+    }
+    
+    if (connect(probe->fd, (struct sockaddr *)&backends[idx].addr, sizeof(backends[idx].addr)) < 0 &&
+        errno != EINPROGRESS) {
+        finish_probe(probe, 0);
+    }
+}
+
+// The socket is writable: the connect finished, one way or the other
+static void send_probe(Probe *probe, int idx) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        finish_probe(probe, 0);
+        return;
+    }
+    
+    char request[LB_MAX_PATH + 128];
+    int request_len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s:%d\r\n"
+        "User-Agent: load-balancer-health-check\r\n"
+        "Connection: close\r\n"
+        "\r\n", lb_health_path, backends[idx].host, backends[idx].port);
+    
+    // A fresh socket buffer always takes a request this small in one go
+    if (send(probe->fd, request, request_len, MSG_NOSIGNAL) != request_len) {
+        finish_probe(probe, 0);
+        return;
+    }
+    probe->state = PROBE_READING;
+}
+
+static void read_probe(Probe *probe) {
+    ssize_t n = recv(probe->fd, probe->response + probe->response_len,
+                     sizeof(probe->response) - 1 - probe->response_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        finish_probe(probe, 0);
+        return;
+    }
+    
+    probe->response_len += n;
+    probe->response[probe->response_len] = '\0';
+    if (probe->response_len < 12) return;  // "HTTP/1.1 200"
+    
+    if (strncmp(probe->response, "HTTP/1.", 7) != 0) {
+        finish_probe(probe, 0);
+        return;
+    }
+    probe->status = atoi(probe->response + 9);
+    finish_probe(probe, probe->status >= 200 && probe->status < 400);
+}
+
+void health_check_backends() {
+    Probe probes[MAX_BACKENDS];
+    struct pollfd fds[MAX_BACKENDS];
+    int owner[MAX_BACKENDS];
+    
+    printf("Performing health check on backends...\n");
+    
+    for (int i = 0; i < num_backends; i++) {
+        start_probe(&probes[i], i);
+    }
+    
+    // Run every probe concurrently until all finish or the round times out
+    long deadline = lb_now_ns() + HEALTH_CHECK_TIMEOUT_MS * 1000000L;
+    while (1) {
+        int nfds = 0;
+        for (int i = 0; i < num_backends; i++) {
+            if (probes[i].state == PROBE_DONE) continue;
+            fds[nfds].fd = probes[i].fd;
+            fds[nfds].events = probes[i].state == PROBE_CONNECTING ? POLLOUT : POLLIN;
+            fds[nfds].revents = 0;
+            owner[nfds++] = i;
+        }
+        
+        long remaining_ms = (deadline - lb_now_ns()) / 1000000L;
+        if (nfds == 0 || remaining_ms <= 0) break;
+        
+        int ready = poll(fds, nfds, remaining_ms);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("Health check poll failed");
+            break;
+        }
+        
+        for (int n = 0; n < nfds; n++) {
+            Probe *probe = &probes[owner[n]];
+            if (!fds[n].revents) continue;
+            if (probe->state == PROBE_CONNECTING) {
+                send_probe(probe, owner[n]);
+            } else {
+                read_probe(probe);
+            }
+        }
+    }
+    
+    for (int i = 0; i < num_backends; i++) {
+        if (probes[i].state != PROBE_DONE) {
+            finish_probe(&probes[i], 0);  // Timed out
+        }
+        
+        __atomic_store_n(&backends[i].active, probes[i].healthy, __ATOMIC_RELAXED);
+        
+        // A backend that got through a whole interval without failures
+        // earns back one step of its ejection backoff
+        int failures = __atomic_exchange_n(&backends[i].failures_since_check, 0, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&backend_mutex);
+        if (failures == 0 && backends[i].ejections > 0 &&
+            lb_now_ns() >= backends[i].ejected_until_ns) {
+            backends[i].ejections--;
+        }
+        pthread_mutex_unlock(&backend_mutex);
+        
+        if (probes[i].status) {
+            printf("Backend %s:%d is %s (%d)\n", backends[i].host, backends[i].port,
+                   probes[i].healthy ? "UP" : "DOWN", probes[i].status);
+        } else {
+            printf("Backend %s:%d is %s\n", backends[i].host, backends[i].port,
+                   probes[i].healthy ? "UP" : "DOWN");
+        }
+    }
+}
+
+// Passive outlier detection. Called by the proxy loops with the outcome
+// of each request: a response head in reasonable time that is not a 5xx
+// is a success; connect failures, resets, malformed and slow responses are
+// failures.
+void backend_report_result(int idx, int ok) {
+    Backend *backend = &backends[idx];
+    
+    if (ok) {
+        if (__atomic_load_n(&backend->consecutive_failures, __ATOMIC_RELAXED) != 0) {
+            __atomic_store_n(&backend->consecutive_failures, 0, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    
+    __atomic_add_fetch(&backend->failures_since_check, 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&backend->consecutive_failures, 1, __ATOMIC_RELAXED) < LB_EJECT_FAILURES) {
+        return;
+    }
+    
+    pthread_mutex_lock(&backend_mutex);
+    long now = lb_now_ns();
+    int ejected = 0;
+    for (int i = 0; i < num_backends; i++) {
+        if (now < backends[i].ejected_until_ns) ejected++;
+    }
+    
+    // Already out, or ejecting it would leave too few backends to serve
+    if (now < backend->ejected_until_ns ||
+        (ejected + 1) * 100 > num_backends * LB_EJECT_MAX_PERCENT) {
+        pthread_mutex_unlock(&backend_mutex);
+        return;
+    }
+    
+    long duration = LB_EJECT_BASE_NS;
+    for (int i = 0; i < backend->ejections && duration < LB_EJECT_MAX_NS; i++) {
+        duration *= 2;
+    }
+    if (duration > LB_EJECT_MAX_NS) duration = LB_EJECT_MAX_NS;
+    
+    backend->ejections++;
+    __atomic_store_n(&backend->ejected_until_ns, now + duration, __ATOMIC_RELAXED);
+    __atomic_store_n(&backend->consecutive_failures, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&backend_mutex);
+    
+    printf("Ejecting backend %s:%d for %ld s after %d consecutive failures\n",
+           backend->host, backend->port, duration / 1000000000L, LB_EJECT_FAILURES);
+}
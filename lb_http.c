@@ -0,0 +1,219 @@
+#include "load_balancer.h"
+
+// Just enough HTTP/1.x for the proxy: where a request or response ends,
+// whether the connection stays open, and the method and path to route on.
+// Header values are looked at in place; nothing is rewritten.
+
+// Find header `name` (case-insensitive) between the first line and the
+// blank line of a message head. Returns 1 and points *value at it.
+int lb_find_header(const char *head, size_t head_len, const char *name,
+                   const char **value, size_t *value_len) {
+    size_t name_len = strlen(name);
+    const char *end = head + head_len;
+    const char *line = memchr(head, '\n', head_len);
+    
+    while (line && ++line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) break;
+        
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0) {
+            const char *v = line + name_len + 1;
+            const char *v_end = eol;
+            while (v < v_end && (*v == ' ' || *v == '\t')) v++;
+            while (v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' ' || v_end[-1] == '\t')) v_end--;
+            *value = v;
+            *value_len = v_end - v;
+            return 1;
+        }
+        line = eol;
+    }
+    return 0;
+}
+
+// Remove every `name` header line from a message head held in a buffer of
+// buf_len bytes, moving what follows down. Returns the bytes removed.
+size_t lb_strip_header(char *buf, size_t buf_len, size_t head_len, const char *name) {
+    size_t name_len = strlen(name);
+    size_t removed = 0;
+    char *line = memchr(buf, '\n', head_len);
+    
+    while (line && ++line < buf + head_len - removed) {
+        char *eol = memchr(line, '\n', buf + head_len - removed - line);
+        if (!eol) break;
+        
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0) {
+            size_t line_len = eol + 1 - line;
+            memmove(line, eol + 1, buf + buf_len - removed - (eol + 1));
+            removed += line_len;
+            line--;
+            continue;
+        }
+        line = eol;
+    }
+    return removed;
+}
+
+// Whether a comma-separated header value lists token
+int lb_header_has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    const char *end = value + len;
+    
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == ',')) value++;
+        const char *start = value;
+        while (value < end && *value != ',' && *value != ' ' && *value != ';') value++;
+        if ((size_t)(value - start) == token_len && strncasecmp(start, token, token_len) == 0) {
+            return 1;
+        }
+        while (value < end && *value != ',') value++;
+    }
+    return 0;
+}
+
+// Decimal Content-Length. Returns -1 if it is not a plain number.
+static int parse_length(const char *value, size_t len, unsigned long long *out) {
+    unsigned long long result = 0;
+    if (len == 0 || len > 18) return -1;
+    
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') return -1;
+        result = result * 10 + (value[i] - '0');
+    }
+    *out = result;
+    return 0;
+}
+
+// Persistence per RFC 9112 section 9.3: HTTP/1.1 stays open unless told
+// otherwise, HTTP/1.0 only when asked
+static int message_keep_alive(const char *head, size_t head_len, int http11) {
+    const char *value;
+    size_t len;
+    
+    if (lb_find_header(head, head_len, "Connection", &value, &len)) {
+        if (lb_header_has_token(value, len, "close")) return 0;
+        if (lb_header_has_token(value, len, "keep-alive")) return 1;
+    }
+    return http11;
+}
+
+const char *lb_status_reason(int status) {
+    switch (status) {
+    case 400: return "Bad Request";
+    case 413: return "Content Too Large";
+    case 414: return "URI Too Long";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Internal Server Error";
+    }
+}
+
+static int request_error(LbRequest *req, int status) {
+    req->error_status = status;
+    return -1;
+}
+
+// Parse the request at the front of buf. Returns 1 once the head and any
+// body are buffered, 0 if more bytes are needed and -1 if the request
+// cannot be proxied, with req->error_status set.
+int lb_parse_request(const char *buf, size_t len, LbRequest *req) {
+    req->error_status = 0;
+    
+    const char *head_end = memmem(buf, len, "\r\n\r\n", 4);
+    if (!head_end) {
+        return len >= LB_BUFFER_SIZE ? request_error(req, 431) : 0;
+    }
+    req->head_len = head_end + 4 - buf;
+    
+    // Request line: METHOD SP target SP HTTP/1.x
+    const char *line_end = memchr(buf, '\r', req->head_len);
+    const char *method_end = memchr(buf, ' ', line_end - buf);
+    if (!method_end || method_end == buf || (size_t)(method_end - buf) >= sizeof(req->method)) {
+        return request_error(req, 400);
+    }
+    const char *target = method_end + 1;
+    const char *target_end = memchr(target, ' ', line_end - target);
+    if (!target_end || target_end == target) {
+        return request_error(req, 400);
+    }
+    if ((size_t)(target_end - target) >= sizeof(req->path)) {
+        return request_error(req, 414);
+    }
+    const char *version = target_end + 1;
+    if (line_end - version != 8 || strncmp(version, "HTTP/1.", 7) != 0) {
+        return request_error(req, 505);
+    }
+    
+    memcpy(req->method, buf, method_end - buf);
+    req->method[method_end - buf] = '\0';
+    memcpy(req->path, target, target_end - target);
+    req->path[target_end - target] = '\0';
+    req->http11 = version[7] == '1';
+    req->keep_alive = message_keep_alive(buf, req->head_len, req->http11);
+    
+    // Bodies are buffered whole before the request is forwarded, so chunked
+    // uploads (unbounded) are refused
+    const char *value;
+    size_t value_len;
+    unsigned long long body_len = 0;
+    if (lb_find_header(buf, req->head_len, "Transfer-Encoding", &value, &value_len)) {
+        return request_error(req, 501);
+    }
+    if (lb_find_header(buf, req->head_len, "Content-Length", &value, &value_len) &&
+        parse_length(value, value_len, &body_len) < 0) {
+        return request_error(req, 400);
+    }
+    if (body_len > LB_BUFFER_SIZE - req->head_len) {
+        return request_error(req, 413);
+    }
+    
+    req->length = req->head_len + body_len;
+    return len >= req->length ? 1 : 0;
+}
+
+// Parse the head of a backend response. Returns 1 once the head is
+// complete, 0 if more bytes are needed and -1 if it is malformed.
+int lb_parse_response(const char *buf, size_t len, const LbRequest *req, LbResponse *resp) {
+    const char *head_end = memmem(buf, len, "\r\n\r\n", 4);
+    if (!head_end) {
+        return len >= LB_BUFFER_SIZE ? -1 : 0;
+    }
+    resp->head_len = head_end + 4 - buf;
+    
+    // Status line: HTTP/1.x SP 3DIGIT SP reason
+    if (resp->head_len < 13 || strncmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ') {
+        return -1;
+    }
+    resp->status = atoi(buf + 9);
+    if (resp->status < 100 || resp->status > 999) {
+        return -1;
+    }
+    resp->keep_alive = message_keep_alive(buf, resp->head_len, buf[7] == '1');
+    
+    // Framing per RFC 9112 section 6.3
+    const char *value;
+    size_t value_len;
+    resp->until_close = 0;
+    resp->content_length = 0;
+    resp->has_body = !(strcmp(req->method, "HEAD") == 0 || resp->status < 200 ||
+                       resp->status == 204 || resp->status == 304);
+    if (!resp->has_body) {
+        return 1;
+    }
+    
+    if (lb_find_header(buf, resp->head_len, "Transfer-Encoding", &value, &value_len) ||
+        !lb_find_header(buf, resp->head_len, "Content-Length", &value, &value_len)) {
+        // Relayed as is until the backend closes; the client connection
+        // cannot be reused after that
+        resp->until_close = 1;
+        resp->keep_alive = 0;
+    } else if (parse_length(value, value_len, &resp->content_length) < 0) {
+        return -1;
+    }
+    return 1;
+}
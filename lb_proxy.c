@@ -0,0 +1,1026 @@
+#include "load_balancer.h"
+
+// Event-driven proxy core. One epoll loop per CPU, each with its own
+// SO_REUSEPORT listener, serves every client connection it accepts
+// without a thread per client. A complete request is read from the client,
+// routed to a backend and written to it over a keep-alive connection taken
+// from that loop's pool (or a new non-blocking connect()), then the
+// response is relayed back. Response heads and small bodies are copied
+// through the client's buffer; large bodies are spliced from the backend
+// socket into a pipe and from the pipe to the client, so their bytes never
+// reach user space. Backend connections go back into the pool
+// when the response ends cleanly, so steady traffic reuses a handful of
+// connections instead of opening one per request.
+//
+// Connections are edge-triggered. Any event on a client or on the backend
+// serving it runs client_pump(), which keeps moving bytes in every
+// direction until nothing more can be done without blocking.
+
+typedef struct {
+    BackendConn *head;       // Most recently used first
+    int count;
+} BackendPool;
+
+typedef struct {
+    int id;
+    int listen_fd;
+    int epoll_fd;
+    time_t now;
+    ClientConn *clients;     // Every open client, for the timeout sweep
+    BackendPool pools[MAX_BACKENDS];
+    LbPipe spare_pipes[LB_SPARE_PIPES];
+    int num_spare_pipes;
+    
+    // Closed connections are freed only after the current batch of epoll
+    // events, which may still point at them
+    ClientConn *dead_clients;
+    BackendConn *dead_backends;
+} LbLoop;
+
+static void set_nodelay(int fd) {
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
+
+static int create_listener(int port) {
+    struct sockaddr_in lb_addr;
+    
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Load balancer socket creation failed");
+        return -1;
+    }
+    
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt failed");
+        close(fd);
+        return -1;
+    }
+    
+    memset(&lb_addr, 0, sizeof(lb_addr));
+    lb_addr.sin_family = AF_INET;
+    lb_addr.sin_addr.s_addr = INADDR_ANY;
+    lb_addr.sin_port = htons(port);
+    
+    if (bind(fd, (struct sockaddr *)&lb_addr, sizeof(lb_addr)) < 0) {
+        perror("Load balancer bind failed");
+        close(fd);
+        return -1;
+    }
+    
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("Load balancer listen failed");
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+static int watch_fd(LbLoop *loop, int fd, void *conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// ---- Backend connections ----
+
+static void pool_remove(LbLoop *loop, BackendConn *bconn) {
+    BackendPool *pool = &loop->pools[bconn->backend];
+    if (bconn->prev) {
+        bconn->prev->next = bconn->next;
+    } else {
+        pool->head = bconn->next;
+    }
+    if (bconn->next) {
+        bconn->next->prev = bconn->prev;
+    }
+    bconn->prev = bconn->next = NULL;
+    pool->count--;
+}
+
+static void close_backend(LbLoop *loop, BackendConn *bconn) {
+    close(bconn->fd);  // Also drops it from the epoll set
+    bconn->fd = -1;
+    bconn->client = NULL;
+    bconn->next = loop->dead_backends;
+    loop->dead_backends = bconn;
+}
+
+// Start a non-blocking connect to backend idx
+static BackendConn *open_backend(LbLoop *loop, int idx) {
+    BackendConn *bconn = calloc(1, sizeof(BackendConn));
+    if (!bconn) return NULL;
+    
+    bconn->type = LB_CONN_BACKEND;
+    bconn->backend = idx;
+    bconn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (bconn->fd < 0) {
+        perror("Backend socket creation failed");
+        free(bconn);
+        return NULL;
+    }
+    set_nodelay(bconn->fd);
+    
+    if (connect(bconn->fd, (struct sockaddr *)&backends[idx].addr, sizeof(backends[idx].addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            close(bconn->fd);
+            free(bconn);
+            return NULL;
+        }
+        bconn->connecting = 1;
+    }
+    
+    if (watch_fd(loop, bconn->fd, bconn) < 0) {
+        close(bconn->fd);
+        free(bconn);
+        return NULL;
+    }
+    
+    __atomic_add_fetch(&backends[idx].connections_opened, 1, __ATOMIC_RELAXED);
+    return bconn;
+}
+
+// An idle pooled connection if there is one, otherwise a new connection
+static BackendConn *acquire_backend(LbLoop *loop, int idx) {
+    BackendPool *pool = &loop->pools[idx];
+    if (pool->head) {
+        BackendConn *bconn = pool->head;
+        pool_remove(loop, bconn);
+        bconn->reused = 1;
+        return bconn;
+    }
+    return open_backend(loop, idx);
+}
+
+// Give the client's current request to a backend connection
+static void attach_backend(ClientConn *client, BackendConn *bconn) {
+    bconn->client = client;
+    client->backend = bconn;
+    client->request_sent = 0;
+    client->dispatched_ns = lb_now_ns();
+    __atomic_add_fetch(&backends[bconn->backend].in_flight, 1, __ATOMIC_RELAXED);
+}
+
+// Detach a backend connection from its client, keeping it for the next
+// request when the exchange ended cleanly
+static void release_backend(LbLoop *loop, ClientConn *client, int reusable) {
+    BackendConn *bconn = client->backend;
+    BackendPool *pool = &loop->pools[bconn->backend];
+    client->backend = NULL;
+    bconn->client = NULL;
+    __atomic_sub_fetch(&backends[bconn->backend].in_flight, 1, __ATOMIC_RELAXED);
+    
+    if (!reusable || !lb_running || pool->count >= LB_POOL_SIZE) {
+        close_backend(loop, bconn);
+        return;
+    }
+    
+    bconn->idle_since = loop->now;
+    bconn->prev = NULL;
+    bconn->next = pool->head;
+    if (pool->head) pool->head->prev = bconn;
+    pool->head = bconn;
+    pool->count++;
+}
+
+// ---- Splice pipes ----
+
+// Give the client a pipe, reusing an empty one when the loop has one.
+// Returns -1 if no pipe could be made; the body is then copied instead.
+static int acquire_pipe(LbLoop *loop, ClientConn *client) {
+    if (loop->num_spare_pipes > 0) {
+        client->pipe = loop->spare_pipes[--loop->num_spare_pipes];
+        return 0;
+    }
+    
+    if (pipe2(client->pipe.fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        client->pipe.fds[0] = client->pipe.fds[1] = -1;
+        return -1;
+    }
+    
+    // Larger pipes mean fewer splice() calls per body; the default size
+    // stays if the system limit is lower
+    fcntl(client->pipe.fds[1], F_SETPIPE_SZ, LB_PIPE_SIZE);
+    int size = fcntl(client->pipe.fds[1], F_GETPIPE_SZ);
+    client->pipe.size = size > 0 ? (size_t)size : 65536;
+    return 0;
+}
+
+// Take back the client's pipe. One still holding bytes cannot be reused.
+static void release_pipe(LbLoop *loop, ClientConn *client) {
+    if (client->piped == 0 && loop->num_spare_pipes < LB_SPARE_PIPES) {
+        loop->spare_pipes[loop->num_spare_pipes++] = client->pipe;
+    } else {
+        close(client->pipe.fds[0]);
+        close(client->pipe.fds[1]);
+    }
+    client->pipe.fds[0] = client->pipe.fds[1] = -1;
+    client->piped = 0;
+}
+
+static unsigned long long response_length(ClientConn *client) {
+    return client->resp.head_len + (client->resp.has_body ? client->resp.content_length : 0);
+}
+
+// ---- Response cache ----
+
+// Forget what the cache was told about the current request
+static void drop_cache_state(ClientConn *client) {
+    free(client->cache_key);
+    client->cache_key = NULL;
+    if (client->capture) {
+        lb_cache_release(client->capture);
+        client->capture = NULL;
+    }
+    if (client->revalidating) {
+        lb_cache_release(client->revalidating);
+        client->revalidating = NULL;
+    }
+}
+
+// Insert a header line into the request at the front of client->in
+static int add_request_header(ClientConn *client, const char *line, size_t len) {
+    if (client->in_len + len > sizeof(client->in)) return -1;
+    
+    size_t at = client->req.head_len - 2;  // Before the blank line
+    memmove(client->in + at + len, client->in + at, client->in_len - at);
+    memcpy(client->in + at, line, len);
+    client->in_len += len;
+    client->req.head_len += len;
+    client->req.length += len;
+    return 0;
+}
+
+// Connection is hop-by-hop: the client's wishes for its own connection
+// are dropped from the forwarded head, and the backend is asked to keep
+// its connection open (HTTP/1.1 does by default) so it can be pooled
+static void prepare_request_head(ClientConn *client) {
+    static const char *const hop_by_hop[] = { "Connection", "Keep-Alive" };
+    
+    for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++) {
+        size_t removed = lb_strip_header(client->in, client->in_len, client->req.head_len,
+                                         hop_by_hop[i]);
+        client->in_len -= removed;
+        client->req.head_len -= removed;
+        client->req.length -= removed;
+    }
+    if (!client->req.http11) {
+        const char line[] = "Connection: keep-alive\r\n";
+        add_request_header(client, line, sizeof(line) - 1);
+    }
+}
+
+// The request at the front of client->in has been answered
+static void consume_request(ClientConn *client) {
+    client->in_len -= client->req.length;
+    memmove(client->in, client->in + client->req.length, client->in_len);
+    client->state = CLIENT_READING;
+    client->attempts = 0;
+}
+
+// Answer the request from a cached response: the head, with Age and
+// Connection headers (cached heads have none), goes through client->out
+// and the body straight from the entry. Takes over the caller's reference.
+static void serve_cached(ClientConn *client, LbCacheEntry *entry) {
+    long age = (lb_now_ns() - __atomic_load_n(&entry->stored_ns, __ATOMIC_RELAXED)) / 1000000000L;
+    size_t head_len = entry->head_len - 2;  // Up to the blank line
+    
+    memcpy(client->out, entry->data, head_len);
+    client->out_len = head_len + snprintf(client->out + head_len, sizeof(client->out) - head_len,
+                                          "Age: %ld\r\nConnection: %s\r\n\r\n", age,
+                                          client->req.keep_alive ? "keep-alive" : "close");
+    client->out_sent = 0;
+    client->cached = entry;
+    client->cached_sent = entry->head_len;
+    client->close_after_response = !client->req.keep_alive;
+    consume_request(client);
+}
+
+// Answer from the cache if it holds a fresh response. Otherwise keep the
+// key so the response can be stored, and make the request conditional if
+// a stale copy can be revalidated. Returns 1 if the request was answered.
+static int lookup_cached(ClientConn *client) {
+    char key[LB_MAX_PATH + 256];
+    int key_len = lb_cache_request_key(client->in, &client->req, key, sizeof(key));
+    if (key_len == 0) return 0;
+    
+    LbCacheEntry *entry = lb_cache_lookup(key, key_len);
+    if (entry && lb_cache_fresh(entry, lb_now_ns())) {
+        serve_cached(client, entry);
+        return 1;
+    }
+    if (entry) {
+        size_t len = strlen(entry->validator);
+        if (len > 0 && add_request_header(client, entry->validator, len) == 0) {
+            client->revalidating = entry;
+        } else {
+            lb_cache_release(entry);
+        }
+    }
+    
+    client->cache_key = malloc(key_len);
+    if (client->cache_key) {
+        memcpy(client->cache_key, key, key_len);
+        client->cache_key_len = key_len;
+    }
+    return 0;
+}
+
+// The response head has been parsed: keep a copy of the response if it
+// may be cached
+static void start_capture(ClientConn *client) {
+    long ttl = lb_cache_response_ttl(client->out, &client->resp);
+    if (ttl <= 0) return;
+    
+    client->capture = lb_cache_entry_new(client->cache_key, client->cache_key_len,
+                                         response_length(client), ttl);
+    client->cache_key = NULL;
+    if (client->capture) {
+        lb_cache_capture(client->capture, client->out, client->out_len);
+    }
+}
+
+// ---- Clients ----
+
+static void close_client(LbLoop *loop, ClientConn *client) {
+    if (client->backend) {
+        release_backend(loop, client, 0);
+    }
+    if (client->pipe.fds[0] >= 0) {
+        release_pipe(loop, client);
+    }
+    if (client->cached) {
+        lb_cache_release(client->cached);
+        client->cached = NULL;
+    }
+    drop_cache_state(client);
+    
+    if (client->prev) {
+        client->prev->next = client->next;
+    } else {
+        loop->clients = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+    
+    LB_DEBUG("Client %d (%s) disconnected\n", client->fd, client->peer);
+    close(client->fd);
+    client->fd = -1;
+    client->next = loop->dead_clients;
+    loop->dead_clients = client;
+}
+
+// Answer the client ourselves and close once it has been sent. Only used
+// before any of a backend response has reached the client.
+static void queue_error(ClientConn *client, int status) {
+    char body[128];
+    int body_len = snprintf(body, sizeof(body), "<html><body><h1>%d %s</h1></body></html>",
+                            status, lb_status_reason(status));
+    
+    client->out_len = snprintf(client->out, sizeof(client->out),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "%s", status, lb_status_reason(status), body_len, body);
+    client->out_sent = 0;
+    client->state = CLIENT_CLOSING;
+}
+
+// Safe to send again after it may have reached a backend that failed
+static int request_retryable(const LbRequest *req) {
+    return strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0;
+}
+
+// Attach a connection to a backend the request has not tried yet, moving
+// on to the next backend when a connection cannot even be started.
+// Returns -1 once LB_MAX_ATTEMPTS backends were tried or none is left.
+static int connect_request(LbLoop *loop, ClientConn *client) {
+    while (client->attempts < LB_MAX_ATTEMPTS) {
+        int idx = select_backend(client->req.path, client->tried);
+        if (idx < 0 || (client->tried & (1u << idx))) return -1;
+        
+        client->attempts++;
+        client->tried |= 1u << idx;
+        
+        BackendConn *bconn = acquire_backend(loop, idx);
+        if (bconn) {
+            LB_DEBUG("%s %s from %s -> backend %d (%s:%d)\n", client->req.method, client->req.path,
+                     client->peer, idx, backends[idx].host, backends[idx].port);
+            attach_backend(client, bconn);
+            return 0;
+        }
+        
+        printf("Failed to connect to backend %d\n", idx);
+        backend_report_result(idx, 0);
+    }
+    return -1;
+}
+
+// Hand the request at the front of client->in to a backend
+static void dispatch_request(LbLoop *loop, ClientConn *client) {
+    client->attempts = 0;
+    client->tried = 0;
+    client->resp_parsed = 0;
+    client->resp_received = 0;
+    
+    if (lb_cache_enabled() && lookup_cached(client)) {
+        return;
+    }
+    
+    prepare_request_head(client);
+    if (connect_request(loop, client) < 0) {
+        if (client->attempts == 0) {
+            printf("No active backends available\n");
+            queue_error(client, 503);
+        } else {
+            queue_error(client, 502);
+        }
+        return;
+    }
+    client->state = CLIENT_FORWARDING;
+}
+
+// The backend connection broke before the response was complete. A pooled
+// connection the backend had already closed is retried on a fresh
+// connection to the same backend. Otherwise the failure counts against
+// the backend, and the request moves to another backend if it never got
+// through to this one, or is a GET or HEAD, and no response byte has been
+// seen. Failing that the client gets a 502, or is cut off if part of the
+// response already went out.
+static void backend_failed(LbLoop *loop, ClientConn *client) {
+    BackendConn *bconn = client->backend;
+    int idx = bconn->backend;
+    int untouched = client->resp_received == 0;
+    int stale = bconn->reused && untouched;
+    int connect_failed = bconn->connecting;
+    release_backend(loop, client, 0);
+    
+    if (stale) {
+        BackendConn *fresh = open_backend(loop, idx);
+        if (fresh) {
+            attach_backend(client, fresh);
+            return;
+        }
+    }
+    
+    backend_report_result(idx, 0);
+    if (untouched && (connect_failed || request_retryable(&client->req)) &&
+        connect_request(loop, client) == 0) {
+        return;
+    }
+    
+    if (untouched || !client->resp_parsed) {
+        queue_error(client, 502);
+    } else {
+        close_client(loop, client);
+    }
+}
+
+// The response has been read in full: return the backend connection to
+// the pool and get ready for the client's next request
+static void finish_response(LbLoop *loop, ClientConn *client) {
+    int reusable = client->resp.keep_alive && !client->resp.until_close;
+    
+    // A backend that sent more than it announced cannot be trusted again
+    unsigned long long expected = response_length(client);
+    if (!client->resp.until_close && client->resp_received > expected) {
+        client->out_len -= client->resp_received - expected;
+        reusable = 0;
+    }
+    release_backend(loop, client, reusable);
+    
+    if (client->capture) {
+        lb_cache_insert(client->capture);
+        client->capture = NULL;
+    }
+    
+    // The cached copy is still good: answer with it instead of the 304
+    if (client->revalidating && client->resp.status == 304) {
+        LbCacheEntry *entry = client->revalidating;
+        client->revalidating = NULL;
+        lb_cache_refresh(entry, client->out, client->resp.head_len);
+        client->out_len = client->out_sent = 0;
+        drop_cache_state(client);
+        serve_cached(client, entry);
+        return;
+    }
+    
+    drop_cache_state(client);
+    consume_request(client);
+}
+
+// Decide whether the client connection outlives this response. Connection
+// is hop-by-hop, so what the backend said about its own connection is
+// dropped from the head, which is still unsent at the front of
+// client->out, and the client is told what happens to its connection.
+static void prepare_response_head(ClientConn *client) {
+    static const char *const hop_by_hop[] = { "Connection", "Keep-Alive" };
+    int keep_alive = client->req.keep_alive && !client->resp.until_close;
+    
+    for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++) {
+        size_t removed = lb_strip_header(client->out, client->out_len, client->resp.head_len,
+                                         hop_by_hop[i]);
+        client->out_len -= removed;
+        client->resp.head_len -= removed;
+        client->resp_received -= removed;
+    }
+    
+    const char *line = keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    size_t len = strlen(line);
+    if (client->out_len + len <= sizeof(client->out)) {
+        size_t at = client->resp.head_len - 2;  // Before the blank line
+        memmove(client->out + at + len, client->out + at, client->out_len - at);
+        memcpy(client->out + at, line, len);
+        client->out_len += len;
+        client->resp.head_len += len;
+        client->resp_received += len;
+    } else if (!client->req.http11) {
+        keep_alive = 0;  // Without the header an HTTP/1.0 client expects a close
+    }
+    client->close_after_response = !keep_alive;
+}
+
+// Read response bytes from the backend into client->out. Returns 1 on
+// progress, 0 if the backend has nothing yet and -1 if the client was
+// closed or answered with an error.
+static int relay_from_backend(LbLoop *loop, ClientConn *client) {
+    BackendConn *bconn = client->backend;
+    
+    // Make room by dropping what the client already has
+    if (client->out_sent > 0 && client->out_len == sizeof(client->out)) {
+        client->out_len -= client->out_sent;
+        memmove(client->out, client->out + client->out_sent, client->out_len);
+        client->out_sent = 0;
+    }
+    
+    size_t room = sizeof(client->out) - client->out_len;
+    if (client->resp_parsed && !client->resp.until_close) {
+        unsigned long long left = response_length(client) - client->resp_received;
+        if (left < room) room = left;
+    }
+    if (room == 0) return 0;
+    
+    ssize_t n = recv(bconn->fd, client->out + client->out_len, room, 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        backend_failed(loop, client);
+        return -1;
+    }
+    if (n == 0) {
+        // A response without Content-Length ends when the backend closes
+        if (client->resp_parsed && client->resp.until_close) {
+            finish_response(loop, client);
+            return 1;
+        }
+        backend_failed(loop, client);
+        return -1;
+    }
+    
+    client->out_len += n;
+    client->resp_received += n;
+    
+    if (!client->resp_parsed) {
+        int parsed = lb_parse_response(client->out, client->out_len, &client->req, &client->resp);
+        if (parsed < 0) {
+            printf("Malformed response from backend %d\n", bconn->backend);
+            backend_report_result(bconn->backend, 0);
+            release_backend(loop, client, 0);
+            queue_error(client, 502);
+            return -1;
+        }
+        client->resp_parsed = parsed;
+        if (parsed) {
+            long latency = lb_now_ns() - client->dispatched_ns;
+            backend_observe_latency(bconn->backend, latency);
+            backend_report_result(bconn->backend, client->resp.status < 500 &&
+                                                  latency < LB_EJECT_LATENCY_NS);
+            prepare_response_head(client);
+            if (client->cache_key && !(client->revalidating && client->resp.status == 304)) {
+                start_capture(client);
+            }
+        }
+    } else if (client->capture) {
+        lb_cache_capture(client->capture, client->out + client->out_len - n, n);
+    }
+    
+    if (client->resp_parsed && !client->resp.until_close &&
+        client->resp_received >= response_length(client)) {
+        finish_response(loop, client);
+    }
+    return 1;
+}
+
+// Large bodies go through the client's pipe once everything buffered
+// ahead of them has been sent
+static int use_splice(LbLoop *loop, ClientConn *client) {
+    if (client->piped > 0) return 1;
+    if (!client->resp_parsed || client->out_len > 0 || client->capture) return 0;
+    if (!client->resp.until_close &&
+        response_length(client) - client->resp_received < LB_SPLICE_MIN_BYTES) {
+        return 0;
+    }
+    return client->pipe.fds[0] >= 0 || acquire_pipe(loop, client) == 0;
+}
+
+// Move response body bytes from the backend into the client's pipe. Same
+// return values as relay_from_backend().
+static int splice_from_backend(LbLoop *loop, ClientConn *client) {
+    size_t room = client->pipe.size - client->piped;
+    if (!client->resp.until_close) {
+        unsigned long long left = response_length(client) - client->resp_received;
+        if (left < room) room = left;
+    }
+    if (room == 0) return 0;
+    
+    ssize_t n = splice(client->backend->fd, NULL, client->pipe.fds[1], NULL, room,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        backend_failed(loop, client);
+        return -1;
+    }
+    if (n == 0) {
+        if (client->resp.until_close) {
+            finish_response(loop, client);
+            return 1;
+        }
+        backend_failed(loop, client);
+        return -1;
+    }
+    
+    client->piped += n;
+    client->resp_received += n;
+    if (!client->resp.until_close && client->resp_received >= response_length(client)) {
+        finish_response(loop, client);
+    }
+    return 1;
+}
+
+static void client_pump(LbLoop *loop, ClientConn *client) {
+    int progress = 1;
+    
+    while (progress) {
+        progress = 0;
+        
+        // Response bytes to the client. A backend response is held back
+        // until its head has been parsed, so an error can still replace it.
+        int sendable = client->state != CLIENT_FORWARDING || client->resp_parsed;
+        if (sendable && client->out_sent < client->out_len) {
+            ssize_t n = send(client->fd, client->out + client->out_sent,
+                             client->out_len - client->out_sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                client->out_sent += n;
+                progress = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                close_client(loop, client);
+                return;
+            }
+        }
+        if (client->out_sent == client->out_len) {
+            client->out_sent = client->out_len = 0;
+        }
+        
+        // Spliced body bytes to the client, which always follow what was
+        // in client->out
+        if (client->out_len == 0 && client->piped > 0) {
+            ssize_t n = splice(client->pipe.fds[0], NULL, client->fd, NULL, client->piped,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                client->piped -= n;
+                progress = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                close_client(loop, client);
+                return;
+            }
+        }
+        if (client->pipe.fds[0] >= 0 && client->piped == 0 && client->state != CLIENT_FORWARDING) {
+            release_pipe(loop, client);
+        }
+        
+        // A cached body, which also follows client->out
+        if (client->out_len == 0 && client->cached) {
+            LbCacheEntry *entry = client->cached;
+            if (client->cached_sent < entry->size) {
+                ssize_t n = send(client->fd, entry->data + client->cached_sent,
+                                 entry->size - client->cached_sent, MSG_NOSIGNAL);
+                if (n > 0) {
+                    client->cached_sent += n;
+                    progress = 1;
+                } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    close_client(loop, client);
+                    return;
+                }
+            }
+            if (client->cached_sent == entry->size) {
+                lb_cache_release(entry);
+                client->cached = NULL;
+            }
+        }
+        
+        if (client->out_len == 0 && client->piped == 0 && !client->cached) {
+            if (client->state == CLIENT_CLOSING ||
+                (client->state == CLIENT_READING && client->close_after_response)) {
+                close_client(loop, client);
+                return;
+            }
+        }
+        
+        // Request bytes from the client, including pipelined ones
+        if (client->state != CLIENT_CLOSING && !client->peer_closed &&
+            client->in_len < sizeof(client->in)) {
+            ssize_t n = recv(client->fd, client->in + client->in_len,
+                             sizeof(client->in) - client->in_len, 0);
+            if (n > 0) {
+                client->in_len += n;
+                progress = 1;
+            } else if (n == 0) {
+                client->peer_closed = 1;
+                progress = 1;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                close_client(loop, client);
+                return;
+            }
+        }
+        
+        // Route the next request once the previous response is out
+        if (client->state == CLIENT_READING && client->out_len == 0 && client->piped == 0 &&
+            !client->cached) {
+            int parsed = lb_parse_request(client->in, client->in_len, &client->req);
+            if (parsed > 0) {
+                dispatch_request(loop, client);
+                progress = 1;
+            } else if (parsed < 0) {
+                queue_error(client, client->req.error_status);
+                progress = 1;
+            } else if (client->peer_closed) {
+                close_client(loop, client);  // Nothing more is coming
+                return;
+            }
+        }
+        
+        if (client->state != CLIENT_FORWARDING || client->backend->connecting) {
+            continue;
+        }
+        
+        // Request bytes to the backend
+        if (client->request_sent < client->req.length) {
+            ssize_t n = send(client->backend->fd, client->in + client->request_sent,
+                             client->req.length - client->request_sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                client->request_sent += n;
+                progress = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                backend_failed(loop, client);
+                if (client->fd < 0) return;
+                progress = 1;
+                continue;
+            }
+        }
+        
+        // Response bytes from the backend
+        int relayed = use_splice(loop, client) ? splice_from_backend(loop, client)
+                                               : relay_from_backend(loop, client);
+        if (relayed != 0) {
+            if (client->fd < 0) return;
+            progress = 1;
+        }
+    }
+}
+
+static void accept_clients(LbLoop *loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_sock = accept4(loop->listen_fd, (struct sockaddr *)&client_addr,
+                                  &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && lb_running) {
+                perror("Accept failed");
+            }
+            return;
+        }
+        
+        ClientConn *client = malloc(sizeof(ClientConn));
+        if (!client) {
+            close(client_sock);
+            continue;
+        }
+        memset(client, 0, offsetof(ClientConn, in));
+        client->type = LB_CONN_CLIENT;
+        client->fd = client_sock;
+        client->state = CLIENT_READING;
+        client->pipe.fds[0] = client->pipe.fds[1] = -1;
+        client->last_active = loop->now;
+        inet_ntop(AF_INET, &client_addr.sin_addr, client->peer, sizeof(client->peer));
+        set_nodelay(client_sock);
+        
+        if (watch_fd(loop, client_sock, client) < 0) {
+            perror("epoll_ctl failed");
+            close(client_sock);
+            free(client);
+            continue;
+        }
+        
+        client->next = loop->clients;
+        if (loop->clients) loop->clients->prev = client;
+        loop->clients = client;
+        
+        LB_DEBUG("New client connected: %s:%d (socket %d, loop %d)\n", client->peer,
+                 ntohs(client_addr.sin_port), client_sock, loop->id);
+        client_pump(loop, client);
+    }
+}
+
+static void handle_backend_event(LbLoop *loop, BackendConn *bconn, uint32_t events) {
+    if (bconn->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(bconn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & EPOLLERR)) {
+            printf("Failed to connect to backend %d: %s\n", bconn->backend, strerror(err));
+            ClientConn *client = bconn->client;
+            backend_failed(loop, client);
+            if (client->fd >= 0) {
+                client_pump(loop, client);
+            }
+            return;
+        }
+        if (!(events & EPOLLOUT)) return;
+        bconn->connecting = 0;
+    }
+    
+    // An idle connection only hears from the backend when it closes (or
+    // misbehaves); either way it is no longer usable. The event may also
+    // be left over from the response it just finished, so look first.
+    if (!bconn->client) {
+        char byte;
+        if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+            !(recv(bconn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)) {
+            pool_remove(loop, bconn);
+            close_backend(loop, bconn);
+        }
+        return;
+    }
+    
+    bconn->client->last_active = loop->now;
+    client_pump(loop, bconn->client);
+}
+
+// Close clients that have been idle, half-sent or waiting on a backend
+// for too long, and pooled connections the backend is about to drop
+static void sweep_timeouts(LbLoop *loop) {
+    ClientConn *client = loop->clients;
+    while (client) {
+        ClientConn *next = client->next;
+        time_t idle = loop->now - client->last_active;
+        
+        if (client->state == CLIENT_FORWARDING && idle >= LB_BACKEND_TIMEOUT) {
+            backend_report_result(client->backend->backend, 0);
+            if (client->resp_parsed) {
+                close_client(loop, client);
+            } else {
+                release_backend(loop, client, 0);
+                queue_error(client, 504);
+                client_pump(loop, client);
+            }
+        } else if (client->state != CLIENT_FORWARDING && idle >= LB_CLIENT_TIMEOUT) {
+            close_client(loop, client);
+        }
+        client = next;
+    }
+    
+    for (int i = 0; i < num_backends; i++) {
+        BackendConn *bconn = loop->pools[i].head;
+        while (bconn) {
+            BackendConn *next = bconn->next;
+            if (loop->now - bconn->idle_since >= LB_POOL_IDLE_TIMEOUT) {
+                pool_remove(loop, bconn);
+                close_backend(loop, bconn);
+            }
+            bconn = next;
+        }
+    }
+}
+
+static void free_dead_connections(LbLoop *loop) {
+    while (loop->dead_clients) {
+        ClientConn *client = loop->dead_clients;
+        loop->dead_clients = client->next;
+        free(client);
+    }
+    while (loop->dead_backends) {
+        BackendConn *bconn = loop->dead_backends;
+        loop->dead_backends = bconn->next;
+        free(bconn);
+    }
+}
+
+void *lb_loop_thread(void *arg) {
+    LbLoop *loop = arg;
+    struct epoll_event events[LB_MAX_EVENTS];
+    
+    printf("Proxy loop %d started (listener %d)\n", loop->id, loop->listen_fd);
+    
+    while (lb_running) {
+        int n = epoll_wait(loop->epoll_fd, events, LB_MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        
+        loop->now = time(NULL);
+        
+        for (int i = 0; i < n; i++) {
+            int *type = events[i].data.ptr;
+            if (type == NULL) {
+                accept_clients(loop);
+            } else if (*type == LB_CONN_CLIENT) {
+                ClientConn *client = events[i].data.ptr;
+                if (client->fd < 0) continue;
+                client->last_active = loop->now;
+                client_pump(loop, client);
+            } else {
+                BackendConn *bconn = events[i].data.ptr;
+                if (bconn->fd < 0) continue;
+                handle_backend_event(loop, bconn, events[i].events);
+            }
+        }
+        
+        sweep_timeouts(loop);
+        free_dead_connections(loop);
+    }
+    
+    printf("Proxy loop %d stopping\n", loop->id);
+    while (loop->clients) {
+        close_client(loop, loop->clients);
+    }
+    for (int i = 0; i < num_backends; i++) {
+        while (loop->pools[i].head) {
+            BackendConn *bconn = loop->pools[i].head;
+            pool_remove(loop, bconn);
+            close_backend(loop, bconn);
+        }
+    }
+    free_dead_connections(loop);
+    for (int i = 0; i < loop->num_spare_pipes; i++) {
+        close(loop->spare_pipes[i].fds[0]);
+        close(loop->spare_pipes[i].fds[1]);
+    }
+    close(loop->listen_fd);
+    close(loop->epoll_fd);
+    free(loop);
+    return NULL;
+}
+
+int start_lb_loops(int port, int num_loops, pthread_t *threads) {
+    for (int i = 0; i < num_loops; i++) {
+        LbLoop *loop = calloc(1, sizeof(LbLoop));
+        if (!loop) return -1;
+        
+        loop->id = i;
+        loop->now = time(NULL);
+        loop->listen_fd = create_listener(port);
+        if (loop->listen_fd < 0) {
+            free(loop);
+            return -1;
+        }
+        
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            close(loop->listen_fd);
+            free(loop);
+            return -1;
+        }
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;  // NULL marks the listener
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev);
+        
+        if (pthread_create(&threads[i], NULL, lb_loop_thread, loop) != 0) {
+            perror("Failed to create proxy loop thread");
+            close(loop->listen_fd);
+            close(loop->epoll_fd);
+            free(loop);
+            return -1;
+        }
+        
+        // Keep each loop on its own core so its connections stay cache-warm
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % CPU_SETSIZE, &cpus);
+        pthread_setaffinity_np(threads[i], sizeof(cpus), &cpus);
+    }
+    
+    return 0;
+}
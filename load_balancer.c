@@ -1,51 +1,104 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <pthread.h>
-#include <signal.h>
-#include <errno.h>
-#include <limits.h>
-#include <sys/select.h>
-
-#define LB_PORT 8085
-#define BUFFER_SIZE 4096
-#define MAX_BACKENDS 4
-
-// Backend server configuration
-typedef struct {
-    char host[64];
-    int port;
-    int active;
-    long request_count;
-} Backend;
+#include "load_balancer.h"
 
 // Global variables
-Backend backends[] = {
-    {"127.0.0.1", 8081, 1, 0},
-    {"127.0.0.1", 8082, 1, 0},
-    {"127.0.0.1", 8083, 1, 0},
-    {"127.0.0.1", 8084, 1, 0}
+Backend backends[MAX_BACKENDS] = {
+    {.host = "127.0.0.1", .port = 8081, .active = 1, .weight = 1},
+    {.host = "127.0.0.1", .port = 8082, .active = 1, .weight = 1},
+    {.host = "127.0.0.1", .port = 8083, .active = 1, .weight = 1},
+    {.host = "127.0.0.1", .port = 8084, .active = 1, .weight = 1}
 };
 
 int num_backends = 4;
 int current_backend = 0;
 int lb_running = 1;
+int lb_policy = LB_POLICY_ROUND_ROBIN;
 pthread_mutex_t backend_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Function prototypes
-int select_backend_round_robin();
-int select_backend_least_connections();
-void *handle_client_lb(void *arg);
-int connect_to_backend(Backend *backend);
-void proxy_data(int client_sock, int backend_sock);
-void health_check_backends();
-void *health_check_thread(void *arg);
-void signal_handler(int signum);
-void print_backend_stats();
+long lb_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Per-thread xorshift generator for the randomized policies
+static unsigned int lb_random() {
+    static __thread unsigned int state;
+    if (state == 0) {
+        state = (unsigned int)lb_now_ns() ^ (unsigned int)(uintptr_t)&state;
+        if (state == 0) state = 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Healthy and not ejected
+int backend_available(int idx) {
+    return __atomic_load_n(&backends[idx].active, __ATOMIC_RELAXED) &&
+           lb_now_ns() >= __atomic_load_n(&backends[idx].ejected_until_ns, __ATOMIC_RELAXED);
+}
+
+static int backend_in_flight(int idx) {
+    return __atomic_load_n(&backends[idx].in_flight, __ATOMIC_RELAXED);
+}
+
+// The latency estimate fades towards zero while a backend takes no
+// samples, so one that was slow once is eventually tried again
+static double backend_latency(int idx, long now) {
+    long latency = __atomic_load_n(&backends[idx].latency_ns, __ATOMIC_RELAXED);
+    long updated = __atomic_load_n(&backends[idx].latency_updated_ns, __ATOMIC_RELAXED);
+    if (now <= updated) return latency;
+    return latency * exp(-(double)(now - updated) / LB_EWMA_DECAY_NS);
+}
+
+// Peak EWMA: a slower sample replaces the average at once, faster ones
+// pull it down in proportion to the time since the last sample
+void backend_observe_latency(int idx, long latency_ns) {
+    Backend *backend = &backends[idx];
+    long now = lb_now_ns();
+    long old = __atomic_load_n(&backend->latency_ns, __ATOMIC_RELAXED);
+    long updated;
+    
+    do {
+        long last = __atomic_load_n(&backend->latency_updated_ns, __ATOMIC_RELAXED);
+        if (latency_ns >= old || now <= last) {
+            updated = latency_ns >= old ? latency_ns : old;
+        } else {
+            double w = exp(-(double)(now - last) / LB_EWMA_DECAY_NS);
+            updated = old * w + latency_ns * (1.0 - w);
+        }
+    } while (!__atomic_compare_exchange_n(&backend->latency_ns, &old, updated, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_store_n(&backend->latency_updated_ns, now, __ATOMIC_RELAXED);
+}
+
+// Whether backend a carries less load per unit of weight than backend b
+static int less_loaded(int a, int b) {
+    return (long)backend_in_flight(a) * backends[b].weight <
+           (long)backend_in_flight(b) * backends[a].weight;
+}
+
+// Pick two distinct active backends at random. Returns how many were
+// found (0, 1 or 2).
+static int random_pair(int *first, int *second) {
+    int active[MAX_BACKENDS];
+    int count = 0;
+    
+    for (int i = 0; i < num_backends; i++) {
+        if (backend_available(i)) active[count++] = i;
+    }
+    if (count == 0) return 0;
+    
+    int a = lb_random() % count;
+    *first = active[a];
+    if (count == 1) return 1;
+    
+    int b = lb_random() % (count - 1);
+    if (b >= a) b++;
+    *second = active[b];
+    return 2;
+}
 
 int select_backend_round_robin() {
     pthread_mutex_lock(&backend_mutex);
@@ -55,9 +108,8 @@ int select_backend_round_robin() {
     
     // Try to find an active backend using round robin
     while (attempts < num_backends) {
-        if (backends[current_backend].active) {
+        if (backend_available(current_backend)) {
             selected = current_backend;
-            backends[current_backend].request_count++;
             current_backend = (current_backend + 1) % num_backends;
             break;
         }
@@ -70,148 +122,224 @@ int select_backend_round_robin() {
 }
 
 int select_backend_least_connections() {
+    int selected = -1;
+    
+    // Start the scan at a random backend so ties do not all land on the first
+    int start = lb_random() % num_backends;
+    for (int n = 0; n < num_backends; n++) {
+        int i = (start + n) % num_backends;
+        if (backend_available(i) && (selected < 0 || less_loaded(i, selected))) {
+            selected = i;
+        }
+    }
+    
+    return selected;
+}
+
+// Smooth weighted round-robin: every pick raises each backend's current
+// weight by its weight and lowers the winner's by the total, which
+// interleaves backends in proportion to their weights instead of in bursts
+int select_backend_weighted() {
     pthread_mutex_lock(&backend_mutex);
     
     int selected = -1;
-    long min_connections = LONG_MAX;
+    int total = 0;
     
     for (int i = 0; i < num_backends; i++) {
-        if (backends[i].active && backends[i].request_count < min_connections) {
-            min_connections = backends[i].request_count;
+        if (!backend_available(i)) continue;
+        backends[i].current_weight += backends[i].weight;
+        total += backends[i].weight;
+        if (selected < 0 || backends[i].current_weight > backends[selected].current_weight) {
             selected = i;
         }
     }
     
     if (selected >= 0) {
-        backends[selected].request_count++;
+        backends[selected].current_weight -= total;
     }
     
     pthread_mutex_unlock(&backend_mutex);
     return selected;
 }
 
-int connect_to_backend(Backend *backend) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Backend socket creation failed");
-        return -1;
+// Power of two choices: nearly as good as scanning for the least loaded
+// backend, without every loop piling onto the same one
+int select_backend_p2c() {
+    int first, second;
+    int found = random_pair(&first, &second);
+    
+    if (found == 0) return -1;
+    if (found == 1) return first;
+    return less_loaded(second, first) ? second : first;
+}
+
+// Two random backends, scored by expected wait: latency times the
+// requests already queued on them
+int select_backend_peak_ewma() {
+    int first, second;
+    int found = random_pair(&first, &second);
+    
+    if (found == 0) return -1;
+    if (found == 1) return first;
+    
+    long now = lb_now_ns();
+    double first_cost = (backend_latency(first, now) + 1) * (backend_in_flight(first) + 1) /
+                        backends[first].weight;
+    double second_cost = (backend_latency(second, now) + 1) * (backend_in_flight(second) + 1) /
+                         backends[second].weight;
+    return second_cost < first_cost ? second : first;
+}
+
+// ---- Consistent hashing ----
+
+// Each backend owns LB_HASH_VNODES * weight points on a 64-bit ring, and a
+// path belongs to the first point at or after its own hash. Adding or
+// losing a backend only moves the paths next to its points, so every
+// other backend keeps serving (and caching) the same files.
+typedef struct {
+    uint64_t point;
+    int backend;
+} RingPoint;
+
+static RingPoint *hash_ring;
+static int hash_ring_size;
+
+// FNV-1a followed by the splitmix64 finalizer, which spreads similar
+// strings (paths sharing a prefix, host:port#1, #2, ...) over the ring
+static uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
     }
-    
-    struct sockaddr_in backend_addr;
-    backend_addr.sin_family = AF_INET;
-    backend_addr.sin_port = htons(backend->port);
-    
-    if (inet_pton(AF_INET, backend->host, &backend_addr.sin_addr) <= 0) {
-        perror("Invalid backend address");
-        close(sock);
-        return -1;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+    const RingPoint *pa = a;
+    const RingPoint *pb = b;
+    if (pa->point != pb->point) return pa->point < pb->point ? -1 : 1;
+    return pa->backend - pb->backend;
+}
+
+int build_hash_ring() {
+    int total = 0;
+    for (int i = 0; i < num_backends; i++) {
+        total += LB_HASH_VNODES * backends[i].weight;
     }
     
-    // Set socket timeout
-    struct timeval timeout;
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-    
-    if (connect(sock, (struct sockaddr *)&backend_addr, sizeof(backend_addr)) < 0) {
-        printf("Failed to connect");
-        close(sock);
-        return -1;
+    hash_ring = malloc(total * sizeof(RingPoint));
+    if (!hash_ring) return -1;
+    
+    hash_ring_size = 0;
+    for (int i = 0; i < num_backends; i++) {
+        for (int v = 0; v < LB_HASH_VNODES * backends[i].weight; v++) {
+            char name[96];
+            int len = snprintf(name, sizeof(name), "%s:%d#%d", backends[i].host, backends[i].port, v);
+            hash_ring[hash_ring_size].point = hash_bytes(name, len);
+            hash_ring[hash_ring_size].backend = i;
+            hash_ring_size++;
+        }
     }
     
-    return sock;
+    qsort(hash_ring, hash_ring_size, sizeof(RingPoint), compare_points);
+    return 0;
 }
 
-void proxy_data(int client_sock, int backend_sock) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    fd_set read_fds;
-    int max_fd = (client_sock > backend_sock) ? client_sock : backend_sock;
-    
-    while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(client_sock, &read_fds);
-        FD_SET(backend_sock, &read_fds);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
-        if (activity < 0) {
-            if (errno == EINTR) continue;
-            perror("Select error");
-            break;
-        }
-        
-        if (activity == 0) continue; // Timeout
-        
-        // Forward data from client to backend
-        if (FD_ISSET(client_sock, &read_fds)) {
-            bytes_read = recv(client_sock, buffer, BUFFER_SIZE, 0);
-            if (bytes_read <= 0) break;
-            
-            if (send(backend_sock, buffer, bytes_read, 0) <= 0) {
-                break;
-            }
+// Walk the ring from the path's hash to the first active backend with
+// room. A backend is full once it carries more than LB_HASH_LOAD_FACTOR
+// percent of its weighted share of the requests in flight (consistent
+// hashing with bounded loads), so a hot path spills over to the next
+// backends on the ring instead of swamping its owner.
+int select_backend_hash(const char *path) {
+    long total_in_flight = 0;
+    long total_weight = 0;
+    for (int i = 0; i < num_backends; i++) {
+        if (backend_available(i)) {
+            total_in_flight += backend_in_flight(i);
+            total_weight += backends[i].weight;
         }
+    }
+    if (total_weight == 0 || hash_ring_size == 0) return -1;
+    
+    // The query string does not change which file is served
+    size_t len = strcspn(path, "?");
+    uint64_t h = hash_bytes(path, len);
+    
+    int lo = 0, hi = hash_ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (hash_ring[mid].point < h) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    int fallback = -1;
+    for (int n = 0; n < hash_ring_size; n++) {
+        int idx = hash_ring[(lo + n) % hash_ring_size].backend;
+        if (!backend_available(idx)) continue;
+        if (fallback < 0) fallback = idx;
         
-        // Forward data from backend to client
-        if (FD_ISSET(backend_sock, &read_fds)) {
-            bytes_read = recv(backend_sock, buffer, BUFFER_SIZE, 0);
-            if (bytes_read <= 0) break;
-            
-            if (send(client_sock, buffer, bytes_read, 0) <= 0) {
-                break;
-            }
+        // Capacity is ceil(factor * (in flight + this one) * weight share)
+        long share = (long)LB_HASH_LOAD_FACTOR * (total_in_flight + 1) * backends[idx].weight;
+        long capacity = (share + 100 * total_weight - 1) / (100 * total_weight);
+        if (backend_in_flight(idx) + 1 <= capacity) {
+            return idx;
         }
     }
+    return fallback;
 }
 
-void health_check_backends() {
-    printf("Performing health check on backends...\n");
+// Select a backend with the configured policy, avoiding those in the
+// exclude bitmask (already tried for this request) when another is
+// available. Returns -1 if none is.
+int select_backend(const char *path, unsigned int exclude) {
+    int selected;
+    
+    switch (lb_policy) {
+    case LB_POLICY_LEAST_CONN: selected = select_backend_least_connections(); break;
+    case LB_POLICY_WEIGHTED: selected = select_backend_weighted(); break;
+    case LB_POLICY_P2C: selected = select_backend_p2c(); break;
+    case LB_POLICY_PEAK_EWMA: selected = select_backend_peak_ewma(); break;
+    case LB_POLICY_HASH: selected = select_backend_hash(path); break;
+    default: selected = select_backend_round_robin(); break;
+    }
     
-    for (int i = 0; i < num_backends; i++) {
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            backends[i].active = 0;
-            continue;
+    if (selected >= 0 && (exclude & (1u << selected))) {
+        int next = -1;
+        for (int n = 1; n < num_backends && next < 0; n++) {
+            int i = (selected + n) % num_backends;
+            if (!(exclude & (1u << i)) && backend_available(i)) next = i;
         }
-        
-        struct sockaddr_in addr;
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(backends[i].port);
-        inet_pton(AF_INET, backends[i].host, &addr.sin_addr);
-        
-        // Set short timeout for health check
-        struct timeval timeout;
-        timeout.tv_sec = 2;
-        timeout.tv_usec = 0;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-        
-        int result = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-        close(sock);
-        
-        pthread_mutex_lock(&backend_mutex);
-        backends[i].active = (result == 0) ? 1 : 0;
-        pthread_mutex_unlock(&backend_mutex);
-        
-        printf("Backend %s:%d is %s\n", backends[i].host, backends[i].port, 
-               backends[i].active ? "UP" : "DOWN");
+        selected = next;
     }
+    
+    if (selected >= 0) {
+        __atomic_add_fetch(&backends[selected].request_count, 1, __ATOMIC_RELAXED);
+    }
+    return selected;
 }
 
 void print_backend_stats() {
     pthread_mutex_lock(&backend_mutex);
     printf("\n=== Backend Statistics ===\n");
     for (int i = 0; i < num_backends; i++) {
-        printf("Backend %d: %s:%d - %s - Requests: %ld\n", 
+        const char *state = !backends[i].active ? "INACTIVE" :
+                            backend_available(i) ? "ACTIVE" : "EJECTED";
+        printf("Backend %d: %s:%d - %s - Weight: %d - Requests: %ld - In flight: %d - "
+               "Latency: %.0f us - Connections opened: %ld\n",
                i, backends[i].host, backends[i].port,
-               backends[i].active ? "ACTIVE" : "INACTIVE",
-               backends[i].request_count);
+               state, backends[i].weight,
+               __atomic_load_n(&backends[i].request_count, __ATOMIC_RELAXED),
+               backend_in_flight(i),
+               backend_latency(i, lb_now_ns()) / 1000,
+               __atomic_load_n(&backends[i].connections_opened, __ATOMIC_RELAXED));
     }
+    lb_cache_print_stats();
     printf("========================\n\n");
     pthread_mutex_unlock(&backend_mutex);
 }
@@ -220,7 +348,7 @@ void *health_check_thread(void *arg) {
     (void)arg; // Suppress unused parameter warning
     
     while (lb_running) {
-        sleep(10); // Health check every 10 seconds
+        sleep(HEALTH_CHECK_INTERVAL);
         if (lb_running) {
             health_check_backends();
             print_backend_stats();
@@ -230,149 +358,178 @@ void *health_check_thread(void *arg) {
     return NULL;
 }
 
-void *handle_client_lb(void *arg) {
-    int client_sock = *(int *)arg;
-    free(arg);
-    
-    // Select backend using round robin
-    int backend_idx = select_backend_round_robin();
-    
-    if (backend_idx < 0) {
-        printf("No active backends available\n");
-        const char *error_response = 
-            "HTTP/1.1 503 Service Unavailable\r\n"
-            "Content-Type: text/html\r\n"
-            "Content-Length: 50\r\n\r\n"
-            "<html><body><h1>503 Service Unavailable</h1></body></html>";
-        send(client_sock, error_response, strlen(error_response), 0);
-        close(client_sock);
-        return NULL;
-    }
-    
-    printf("Selected backend %d (%s:%d) for client %d\n", 
-           backend_idx, backends[backend_idx].host, backends[backend_idx].port, client_sock);
-    
-    // Connect to selected backend
-    int backend_sock = connect_to_backend(&backends[backend_idx]);
-    if (backend_sock < 0) {
-        printf("Failed to connect to backend %d\n", backend_idx);
-        const char *error_response = 
-            "HTTP/1.1 502 Bad Gateway\r\n"
-            "Content-Type: text/html\r\n"
-            "Content-Length: 50\r\n\r\n"
-            "<html><body><h1>502 Bad Gateway</h1></body></html>";
-        send(client_sock, error_response, strlen(error_response), 0);
-        close(client_sock);
-        return NULL;
+void signal_handler(int signum) {
+    printf("\nReceived signal %d, shutting down load balancer...\n", signum);
+    lb_running = 0;
+}
+
+static const char *policy_names[] = {"round_robin", "least_conn", "weighted", "p2c", "peak_ewma", "hash"};
+
+// LB_BACKENDS="host:port[:weight],..." replaces the default backends
+static int parse_backends(const char *spec) {
+    Backend parsed[MAX_BACKENDS];
+    int count = 0;
+    char copy[1024];
+    
+    if (strlen(spec) >= sizeof(copy)) return -1;
+    strcpy(copy, spec);
+    
+    for (char *saveptr, *item = strtok_r(copy, ",", &saveptr); item;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strchr(item, ':');
+        if (!colon || count == MAX_BACKENDS || (size_t)(colon - item) >= sizeof(parsed[0].host)) {
+            return -1;
+        }
+        
+        memset(&parsed[count], 0, sizeof(Backend));
+        memcpy(parsed[count].host, item, colon - item);
+        parsed[count].active = 1;
+        parsed[count].weight = 1;
+        
+        char *end;
+        parsed[count].port = strtol(colon + 1, &end, 10);
+        if (*end == ':') {
+            parsed[count].weight = strtol(end + 1, &end, 10);
+        }
+        if (*end != '\0' || parsed[count].port <= 0 || parsed[count].port > 65535 ||
+            parsed[count].weight <= 0 || parsed[count].weight > 1000) {
+            return -1;
+        }
+        count++;
     }
     
-    // Proxy data between client and backend
-    proxy_data(client_sock, backend_sock);
-    
-    // Cleanup
-    close(backend_sock);
-    close(client_sock);
-    
-    printf("Client %d disconnected\n", client_sock);
-    return NULL;
+    if (count == 0) return -1;
+    memcpy(backends, parsed, count * sizeof(Backend));
+    num_backends = count;
+    return 0;
 }
 
-void signal_handler(int signum) {
-    printf("\nReceived signal %d, shutting down load balancer...\n", signum);
-    lb_running = 0;
+static int resolve_backends() {
+    for (int i = 0; i < num_backends; i++) {
+        memset(&backends[i].addr, 0, sizeof(backends[i].addr));
+        backends[i].addr.sin_family = AF_INET;
+        backends[i].addr.sin_port = htons(backends[i].port);
+        if (inet_pton(AF_INET, backends[i].host, &backends[i].addr.sin_addr) <= 0) {
+            printf("Invalid backend address: %s\n", backends[i].host);
+            return -1;
+        }
+    }
+    return 0;
 }
 
 int main() {
-    int lb_fd, client_sock;
-    struct sockaddr_in lb_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    int port = LB_PORT;
     pthread_t health_check_tid;
     
-    printf("Starting Load Balancer on port %d\n", LB_PORT);
-    printf("Backend servers:\n");
-    for (int i = 0; i < num_backends; i++) {
-        printf("  %d: %s:%d\n", i, backends[i].host, backends[i].port);
+    char *port_env = getenv("LB_PORT");
+    if (port_env) {
+        int requested = atoi(port_env);
+        if (requested > 0 && requested <= 65535) {
+            port = requested;
+        } else {
+            printf("Invalid LB_PORT environment variable: %s, using default %d\n", port_env, LB_PORT);
+        }
     }
-    printf("\n");
-    
-    // Set up signal handlers
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
     
-    // Create socket
-    lb_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (lb_fd < 0) {
-        perror("Load balancer socket creation failed");
+    char *backends_env = getenv("LB_BACKENDS");
+    if (backends_env && parse_backends(backends_env) < 0) {
+        printf("Invalid LB_BACKENDS environment variable: %s, using default backends\n", backends_env);
+    }
+    if (resolve_backends() < 0) {
         exit(1);
     }
     
-    // Set socket options
-    int opt = 1;
-    if (setsockopt(lb_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt failed");
-        close(lb_fd);
-        exit(1);
+    // Response cache, off unless given a budget
+    char *cache_env = getenv("LB_CACHE_BYTES");
+    if (cache_env) {
+        char *end;
+        long long budget = strtoll(cache_env, &end, 10);
+        if (*end != '\0' || budget < 0) {
+            printf("Invalid LB_CACHE_BYTES environment variable: %s, cache disabled\n", cache_env);
+        } else if (lb_cache_init(budget) < 0) {
+            printf("Failed to allocate the response cache, cache disabled\n");
+        }
     }
     
-    // Bind socket
-    lb_addr.sin_family = AF_INET;
-    lb_addr.sin_addr.s_addr = INADDR_ANY;
-    lb_addr.sin_port = htons(LB_PORT);
+    char *health_env = getenv("LB_HEALTH_PATH");
+    if (health_env) {
+        if (health_env[0] == '/' && strlen(health_env) < sizeof(lb_health_path) &&
+            !strpbrk(health_env, " \r\n")) {
+            strcpy(lb_health_path, health_env);
+        } else {
+            printf("Invalid LB_HEALTH_PATH environment variable: %s, using default %s\n",
+                   health_env, LB_HEALTH_PATH);
+        }
+    }
     
-    if (bind(lb_fd, (struct sockaddr *)&lb_addr, sizeof(lb_addr)) < 0) {
-        perror("Load balancer bind failed");
-        close(lb_fd);
+    char *policy_env = getenv("LB_POLICY");
+    if (policy_env) {
+        int found = -1;
+        for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+            if (strcmp(policy_env, policy_names[i]) == 0) found = i;
+        }
+        if (found >= 0) {
+            lb_policy = found;
+        } else {
+            printf("Invalid LB_POLICY environment variable: %s, using round_robin\n", policy_env);
+        }
+    }
+    if (lb_policy == LB_POLICY_HASH && build_hash_ring() < 0) {
+        printf("Failed to build the consistent hash ring\n");
         exit(1);
     }
     
-    // Listen for connections
-    if (listen(lb_fd, 100) < 0) {
-        perror("Load balancer listen failed");
-        close(lb_fd);
-        exit(1);
+    // One proxy loop per CPU unless LB_THREADS says otherwise
+    int num_loops = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_loops < 1) num_loops = 1;
+    char *threads_env = getenv("LB_THREADS");
+    if (threads_env) {
+        int requested = atoi(threads_env);
+        if (requested > 0 && requested <= 256) {
+            num_loops = requested;
+        } else {
+            printf("Invalid LB_THREADS environment variable: %s, using default %d\n",
+                   threads_env, num_loops);
+        }
+    }
+    
+    printf("Starting Load Balancer on port %d (%d proxy loops, %s policy)\n",
+           port, num_loops, policy_names[lb_policy]);
+    printf("Backend servers:\n");
+    for (int i = 0; i < num_backends; i++) {
+        printf("  %d: %s:%d (weight %d)\n", i, backends[i].host, backends[i].port, backends[i].weight);
     }
+    printf("\n");
     
-    printf("Load balancer listening on port %d...\n", LB_PORT);
+    // Set up signal handlers
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
     
     // Perform initial health check
     health_check_backends();
     
+    pthread_t *loop_threads = calloc(num_loops, sizeof(pthread_t));
+    if (!loop_threads || start_lb_loops(port, num_loops, loop_threads) < 0) {
+        printf("Failed to start proxy loops\n");
+        exit(1);
+    }
+    
+    printf("Load balancer listening on port %d...\n", port);
+    
     // Start health check thread
     if (pthread_create(&health_check_tid, NULL, health_check_thread, NULL) != 0) {
         perror("Failed to create health check thread");
     }
     
-    // Accept connections
-    while (lb_running) {
-        client_sock = accept(lb_fd, (struct sockaddr *)&client_addr, &client_len);
-        
-        if (client_sock < 0) {
-            if (lb_running) {
-                perror("Accept failed");
-            }
-            continue;
-        }
-        
-        printf("New client connected: %s:%d (socket %d)\n", 
-               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_sock);
-        
-        // Create thread for client
-        pthread_t client_thread;
-        int *client_sock_ptr = malloc(sizeof(int));
-        *client_sock_ptr = client_sock;
-        
-        if (pthread_create(&client_thread, NULL, handle_client_lb, client_sock_ptr) != 0) {
-            perror("Failed to create client thread");
-            close(client_sock);
-            free(client_sock_ptr);
-        } else {
-            pthread_detach(client_thread);
-        }
+    // The loops notice lb_running within a second of a signal
+    for (int i = 0; i < num_loops; i++) {
+        pthread_join(loop_threads[i], NULL);
     }
+    free(loop_threads);
     
     // Cleanup
     printf("Shutting down load balancer...\n");
-    close(lb_fd);
     
     // Cancel health check thread
     pthread_cancel(health_check_tid);
@@ -380,4 +537,4 @@ int main() {
     
     printf("Load balancer shutdown complete\n");
     return 0;
-}
\ No newline at end of file
+}
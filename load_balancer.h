@@ -0,0 +1,260 @@
+#ifndef LOAD_BALANCER_H
+#define LOAD_BALANCER_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <poll.h>
+
+// Configuration constants
+#define LB_PORT 8085
+#define MAX_BACKENDS 16
+#define LB_BUFFER_SIZE 16384          // per direction, per client; requests must fit
+#define LB_MAX_PATH 1024
+#define LB_MAX_EVENTS 256
+#define LB_POOL_SIZE 64               // idle backend connections kept per backend per loop
+#define LB_POOL_IDLE_TIMEOUT 4        // seconds; below the webserver's KEEPALIVE_TIMEOUT
+#define LB_CLIENT_TIMEOUT 15          // seconds a client may sit idle or half-sent
+#define LB_BACKEND_TIMEOUT 30         // seconds to wait on a backend before 504
+#define LB_SPLICE_MIN_BYTES 65536     // bodies at least this large are spliced, not copied
+#define LB_PIPE_SIZE (256 * 1024)     // requested capacity of each splice pipe
+#define LB_SPARE_PIPES 32             // empty pipes kept per loop for the next large body
+#define LB_CACHE_SHARDS 16
+#define LB_CACHE_BUCKETS 1024         // hash buckets per shard
+#define LB_CACHE_MAX_OBJECT (1024 * 1024)  // larger responses are not cached
+#define LB_CACHE_HEAD_ROOM 64         // for the Age and Connection headers added when served
+#define LB_CACHE_HEURISTIC_TTL_NS 10000000000L  // freshness without max-age, given Last-Modified
+#define HEALTH_CHECK_INTERVAL 10
+#define HEALTH_CHECK_TIMEOUT_MS 2000  // for all probes of one round together
+#define LB_HEALTH_PATH "/"            // probed with GET; 2xx or 3xx is healthy
+#define LB_MAX_ATTEMPTS 3             // backends tried for one request
+#define LB_EJECT_FAILURES 5           // consecutive failures before ejection
+#define LB_EJECT_LATENCY_NS 2000000000L  // responses slower than this count as failures
+#define LB_EJECT_BASE_NS 5000000000L  // first ejection; doubles with each repeat
+#define LB_EJECT_MAX_NS 300000000000L
+#define LB_EJECT_MAX_PERCENT 50       // never eject more than this share of backends
+#define LB_EWMA_DECAY_NS 10000000000L  // time constant of the latency average (10 s)
+
+// Backend selection policies (chosen at startup with LB_POLICY)
+#define LB_POLICY_ROUND_ROBIN 0
+#define LB_POLICY_LEAST_CONN 1      // fewest in-flight requests per unit of weight
+#define LB_POLICY_WEIGHTED 2        // smooth weighted round-robin
+#define LB_POLICY_P2C 3             // less loaded of two random backends
+#define LB_POLICY_PEAK_EWMA 4       // two random backends, lower latency x load
+#define LB_POLICY_HASH 5            // consistent hash of the path, with bounded load
+
+#define LB_HASH_VNODES 160            // ring points per unit of backend weight
+#define LB_HASH_LOAD_FACTOR 125       // percent of its fair share a backend may carry
+
+// Per-connection chatter only in debug builds (make debug)
+#ifdef DEBUG
+#define LB_DEBUG(...) printf(__VA_ARGS__)
+#else
+#define LB_DEBUG(...) do { } while (0)
+#endif
+
+// Backend server configuration. Counters are shared by every event loop
+// and updated with __atomic builtins. A backend takes traffic while it
+// passes health probes (active) and is not ejected for failing requests.
+typedef struct {
+    char host[64];
+    int port;
+    struct sockaddr_in addr;
+    int active;               // Last health probe succeeded
+    int weight;               // Relative share of traffic (LB_BACKENDS host:port:weight)
+    long request_count;
+    long connections_opened;  // Pooled reuse keeps this far below request_count
+    int in_flight;            // Requests assigned and not yet answered
+    long latency_ns;          // Peak EWMA of time to the response head
+    long latency_updated_ns;  // When latency_ns last took a sample
+    int current_weight;       // Smooth weighted round-robin state, under backend_mutex
+    int consecutive_failures; // Failed requests since the last success
+    int failures_since_check; // Failed requests since the last health check
+    int ejections;            // Backoff exponent, decays while the backend behaves
+    long ejected_until_ns;    // Out of rotation until then
+} Backend;
+
+// A request as far as the load balancer cares: enough to route it and to
+// know where it ends
+typedef struct {
+    char method[16];
+    char path[LB_MAX_PATH];
+    size_t head_len;
+    size_t length;            // Head plus body
+    int http11;               // HTTP/1.1 rather than 1.0
+    int keep_alive;
+    int error_status;         // Set when parsing fails
+} LbRequest;
+
+// The status line and framing of a backend response
+typedef struct {
+    int status;
+    size_t head_len;
+    int has_body;
+    int until_close;          // No Content-Length: the body ends at EOF
+    unsigned long long content_length;
+    int keep_alive;
+} LbResponse;
+
+// epoll carries a pointer to either kind of connection; the type field
+// comes first in both so the loop can tell them apart
+#define LB_CONN_CLIENT 0
+#define LB_CONN_BACKEND 1
+
+// Client states
+#define CLIENT_READING 0      // Waiting for a complete request
+#define CLIENT_FORWARDING 1   // Request handed to a backend, relaying the response
+#define CLIENT_CLOSING 2      // Flushing a final response, then closing
+
+// A pipe that response bodies are spliced through on their way from the
+// backend socket to the client socket
+typedef struct {
+    int fds[2];               // -1 when the client has none
+    size_t size;              // Capacity
+} LbPipe;
+
+// A cached backend response: the head (hop-by-hop headers removed) and
+// body exactly as they are sent. Reference counted, so a client can keep
+// sending an entry that has since been replaced or evicted.
+typedef struct LbCacheEntry {
+    uint64_t hash;
+    char *key;                // Path and the Accept-Encoding it varies on
+    size_t key_len;
+    char *data;
+    size_t head_len;
+    size_t size;
+    size_t filled;            // Bytes captured so far, while being stored
+    long stored_ns;           // Received or last revalidated
+    long ttl_ns;
+    char validator[192];      // Conditional header line to revalidate with, or ""
+    int refs;
+    struct LbCacheEntry *hash_next;
+    struct LbCacheEntry *lru_prev;
+    struct LbCacheEntry *lru_next;
+} LbCacheEntry;
+
+struct ClientConn;
+
+typedef struct BackendConn {
+    int type;
+    int fd;
+    int backend;              // Index into backends[]
+    int connecting;           // Non-blocking connect() still in progress
+    int reused;               // Came from the pool, so the backend may have closed it
+    struct ClientConn *client;  // NULL while idle in the pool
+    time_t idle_since;
+    struct BackendConn *prev;
+    struct BackendConn *next;
+} BackendConn;
+
+typedef struct ClientConn {
+    int type;
+    int fd;
+    int state;
+    char peer[INET_ADDRSTRLEN];
+    time_t last_active;
+    int peer_closed;
+    
+    // Client to backend: the request at the front of in, then anything
+    // pipelined behind it
+    size_t in_len;
+    LbRequest req;
+    size_t request_sent;
+    int attempts;             // Backends tried for this request
+    unsigned int tried;       // Bitmask of those backends
+    
+    // Backend to client
+    size_t out_len;
+    size_t out_sent;
+    LbResponse resp;
+    int resp_parsed;
+    unsigned long long resp_received;   // Bytes of the response read so far
+    int close_after_response;
+    long dispatched_ns;       // When the request went to the backend, for latency
+    
+    // Response cache
+    char *cache_key;          // Set while a cacheable request is forwarded
+    size_t cache_key_len;
+    LbCacheEntry *capture;    // Response being stored
+    LbCacheEntry *revalidating;  // Stale entry the backend is asked about
+    LbCacheEntry *cached;     // Entry whose body is being sent
+    size_t cached_sent;
+    LbPipe pipe;
+    size_t piped;             // Response bytes in the pipe, not yet sent
+    
+    BackendConn *backend;
+    struct ClientConn *prev;
+    struct ClientConn *next;
+    
+    // Buffers last, so setting up a connection only clears the fields above
+    char in[LB_BUFFER_SIZE];
+    char out[LB_BUFFER_SIZE];
+} ClientConn;
+
+// Global variables
+extern Backend backends[MAX_BACKENDS];
+extern int num_backends;
+extern int lb_running;
+extern int lb_policy;
+extern char lb_health_path[LB_MAX_PATH];
+extern pthread_mutex_t backend_mutex;
+
+// Function prototypes
+int select_backend(const char *path, unsigned int exclude);
+int backend_available(int idx);
+void backend_report_result(int idx, int ok);
+int select_backend_round_robin();
+int select_backend_least_connections();
+int select_backend_weighted();
+int select_backend_p2c();
+int select_backend_peak_ewma();
+int select_backend_hash(const char *path);
+int build_hash_ring();
+void backend_observe_latency(int idx, long latency_ns);
+long lb_now_ns();
+const char *lb_status_reason(int status);
+int lb_parse_request(const char *buf, size_t len, LbRequest *req);
+int lb_parse_response(const char *buf, size_t len, const LbRequest *req, LbResponse *resp);
+size_t lb_strip_header(char *buf, size_t buf_len, size_t head_len, const char *name);
+int lb_find_header(const char *head, size_t head_len, const char *name,
+                   const char **value, size_t *value_len);
+int lb_header_has_token(const char *value, size_t len, const char *token);
+int lb_cache_init(size_t budget);
+int lb_cache_enabled();
+int lb_cache_request_key(const char *head, const LbRequest *req, char *key, size_t size);
+long lb_cache_response_ttl(const char *head, const LbResponse *resp);
+LbCacheEntry *lb_cache_lookup(const char *key, size_t key_len);
+LbCacheEntry *lb_cache_entry_new(char *key, size_t key_len, size_t size, long ttl_ns);
+void lb_cache_capture(LbCacheEntry *entry, const char *data, size_t len);
+void lb_cache_insert(LbCacheEntry *entry);
+void lb_cache_refresh(LbCacheEntry *entry, const char *head, size_t head_len);
+int lb_cache_fresh(LbCacheEntry *entry, long now);
+void lb_cache_release(LbCacheEntry *entry);
+void lb_cache_print_stats();
+int start_lb_loops(int port, int num_loops, pthread_t *threads);
+void *lb_loop_thread(void *arg);
+void health_check_backends();
+void *health_check_thread(void *arg);
+void signal_handler(int signum);
+void print_backend_stats();
+
+#endif
@@ -0,0 +1,306 @@
+#include "server.h"
+#include <sys/uio.h>
+
+// Asynchronous logging. Each thread formats its lines into its own
+// single-producer ring buffer without taking any lock; a background writer
+// drains every ring and writes whole batches with one writev() call. When a
+// ring is full the line is dropped (and counted) rather than stalling the
+// request path.
+
+#define LOG_RING_SIZE (64 * 1024)    // Power of two
+#define LOG_LINE_MAX 1024
+#define LOG_BATCH_IOV 64
+#define LOG_DRAIN_INTERVAL_US 10000
+
+typedef struct LogRing {
+    char data[LOG_RING_SIZE];
+    unsigned long head __attribute__((aligned(64)));  // Written by the owning thread
+    unsigned long dropped;
+    unsigned long tail __attribute__((aligned(64)));  // Written by the drainer
+    unsigned long reported_dropped;
+    struct LogRing *next;
+} LogRing;
+
+int log_level = LOG_LEVEL_INFO;
+int access_log_format = ACCESS_LOG_COMMON;
+
+static int log_fd = STDOUT_FILENO;
+static LogRing *log_rings = NULL;
+static __thread LogRing *thread_ring = NULL;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// Formatting timestamps is surprisingly expensive, so each thread keeps
+// the strings for the current second
+static __thread time_t cached_second = -1;
+static __thread char cached_iso_time[32];
+static __thread char cached_clf_time[32];
+
+static void update_time_strings() {
+    time_t now = time(NULL);
+    if (now == cached_second) return;
+    
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(cached_iso_time, sizeof(cached_iso_time), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    strftime(cached_clf_time, sizeof(cached_clf_time), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    cached_second = now;
+}
+
+static LogRing *get_thread_ring() {
+    if (thread_ring) return thread_ring;
+    
+    LogRing *ring = aligned_alloc(64, sizeof(LogRing));
+    if (!ring) return NULL;
+    memset(ring, 0, sizeof(LogRing));
+    
+    ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    
+    thread_ring = ring;
+    return ring;
+}
+
+// Copy a complete line into the calling thread's ring
+static void ring_push(const char *line, size_t len) {
+    LogRing *ring = get_thread_ring();
+    if (!ring) return;
+    
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (len > LOG_RING_SIZE - (head - tail)) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    size_t offset = head & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - offset;
+    if (first > len) first = len;
+    memcpy(ring->data + offset, line, first);
+    memcpy(ring->data, line + first, len - first);
+    
+    // Publish the bytes only after they have been copied
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+void log_write(int level, const char *fmt, ...) {
+    char line[LOG_LINE_MAX];
+    update_time_strings();
+    
+    int len = snprintf(line, sizeof(line), "%s %-5s ", cached_iso_time, level_names[level]);
+    
+    va_list args;
+    va_start(args, fmt);
+    int msg_len = vsnprintf(line + len, sizeof(line) - len - 1, fmt, args);
+    va_end(args);
+    if (msg_len < 0) return;
+    
+    len += msg_len;
+    if (len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+    line[len++] = '\n';
+    ring_push(line, len);
+}
+
+// Append src to dst, escaping characters that would break a quoted field
+static size_t escape_field(char *dst, size_t size, const char *src) {
+    size_t len = 0;
+    for (; *src && len + 7 < size; src++) {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\') {
+            dst[len++] = '\\';
+            dst[len++] = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            len += snprintf(dst + len, size - len, "\\u%04x", c);
+        } else {
+            dst[len++] = c;
+        }
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+// One access log line per request, in common log format (plus cache
+// result and response time) or as a JSON object
+void log_access(Connection *conn, HttpRequest *req, int status, int cache_hit,
+                size_t bytes, double response_time) {
+    if (access_log_format == ACCESS_LOG_OFF) return;
+    
+    char method[sizeof(req->method) * 2];
+    char path[MAX_FILENAME * 2];
+    char protocol[sizeof(req->protocol) * 2];
+    escape_field(method, sizeof(method), req->method);
+    escape_field(path, sizeof(path), req->path);
+    escape_field(protocol, sizeof(protocol), req->protocol);
+    update_time_strings();
+    
+    char line[LOG_LINE_MAX];
+    int len;
+    if (access_log_format == ACCESS_LOG_JSON) {
+        len = snprintf(line, sizeof(line),
+            "{\"time\": \"%s\", \"remote\": \"%s\", \"method\": \"%s\", \"path\": \"%s\", "
+            "\"protocol\": \"%s\", \"status\": %d, \"bytes\": %zu, \"cache\": \"%s\", "
+            "\"duration_ms\": %.3f}\n",
+            cached_iso_time, conn->peer, method, path, protocol, status, bytes,
+            cache_hit ? "hit" : "miss", response_time * 1000);
+    } else {
+        len = snprintf(line, sizeof(line), "%s - - [%s] \"%s %s %s\" %d %zu %s %.3f\n",
+                       conn->peer, cached_clf_time, method, path, protocol, status, bytes,
+                       cache_hit ? "hit" : "miss", response_time * 1000);
+    }
+    
+    if (len > 0 && len < (int)sizeof(line)) {
+        ring_push(line, len);
+    }
+}
+
+static void write_all(struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(log_fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;  // Nowhere left to report it
+        }
+        
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Write out everything currently in the rings. Returns the bytes written.
+static size_t drain_rings() {
+    struct iovec iov[LOG_BATCH_IOV];
+    LogRing *batch[LOG_BATCH_IOV];
+    unsigned long batch_head[LOG_BATCH_IOV];
+    int iovcnt = 0;
+    int num_batch = 0;
+    size_t total = 0;
+    
+    pthread_mutex_lock(&drain_mutex);
+    
+    // Interleaved printf() output from elsewhere goes out first
+    if (log_fd == STDOUT_FILENO) {
+        fflush(stdout);
+    }
+    
+    for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
+        if (head == tail) continue;
+        
+        // A ring can wrap, so it may take two iovecs
+        if (iovcnt + 2 > LOG_BATCH_IOV) {
+            write_all(iov, iovcnt);
+            for (int i = 0; i < num_batch; i++) {
+                __atomic_store_n(&batch[i]->tail, batch_head[i], __ATOMIC_RELEASE);
+            }
+            iovcnt = num_batch = 0;
+        }
+        
+        size_t offset = tail & (LOG_RING_SIZE - 1);
+        size_t len = head - tail;
+        size_t first = LOG_RING_SIZE - offset;
+        if (first > len) first = len;
+        iov[iovcnt].iov_base = ring->data + offset;
+        iov[iovcnt].iov_len = first;
+        iovcnt++;
+        if (len > first) {
+            iov[iovcnt].iov_base = ring->data;
+            iov[iovcnt].iov_len = len - first;
+            iovcnt++;
+        }
+        batch[num_batch] = ring;
+        batch_head[num_batch] = head;
+        num_batch++;
+        total += len;
+    }
+    
+    if (iovcnt > 0) {
+        write_all(iov, iovcnt);
+        for (int i = 0; i < num_batch; i++) {
+            __atomic_store_n(&batch[i]->tail, batch_head[i], __ATOMIC_RELEASE);
+        }
+    }
+    
+    // Say so when lines had to be dropped
+    for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported_dropped) {
+            char line[128];
+            int len = snprintf(line, sizeof(line), "WARN  log ring full, dropped %lu lines\n",
+                               dropped - ring->reported_dropped);
+            struct iovec warn = { line, len };
+            write_all(&warn, 1);
+            ring->reported_dropped = dropped;
+        }
+    }
+    
+    pthread_mutex_unlock(&drain_mutex);
+    return total;
+}
+
+void log_flush() {
+    drain_rings();
+}
+
+static void *log_writer_thread(void *arg) {
+    (void)arg; // Suppress unused parameter warning
+    
+    while (1) {
+        // Sleep only when there was nothing to write
+        if (drain_rings() == 0) {
+            usleep(LOG_DRAIN_INTERVAL_US);
+        }
+    }
+    return NULL;
+}
+
+// Read LOG_LEVEL, LOG_FILE and ACCESS_LOG and start the writer thread
+int log_init() {
+    char *level_env = getenv("LOG_LEVEL");
+    if (level_env) {
+        for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; i++) {
+            if (strcasecmp(level_env, level_names[i]) == 0) {
+                log_level = i;
+            }
+        }
+    }
+    
+    char *format_env = getenv("ACCESS_LOG");
+    if (format_env) {
+        if (strcmp(format_env, "json") == 0) {
+            access_log_format = ACCESS_LOG_JSON;
+        } else if (strcmp(format_env, "off") == 0) {
+            access_log_format = ACCESS_LOG_OFF;
+        }
+    }
+    
+    char *file_env = getenv("LOG_FILE");
+    if (file_env) {
+        int fd = open(file_env, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror("Failed to open LOG_FILE");
+        } else {
+            log_fd = fd;
+        }
+    }
+    
+    // The writer runs until the process exits; cleanup_server() flushes
+    // whatever is left
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, log_writer_thread, NULL) != 0) {
+        perror("Failed to create log writer thread");
+        return -1;
+    }
+    pthread_detach(writer);
+    return 0;
+}
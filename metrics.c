@@ -1,48 +1,414 @@
 #include "server.h"
 
-// Global metrics variables (defined here, declared in server.h)
-long total_requests = 0;
-long cache_hits = 0;
-long cache_misses = 0;
-double total_response_time = 0.0;
-pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Open client connections, across both server modes
+int active_connections = 0;
 
-void record_request(int cache_hit, double response_time) {
-    pthread_mutex_lock(&metrics_mutex);
+// Label values for the request counters. The last slot of each collects
+// everything else.
+static const char *metric_methods[METRIC_METHODS] = { "GET", "HEAD", "POST", "other" };
+static const int metric_codes[METRIC_CODES] = { 200, 206, 304, 400, 404, 413, 414, 416, 431, 500, 501, 503, 505, 0 };
+
+// Upper bounds (seconds) of the exported histogram buckets. The internal
+// buckets are much finer and are folded into these when rendering.
+static const double latency_bounds[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+#define NUM_LATENCY_BOUNDS (sizeof(latency_bounds) / sizeof(latency_bounds[0]))
+
+// Every thread that records a request gets its own shard on first use, so
+// the request path never takes a lock or shares a cache line. Shards are
+// pushed onto a lock-free list that readers walk to aggregate.
+static MetricsShard *metrics_shards = NULL;
+static __thread MetricsShard *thread_shard = NULL;
+
+static MetricsShard *get_thread_shard() {
+    if (thread_shard) return thread_shard;
+    
+    MetricsShard *shard = aligned_alloc(64, sizeof(MetricsShard));
+    if (!shard) return NULL;
+    memset(shard, 0, sizeof(MetricsShard));
+    
+    shard->next = __atomic_load_n(&metrics_shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metrics_shards, &shard->next, shard, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    
+    thread_shard = shard;
+    return shard;
+}
+
+static int latency_bucket(unsigned long long us) {
+    if (us < (1 << LATENCY_SUB_BITS)) return us;
+    if (us >= (1ULL << 32)) us = (1ULL << 32) - 1;
+    
+    int exponent = 63 - __builtin_clzll(us);
+    int shift = exponent - LATENCY_SUB_BITS;
+    int sub = (us >> shift) & ((1 << LATENCY_SUB_BITS) - 1);
+    return ((shift + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+// Highest value that falls in a bucket
+static unsigned long long latency_bucket_value(int bucket) {
+    if (bucket < (1 << LATENCY_SUB_BITS)) return bucket;
+    
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    unsigned long long sub = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+    return (((1ULL << LATENCY_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+// Only the owning thread writes a shard; the atomic load/store pair keeps
+// readers from seeing torn values without a locked instruction
+static void add_counter(unsigned long long *counter, unsigned long long value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static int method_index(const char *method) {
+    for (int i = 0; i < METRIC_METHODS - 1; i++) {
+        if (strcmp(method, metric_methods[i]) == 0) return i;
+    }
+    return METRIC_METHODS - 1;
+}
+
+static int code_index(int status) {
+    for (int i = 0; i < METRIC_CODES - 1; i++) {
+        if (status == metric_codes[i]) return i;
+    }
+    return METRIC_CODES - 1;
+}
+
+void record_request(const char *method, int status, int cache_hit, size_t bytes_in,
+                    size_t bytes_out, double response_time) {
+    MetricsShard *shard = get_thread_shard();
+    if (!shard) return;
     
-    total_requests++;
-    total_response_time += response_time;
+    add_counter(&shard->requests[method_index(method)][code_index(status)], 1);
+    add_counter(&shard->bytes_in, bytes_in);
+    add_counter(&shard->bytes_out, bytes_out);
     
-    if (cache_hit) {
-        cache_hits++;
-    } else {
-        cache_misses++;
+    int status_class = status / 100 - 1;
+    if (status_class < 0 || status_class >= STATUS_CLASSES) {
+        status_class = STATUS_CLASSES - 1;
     }
     
-    pthread_mutex_unlock(&metrics_mutex);
+    unsigned long long us = response_time > 0 ? (unsigned long long)(response_time * 1000000.0) : 0;
+    LatencyHistogram *histogram = &shard->latency[status_class][cache_hit ? 1 : 0];
+    add_counter(&histogram->buckets[latency_bucket(us)], 1);
+    add_counter(&histogram->total_us, us);
+    add_counter(&histogram->count, 1);
+}
+
+void latency_merge(LatencyHistogram *total, const LatencyHistogram *histogram) {
+    total->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    total->total_us += __atomic_load_n(&histogram->total_us, __ATOMIC_RELAXED);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total->buckets[i] += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Sum all thread shards into a newly allocated one, which the caller frees.
+// Recording threads are never blocked while this runs.
+MetricsShard *metrics_snapshot() {
+    MetricsShard *total = calloc(1, sizeof(MetricsShard));
+    if (!total) return NULL;
+    
+    for (MetricsShard *shard = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE);
+         shard; shard = shard->next) {
+        for (int c = 0; c < STATUS_CLASSES; c++) {
+            for (int hit = 0; hit < 2; hit++) {
+                latency_merge(&total->latency[c][hit], &shard->latency[c][hit]);
+            }
+        }
+        for (int m = 0; m < METRIC_METHODS; m++) {
+            for (int c = 0; c < METRIC_CODES; c++) {
+                total->requests[m][c] += __atomic_load_n(&shard->requests[m][c], __ATOMIC_RELAXED);
+            }
+        }
+        total->bytes_in += __atomic_load_n(&shard->bytes_in, __ATOMIC_RELAXED);
+        total->bytes_out += __atomic_load_n(&shard->bytes_out, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// Combine a snapshot's histograms into one and count hits and misses
+void metrics_totals(const MetricsShard *snapshot, LatencyHistogram *all,
+                    unsigned long long *cache_hits, unsigned long long *cache_misses) {
+    *cache_hits = *cache_misses = 0;
+    for (int c = 0; c < STATUS_CLASSES; c++) {
+        *cache_misses += snapshot->latency[c][0].count;
+        *cache_hits += snapshot->latency[c][1].count;
+        latency_merge(all, &snapshot->latency[c][0]);
+        latency_merge(all, &snapshot->latency[c][1]);
+    }
+}
+
+// Latency in seconds below which `percentile` percent of requests fell
+double latency_percentile(const LatencyHistogram *histogram, double percentile) {
+    unsigned long long total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += histogram->buckets[i];
+    }
+    if (total == 0) return 0.0;
+    
+    unsigned long long target = (unsigned long long)(percentile / 100.0 * total + 0.5);
+    if (target < 1) target = 1;
+    
+    unsigned long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= target) {
+            return latency_bucket_value(i) / 1000000.0;
+        }
+    }
+    return latency_bucket_value(LATENCY_BUCKETS - 1) / 1000000.0;
+}
+
+static void print_latency(const char *label, const LatencyHistogram *histogram) {
+    if (histogram->count == 0) return;
+    
+    printf("  %-10s %8llu req  avg %.2f  p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f ms\n",
+           label, histogram->count, histogram->total_us / 1000.0 / histogram->count,
+           latency_percentile(histogram, 50) * 1000, latency_percentile(histogram, 90) * 1000,
+           latency_percentile(histogram, 99) * 1000, latency_percentile(histogram, 99.9) * 1000);
 }
 
 void print_metrics() {
-    pthread_mutex_lock(&metrics_mutex);
+    MetricsShard *snapshot = metrics_snapshot();
+    if (!snapshot) return;
     
-    double avg_response_time = 0.0;
-    double cache_hit_rate = 0.0;
+    LatencyHistogram *all = calloc(1, sizeof(LatencyHistogram));
+    if (!all) {
+        free(snapshot);
+        return;
+    }
     
-    if (total_requests > 0) {
-        avg_response_time = total_response_time / total_requests;
-        cache_hit_rate = ((double)cache_hits / total_requests) * 100.0;
+    unsigned long long cache_hits, cache_misses;
+    metrics_totals(snapshot, all, &cache_hits, &cache_misses);
+    
+    double cache_hit_rate = 0.0;
+    if (all->count > 0) {
+        cache_hit_rate = ((double)cache_hits / all->count) * 100.0;
     }
     
     printf("\n=== SERVER METRICS ===\n");
-    printf("Total Requests: %ld\n", total_requests);
-    printf("Cache Hits: %ld\n", cache_hits);
-    printf("Cache Misses: %ld\n", cache_misses);
+    printf("Total Requests: %llu\n", all->count);
+    printf("Cache Hits: %llu\n", cache_hits);
+    printf("Cache Misses: %llu\n", cache_misses);
     printf("Cache Hit Rate: %.2f%%\n", cache_hit_rate);
-    printf("Average Response Time: %.2f ms\n", avg_response_time * 1000);
-    printf("Cache Size: %d entries\n", cache_size);
+    printf("Cache Size: %d entries (%zu bytes)\n", cache_entry_count(), cache_bytes_used());
+    if (shared_cache_enabled()) {
+        printf("Shared Cache: %d entries (%zu bytes), %llu hits, %llu misses (all processes)\n",
+               shared_cache_entry_count(), shared_cache_bytes_used(), shared_cache_hit_count(),
+               shared_cache_miss_count());
+    }
+    printf("Response Times:\n");
+    print_latency("all", all);
+    for (int c = 0; c < STATUS_CLASSES; c++) {
+        for (int hit = 1; hit >= 0; hit--) {
+            char label[16];
+            snprintf(label, sizeof(label), "%dxx %s", c + 1, hit ? "hit" : "miss");
+            print_latency(label, &snapshot->latency[c][hit]);
+        }
+    }
     printf("=======================\n\n");
     
-    pthread_mutex_unlock(&metrics_mutex);
+    free(all);
+    free(snapshot);
+}
+
+// HTML page for browsers and the demo UI
+void format_metrics_html(Buffer *out) {
+    MetricsShard *snapshot = metrics_snapshot();
+    LatencyHistogram *all = calloc(1, sizeof(LatencyHistogram));
+    unsigned long long cache_hits = 0;
+    unsigned long long cache_misses = 0;
+    
+    if (snapshot && all) {
+        metrics_totals(snapshot, all, &cache_hits, &cache_misses);
+    }
+    
+    unsigned long long total_requests = all ? all->count : 0;
+    double avg_response_time = 0.0;
+    double cache_hit_rate = 0.0;
+    if (total_requests > 0) {
+        avg_response_time = all->total_us / 1000.0 / total_requests;
+        cache_hit_rate = ((double)cache_hits / total_requests) * 100.0;
+    }
+    
+    buffer_printf(out,
+        "<!DOCTYPE html>\n"
+        "<html><head><title>Server Metrics</title></head><body>\n"
+        "<h1>Server Performance Metrics</h1>\n"
+        "<p><strong>Total Requests:</strong> %llu</p>\n"
+        "<p><strong>Cache Hits:</strong> %llu</p>\n"
+        "<p><strong>Cache Misses:</strong> %llu</p>\n"
+        "<p><strong>Cache Hit Rate:</strong> %.2f%%</p>\n"
+        "<p><strong>Average Response Time:</strong> %.2f ms</p>\n"
+        "<p><strong>Response Time p50 / p90 / p99 / p99.9:</strong> %.2f / %.2f / %.2f / %.2f ms</p>\n"
+        "<p><strong>Cache Size:</strong> %d entries (%zu bytes)</p>\n"
+        "<p><em>Auto-refresh every 5 seconds</em></p>\n"
+        "<script>setTimeout(function(){location.reload();}, 5000);</script>\n"
+        "</body></html>",
+        total_requests, cache_hits, cache_misses, cache_hit_rate, avg_response_time,
+        all ? latency_percentile(all, 50) * 1000 : 0.0,
+        all ? latency_percentile(all, 90) * 1000 : 0.0,
+        all ? latency_percentile(all, 99) * 1000 : 0.0,
+        all ? latency_percentile(all, 99.9) * 1000 : 0.0,
+        cache_entry_count(), cache_bytes_used());
+    
+    free(all);
+    free(snapshot);
+}
+
+static void format_latency_histogram(Buffer *out, const LatencyHistogram *histogram,
+                                     const char *labels) {
+    unsigned long long cumulative = 0;
+    int bucket = 0;
+    
+    for (size_t i = 0; i < NUM_LATENCY_BOUNDS; i++) {
+        while (bucket < LATENCY_BUCKETS &&
+               latency_bucket_value(bucket) / 1000000.0 <= latency_bounds[i]) {
+            cumulative += histogram->buckets[bucket++];
+        }
+        // OpenMetrics wants canonical floats, "1.0" rather than "1"
+        char le[32];
+        snprintf(le, sizeof(le), "%g", latency_bounds[i]);
+        if (!strpbrk(le, ".e")) strcat(le, ".0");
+        buffer_printf(out, "webserver_http_request_duration_seconds_bucket{%s,le=\"%s\"} %llu\n",
+                      labels, le, cumulative);
+    }
+    
+    // +Inf and _count come from the buckets too, not from count: shards are
+    // read while requests are recorded, and the two may disagree by a few
+    while (bucket < LATENCY_BUCKETS) {
+        cumulative += histogram->buckets[bucket++];
+    }
+    buffer_printf(out, "webserver_http_request_duration_seconds_bucket{%s,le=\"+Inf\"} %llu\n",
+                  labels, cumulative);
+    buffer_printf(out, "webserver_http_request_duration_seconds_count{%s} %llu\n",
+                  labels, cumulative);
+    buffer_printf(out, "webserver_http_request_duration_seconds_sum{%s} %.6f\n",
+                  labels, histogram->total_us / 1000000.0);
+}
+
+// OpenMetrics text exposition. Series that were never recorded are left
+// out to keep scrapes small.
+void format_openmetrics(Buffer *out) {
+    MetricsShard *snapshot = metrics_snapshot();
+    if (!snapshot) {
+        buffer_printf(out, "# EOF\n");
+        return;
+    }
+    
+    LatencyHistogram *all = calloc(1, sizeof(LatencyHistogram));
+    unsigned long long cache_hits = 0;
+    unsigned long long cache_misses = 0;
+    if (all) {
+        metrics_totals(snapshot, all, &cache_hits, &cache_misses);
+    }
+    
+    buffer_printf(out, "# TYPE webserver_http_requests counter\n"
+                       "# HELP webserver_http_requests HTTP requests by method and status code.\n");
+    for (int m = 0; m < METRIC_METHODS; m++) {
+        for (int c = 0; c < METRIC_CODES; c++) {
+            if (snapshot->requests[m][c] == 0) continue;
+            char code[8];
+            if (metric_codes[c]) {
+                snprintf(code, sizeof(code), "%d", metric_codes[c]);
+            } else {
+                strcpy(code, "other");
+            }
+            buffer_printf(out, "webserver_http_requests_total{method=\"%s\",code=\"%s\"} %llu\n",
+                          metric_methods[m], code, snapshot->requests[m][c]);
+        }
+    }
+    
+    buffer_printf(out,
+        "# TYPE webserver_http_request_bytes counter\n"
+        "# UNIT webserver_http_request_bytes bytes\n"
+        "# HELP webserver_http_request_bytes Bytes of request headers and bodies received.\n"
+        "webserver_http_request_bytes_total %llu\n"
+        "# TYPE webserver_http_response_bytes counter\n"
+        "# UNIT webserver_http_response_bytes bytes\n"
+        "# HELP webserver_http_response_bytes Bytes of response headers and bodies sent.\n"
+        "webserver_http_response_bytes_total %llu\n",
+        snapshot->bytes_in, snapshot->bytes_out);
+    
+    buffer_printf(out,
+        "# TYPE webserver_cache_hits counter\n"
+        "# HELP webserver_cache_hits Requests answered from the cache.\n"
+        "webserver_cache_hits_total %llu\n"
+        "# TYPE webserver_cache_misses counter\n"
+        "# HELP webserver_cache_misses Requests not answered from the cache.\n"
+        "webserver_cache_misses_total %llu\n"
+        "# TYPE webserver_cache_evictions counter\n"
+        "# HELP webserver_cache_evictions Entries evicted to make room.\n"
+        "webserver_cache_evictions_total %llu\n"
+        "# TYPE webserver_cache_entries gauge\n"
+        "# HELP webserver_cache_entries Files currently cached.\n"
+        "webserver_cache_entries %d\n"
+        "# TYPE webserver_cache_resident_bytes gauge\n"
+        "# UNIT webserver_cache_resident_bytes bytes\n"
+        "# HELP webserver_cache_resident_bytes Bytes held by cached files.\n"
+        "webserver_cache_resident_bytes %zu\n"
+        "# TYPE webserver_cache_capacity_bytes gauge\n"
+        "# UNIT webserver_cache_capacity_bytes bytes\n"
+        "# HELP webserver_cache_capacity_bytes Cache byte budget.\n"
+        "webserver_cache_capacity_bytes %zu\n",
+        cache_hits, cache_misses, cache_eviction_count(), cache_entry_count(),
+        cache_bytes_used(), cache_capacity());
+    
+    // Host-wide totals, the same from every process sharing the segment
+    if (shared_cache_enabled()) {
+        buffer_printf(out,
+            "# TYPE webserver_shared_cache_hits counter\n"
+            "# HELP webserver_shared_cache_hits Local cache misses found in the shared cache, all processes.\n"
+            "webserver_shared_cache_hits_total %llu\n"
+            "# TYPE webserver_shared_cache_misses counter\n"
+            "# HELP webserver_shared_cache_misses Local cache misses not in the shared cache, all processes.\n"
+            "webserver_shared_cache_misses_total %llu\n"
+            "# TYPE webserver_shared_cache_evictions counter\n"
+            "# HELP webserver_shared_cache_evictions Shared cache entries dropped to make room.\n"
+            "webserver_shared_cache_evictions_total %llu\n"
+            "# TYPE webserver_shared_cache_entries gauge\n"
+            "# HELP webserver_shared_cache_entries Files in the shared cache.\n"
+            "webserver_shared_cache_entries %d\n"
+            "# TYPE webserver_shared_cache_resident_bytes gauge\n"
+            "# UNIT webserver_shared_cache_resident_bytes bytes\n"
+            "# HELP webserver_shared_cache_resident_bytes Bytes held by the shared cache.\n"
+            "webserver_shared_cache_resident_bytes %zu\n"
+            "# TYPE webserver_shared_cache_capacity_bytes gauge\n"
+            "# UNIT webserver_shared_cache_capacity_bytes bytes\n"
+            "# HELP webserver_shared_cache_capacity_bytes Shared cache byte budget.\n"
+            "webserver_shared_cache_capacity_bytes %zu\n",
+            shared_cache_hit_count(), shared_cache_miss_count(), shared_cache_eviction_count(),
+            shared_cache_entry_count(), shared_cache_bytes_used(), shared_cache_capacity());
+    }
+    
+    buffer_printf(out,
+        "# TYPE webserver_queue_depth gauge\n"
+        "# HELP webserver_queue_depth Accepted connections waiting for a worker.\n"
+        "webserver_queue_depth %d\n"
+        "# TYPE webserver_active_connections gauge\n"
+        "# HELP webserver_active_connections Open client connections.\n"
+        "webserver_active_connections %d\n",
+        queue_depth(), __atomic_load_n(&active_connections, __ATOMIC_RELAXED));
+    
+    buffer_printf(out,
+        "# TYPE webserver_http_request_duration_seconds histogram\n"
+        "# UNIT webserver_http_request_duration_seconds seconds\n"
+        "# HELP webserver_http_request_duration_seconds Time to handle a request, by status class and cache result.\n");
+    for (int c = 0; c < STATUS_CLASSES; c++) {
+        for (int hit = 1; hit >= 0; hit--) {
+            if (snapshot->latency[c][hit].count == 0) continue;
+            char labels[64];
+            snprintf(labels, sizeof(labels), "code=\"%dxx\",cache=\"%s\"", c + 1, hit ? "hit" : "miss");
+            format_latency_histogram(out, &snapshot->latency[c][hit], labels);
+        }
+    }
+    
+    buffer_printf(out, "# EOF\n");
+    free(all);
+    free(snapshot);
 }
 
 void *metrics_thread(void *arg) {
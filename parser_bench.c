@@ -0,0 +1,207 @@
+#include "server.h"
+
+// Microbenchmark and fuzzer for the request parser.
+//
+//   ./parser_bench [iterations] [seed]
+//
+// The benchmark parses a few typical requests over and over. The fuzzer
+// mutates them at random and checks that feeding the result in random
+// pieces gives the same answer as parsing it in one go, and that every
+// header slice points inside the buffer. Exits non-zero on the first
+// mismatch, printing the seed that reproduces it.
+
+static const char *samples[] = {
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+    
+    "GET /style.css?v=3 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=4f2a9c1e7b; theme=dark; consent=yes\r\n"
+    "If-None-Match: \"1a2b-65a1b2c3-4d5e\"\r\n"
+    "If-Modified-Since: Mon, 15 Jan 2024 10:00:00 GMT\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "\r\n",
+    
+    "GET /video.mp4 HTTP/1.1\r\n"
+    "Host: media.example.com\r\n"
+    "Range: bytes=0-1023, 4096-\r\n"
+    "If-Range: \"9f-65a1b2c3-77\"\r\n"
+    "\r\n",
+    
+    "POST /submit HTTP/1.0\r\n"
+    "Content-Length: 11\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+    "hello=world",
+};
+
+#define NUM_SAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_benchmark(long iterations) {
+    HttpParser parser;
+    
+    printf("%-12s %10s %12s %10s\n", "request", "bytes", "ns/request", "MB/s");
+    for (size_t s = 0; s < NUM_SAMPLES; s++) {
+        size_t len = strlen(samples[s]);
+        int ok = 1;
+        
+        double start = now_seconds();
+        for (long i = 0; i < iterations; i++) {
+            http_parser_init(&parser);
+            ok &= http_parse(&parser, samples[s], len) == 1;
+        }
+        double elapsed = now_seconds() - start;
+        
+        if (!ok) {
+            printf("sample %zu did not parse\n", s);
+            exit(1);
+        }
+        printf("sample %-5zu %10zu %12.1f %10.1f\n", s, len, elapsed * 1e9 / iterations,
+               len * (double)iterations / elapsed / (1024 * 1024));
+    }
+}
+
+// Bytes that steer the parser into its interesting branches
+static const char fuzz_bytes[] = ":\r\n \t/?0123456789HTP.,;=\"\x7f";
+
+static size_t mutate(char *buf, size_t len, size_t cap) {
+    int mutations = 1 + rand() % 4;
+    
+    for (int m = 0; m < mutations; m++) {
+        size_t pos = len ? (size_t)rand() % len : 0;
+        
+        switch (rand() % 5) {
+        case 0:  // Replace a byte with anything
+            if (len) buf[pos] = rand() % 256;
+            break;
+        case 1:  // Replace a byte with a delimiter
+            if (len) buf[pos] = fuzz_bytes[rand() % (sizeof(fuzz_bytes) - 1)];
+            break;
+        case 2:  // Insert a delimiter
+            if (len < cap) {
+                memmove(buf + pos + 1, buf + pos, len - pos);
+                buf[pos] = fuzz_bytes[rand() % (sizeof(fuzz_bytes) - 1)];
+                len++;
+            }
+            break;
+        case 3:  // Delete a byte
+            if (len) {
+                memmove(buf + pos, buf + pos + 1, len - pos - 1);
+                len--;
+            }
+            break;
+        case 4:  // Repeat a chunk, which duplicates headers and grows lines
+            {
+                size_t chunk = 1 + rand() % 64;
+                if (pos + chunk > len) chunk = len - pos;
+                if (len + chunk > cap) chunk = cap - len;
+                memmove(buf + pos + chunk, buf + pos, len - pos);
+                len += chunk;
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+static int slice_in_buffer(Slice slice, const char *buf, size_t len) {
+    if (!slice.data) return slice.len == 0;
+    return slice.data >= buf && slice.data + slice.len <= buf + len;
+}
+
+static int check_slices(const HttpRequest *req, const char *buf, size_t len) {
+    const Slice *known[] = { &req->query, &req->host, &req->connection, &req->accept,
+                             &req->accept_encoding, &req->if_none_match,
+                             &req->if_modified_since, &req->range, &req->if_range };
+    
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+        if (!slice_in_buffer(*known[i], buf, len)) return 0;
+    }
+    for (int i = 0; i < req->num_headers; i++) {
+        if (!slice_in_buffer(req->headers[i].name, buf, len) ||
+            !slice_in_buffer(req->headers[i].value, buf, len)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int same_outcome(int result_a, const HttpParser *a, int result_b, const HttpParser *b) {
+    if (result_a != result_b) return 0;
+    if (result_a < 0) return a->error_status == b->error_status;
+    if (result_a == 0) return 1;
+    
+    return a->req.length == b->req.length &&
+           a->req.keep_alive == b->req.keep_alive &&
+           a->req.num_headers == b->req.num_headers &&
+           strcmp(a->req.method, b->req.method) == 0 &&
+           strcmp(a->req.path, b->req.path) == 0;
+}
+
+static void run_fuzzer(long iterations, unsigned int seed) {
+    static char buf[BUFFER_SIZE];
+    long complete = 0, errors = 0;
+    
+    srand(seed);
+    for (long i = 0; i < iterations; i++) {
+        const char *sample = samples[rand() % NUM_SAMPLES];
+        size_t len = strlen(sample);
+        memcpy(buf, sample, len);
+        len = mutate(buf, len, BUFFER_SIZE - 1);
+        
+        // The whole input at once
+        HttpParser whole;
+        http_parser_init(&whole);
+        int whole_result = http_parse(&whole, buf, len);
+        
+        // The same input arriving in random pieces
+        HttpParser split;
+        http_parser_init(&split);
+        int split_result = 0;
+        size_t fed = 0;
+        while (split_result == 0 && fed < len) {
+            fed += 1 + rand() % (len - fed);
+            split_result = http_parse(&split, buf, fed);
+        }
+        
+        if (!same_outcome(whole_result, &whole, split_result, &split) ||
+            !check_slices(&whole.req, buf, len) || !check_slices(&split.req, buf, len) ||
+            (whole_result == 1 && whole.req.length > len)) {
+            printf("Mismatch at iteration %ld (seed %u): whole %d/%d, split %d/%d\n",
+                   i, seed, whole_result, whole.error_status, split_result, split.error_status);
+            fwrite(buf, 1, len, stdout);
+            printf("\n");
+            exit(1);
+        }
+        
+        if (whole_result == 1) complete++;
+        if (whole_result < 0) errors++;
+    }
+    
+    printf("Fuzzed %ld requests (seed %u): %ld complete, %ld rejected, %ld incomplete\n",
+           iterations, seed, complete, errors, iterations - complete - errors);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    unsigned int seed = argc > 2 ? (unsigned int)atol(argv[2]) : (unsigned int)time(NULL);
+    if (iterations <= 0) iterations = 1000000;
+    
+    run_benchmark(iterations);
+    run_fuzzer(iterations, seed);
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include "server.h"
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+// Prefork mode: the master forks one worker process per CPU and then only
+// supervises them. Every worker opens its own SO_REUSEPORT listener on the
+// shared port, so the kernel spreads connections across processes with no
+// proxy hop, and a worker that crashes takes only its own connections
+// with it. The master replaces workers that die and passes SIGINT and
+// SIGTERM on to all of them.
+typedef struct {
+    pid_t pid;
+    time_t started;
+} WorkerProcess;
+
+static WorkerProcess *workers = NULL;
+static int num_processes = 0;
+static int cpus[CPU_SETSIZE];   // CPUs the master may run on, in order
+static int num_cpus = 0;
+static volatile sig_atomic_t stop_signal = 0;
+
+static void master_signal_handler(int signum) {
+    stop_signal = signum;
+}
+
+// Returns 0 in the new worker, 1 in the master and -1 if fork() failed
+static int spawn_worker(int id, int pin_cpus) {
+    pid_t master = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork worker process");
+        return -1;
+    }
+    
+    if (pid > 0) {
+        workers[id].pid = pid;
+        workers[id].started = time(NULL);
+        return 1;
+    }
+    
+    // Take the worker down with the master, even if it is killed outright
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != master) {
+        exit(0);
+    }
+    
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    
+    if (pin_cpus && num_cpus > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[id % num_cpus], &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("Failed to pin worker process");
+        }
+    }
+    return 0;
+}
+
+static int find_worker(pid_t pid) {
+    for (int i = 0; i < num_processes; i++) {
+        if (workers[i].pid == pid) return i;
+    }
+    return -1;
+}
+
+static void stop_workers() {
+    for (int i = 0; i < num_processes; i++) {
+        if (workers[i].pid > 0) {
+            kill(workers[i].pid, SIGTERM);
+        }
+    }
+    
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, 0)) > 0 || (pid < 0 && errno == EINTR)) {
+        int id = pid > 0 ? find_worker(pid) : -1;
+        if (id >= 0) workers[id].pid = 0;
+    }
+}
+
+// Forks the workers and supervises them. Returns only in a worker process,
+// with that worker's index; the master exits once the workers are gone.
+int start_worker_processes(int processes, int pin_cpus) {
+    num_processes = processes;
+    workers = calloc(processes, sizeof(WorkerProcess));
+    if (!workers) {
+        perror("Failed to allocate worker table");
+        exit(1);
+    }
+    
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) cpus[num_cpus++] = cpu;
+        }
+    }
+    
+    // No SA_RESTART, so a signal wakes the master out of waitpid()
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = master_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    
+    // Whatever is buffered now would otherwise be printed once per worker
+    fflush(stdout);
+    
+    for (int i = 0; i < processes; i++) {
+        int result = spawn_worker(i, pin_cpus);
+        if (result == 0) return i;
+        if (result < 0) {
+            stop_workers();
+            exit(1);
+        }
+    }
+    
+    printf("Master %d started %d worker processes%s\n", (int)getpid(), processes,
+           pin_cpus ? " pinned to CPUs" : "");
+    
+    int exit_code = 0;
+    while (!stop_signal) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("waitpid failed");
+            exit_code = 1;
+            break;
+        }
+        
+        int id = find_worker(pid);
+        if (id < 0 || stop_signal) continue;
+        workers[id].pid = 0;
+        
+        int lifetime = time(NULL) - workers[id].started;
+        if (WIFSIGNALED(status)) {
+            printf("Worker %d (pid %d) killed by signal %d, restarting\n", id, (int)pid,
+                   WTERMSIG(status));
+        } else if (WEXITSTATUS(status) != 0 && lifetime < WORKER_RESTART_DELAY) {
+            // Failed during startup (port taken, out of memory): restarting
+            // would only fail the same way
+            printf("Worker %d (pid %d) failed to start, shutting down\n", id, (int)pid);
+            exit_code = 1;
+            break;
+        } else {
+            printf("Worker %d (pid %d) exited with status %d, restarting\n", id, (int)pid,
+                   WEXITSTATUS(status));
+        }
+        
+        // Don't spin on a worker that crashes as soon as it starts
+        if (lifetime < WORKER_RESTART_DELAY) {
+            sleep(WORKER_RESTART_DELAY);
+            if (stop_signal) break;
+        }
+        
+        fflush(stdout);
+        int result = spawn_worker(id, pin_cpus);
+        if (result == 0) return id;
+        if (result < 0) {
+            exit_code = 1;
+            break;
+        }
+    }
+    
+    if (stop_signal) {
+        printf("\nReceived signal %d, stopping worker processes...\n", (int)stop_signal);
+    }
+    stop_workers();
+    printf("Master shutdown complete\n");
+    exit(exit_code);
+}
@@ -0,0 +1,105 @@
+#include "server.h"
+#include <stdint.h>
+
+// Range header parsing (RFC 9110 section 14). Only byte ranges are
+// understood. Ranges are sorted and overlapping or adjacent ones merged,
+// so a client cannot make us send the same bytes many times over.
+
+// Read a decimal number. Returns the position after it, or NULL if there
+// are no digits or the value would overflow.
+static const char *parse_position(const char *p, const char *end, size_t *value) {
+    const char *start = p;
+    size_t result = 0;
+    
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (p - start >= 18) return NULL;
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+    
+    if (p == start) return NULL;
+    *value = result;
+    return p;
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    const ByteRange *ra = a;
+    const ByteRange *rb = b;
+    if (ra->start != rb->start) return ra->start < rb->start ? -1 : 1;
+    return 0;
+}
+
+// Turn a Range header into byte ranges of a body of the given size.
+// Returns the number of ranges, 0 if the header should be ignored (not
+// byte ranges, malformed, or asking for too many) and -1 if no range
+// overlaps the body (416 Range Not Satisfiable).
+int parse_range(Slice value, size_t size, RangeSet *set) {
+    const char *p = value.data;
+    const char *end = value.data + value.len;
+    int specs = 0;
+    
+    set->count = 0;
+    if (value.len < 6 || strncasecmp(p, "bytes=", 6) != 0) return 0;
+    p += 6;
+    
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+        
+        size_t first, last;
+        if (*p == '-') {
+            // Suffix range: the last N bytes
+            size_t suffix;
+            p = parse_position(p + 1, end, &suffix);
+            if (!p) return 0;
+            if (suffix == 0 || size == 0) {
+                first = size;  // Unsatisfiable
+                last = size;
+            } else {
+                first = suffix >= size ? 0 : size - suffix;
+                last = size - 1;
+            }
+        } else {
+            p = parse_position(p, end, &first);
+            if (!p || p == end || *p != '-') return 0;
+            p++;
+            last = SIZE_MAX;
+            if (p < end && *p >= '0' && *p <= '9') {
+                p = parse_position(p, end, &last);
+                if (!p || last < first) return 0;
+            }
+        }
+        
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p != ',') return 0;
+        
+        if (++specs > MAX_RANGES) return 0;
+        
+        // Ranges starting past the end are dropped, the rest clipped
+        if (first >= size) continue;
+        if (last >= size) last = size - 1;
+        set->ranges[set->count].start = first;
+        set->ranges[set->count].length = last - first + 1;
+        set->count++;
+    }
+    
+    if (specs == 0) return 0;
+    if (set->count == 0) return -1;
+    
+    qsort(set->ranges, set->count, sizeof(ByteRange), compare_ranges);
+    int merged = 0;
+    for (int i = 1; i < set->count; i++) {
+        ByteRange *prev = &set->ranges[merged];
+        ByteRange *range = &set->ranges[i];
+        if (range->start <= prev->start + prev->length) {
+            size_t range_end = range->start + range->length;
+            if (range_end > prev->start + prev->length) {
+                prev->length = range_end - prev->start;
+            }
+        } else {
+            set->ranges[++merged] = *range;
+        }
+    }
+    set->count = merged + 1;
+    return set->count;
+}
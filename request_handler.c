@@ -1,80 +1,193 @@
 #include "server.h"
 
-void handle_client(int client_sock) {
-    struct timeval start_time, end_time;
-    gettimeofday(&start_time, NULL);
+// Files at least this large are sent with sendfile() instead of cached
+size_t sendfile_threshold = SENDFILE_THRESHOLD;
+
+// Fill in the request fields derived from its header slices
+static void prepare_request(HttpRequest *req) {
+    req->accepted_encodings = 1 << ENCODING_IDENTITY;
+    if (req->accept_encoding.data) {
+        req->accepted_encodings = parse_accept_encoding(req->accept_encoding.data,
+                                                        req->accept_encoding.len);
+    }
     
-    char buffer[BUFFER_SIZE];
-    char method[16], path[256], protocol[16];
+    // Browsers get the HTML metrics page, scrapers get OpenMetrics
+    req->accept_html = req->accept.data &&
+                       memmem(req->accept.data, req->accept.len, "text/html", 9) != NULL;
     
-    // Read HTTP request
-    int bytes_read = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_read <= 0) {
-        gettimeofday(&end_time, NULL);
-        double response_time = get_time_diff(start_time, end_time);
-        record_request(0, response_time);
-        return;
+    req->modified_since = 0;
+    if (req->if_modified_since.data && req->if_modified_since.len < 64) {
+        char date[64];
+        struct tm tm;
+        memcpy(date, req->if_modified_since.data, req->if_modified_since.len);
+        date[req->if_modified_since.len] = '\0';
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+            req->modified_since = timegm(&tm);
+        }
+    }
+}
+
+// Returns 1 if the client's cached copy is still current. If-None-Match
+// wins over If-Modified-Since when both are present (RFC 7232 section 6).
+static int request_not_modified(HttpRequest *req, const char *etag, time_t mtime) {
+    if (req->if_none_match.data) {
+        const char *p = req->if_none_match.data;
+        const char *end = p + req->if_none_match.len;
+        size_t etag_len = strlen(etag);
+        
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == ',')) p++;
+            if (p == end) break;
+            if (*p == '*') return 1;
+            if (end - p > 2 && strncmp(p, "W/", 2) == 0) p += 2;  // Weak comparison
+            
+            const char *comma = memchr(p, ',', end - p);
+            size_t len = (comma ? comma : end) - p;
+            while (len > 0 && p[len - 1] == ' ') len--;
+            
+            if (len == etag_len && strncmp(p, etag, len) == 0) return 1;
+            if (!comma) break;
+            p = comma + 1;
+        }
+        return 0;
     }
     
-    buffer[bytes_read] = '\0';
+    return req->modified_since && mtime <= req->modified_since;
+}
+
+// Whether a Range header still applies. If-Range makes it conditional on
+// the client's copy being current: a strong ETag must match exactly, a
+// date must equal Last-Modified. Otherwise the whole body is sent.
+static int request_range_applies(HttpRequest *req, const char *etag, time_t mtime) {
+    if (!req->if_range.data) return 1;
     
-    // Parse HTTP request line
-    if (sscanf(buffer, "%s %s %s", method, path, protocol) != 3) {
-        send_500(client_sock);
-        gettimeofday(&end_time, NULL);
-        double response_time = get_time_diff(start_time, end_time);
-        record_request(0, response_time);
-        return;
+    Slice value = req->if_range;
+    if (value.len > 0 && value.data[0] == '"') {
+        return value.len == strlen(etag) && memcmp(value.data, etag, value.len) == 0;
+    }
+    if (value.len >= 64 || value.len == 0 || value.data[0] == 'W') {
+        return 0;  // Weak validators never match
     }
     
-    printf("Request: %s %s %s\n", method, path, protocol);
+    char date[64];
+    struct tm tm;
+    memcpy(date, value.data, value.len);
+    date[value.len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    return strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) && timegm(&tm) == mtime;
+}
+
+// Serve every complete request buffered in conn->in, in order. Stops early
+// when output is still queued on a non-blocking socket so a pipelining
+// client cannot make us buffer unbounded responses. Returns the number of
+// requests served.
+int process_requests(Connection *conn) {
+    int served = 0;
     
-    // Handle special metrics endpoint
-    if (strcmp(path, "/metrics") == 0) {
-        pthread_mutex_lock(&metrics_mutex);
+    // Deferred connections queue every pipelined response and send them
+    // together; the others send each one before parsing the next
+    while (!conn->close_after_write && (conn->deferred || !conn_has_pending_output(conn))) {
+        int result = http_parse(&conn->parser, conn->in, conn->in_len);
+        if (result == 0) break;
         
-        char metrics_body[1024];
-        double avg_response_time = 0.0;
-        double cache_hit_rate = 0.0;
+        // Answer a bad request and drop the connection, since we can no
+        // longer tell where the next request would start
+        if (result < 0) {
+            unsigned long long bytes_before = conn->bytes_out;
+            int status = conn->parser.error_status;
+            conn->close_after_write = 1;
+            send_error(conn, status);
+            record_request(conn->parser.req.method, status, 0, conn->in_len,
+                           conn->bytes_out - bytes_before, 0.0);
+            conn->in_len = 0;
+            break;
+        }
         
-        if (total_requests > 0) {
-            avg_response_time = total_response_time / total_requests;
-            cache_hit_rate = ((double)cache_hits / total_requests) * 100.0;
+        HttpRequest *req = &conn->parser.req;
+        prepare_request(req);
+        
+        conn->requests_served++;
+        if (!req->keep_alive || conn->requests_served >= KEEPALIVE_MAX_REQUESTS) {
+            conn->close_after_write = 1;
         }
         
-        snprintf(metrics_body, sizeof(metrics_body),
-            "<!DOCTYPE html>\n"
-            "<html><head><title>Server Metrics</title></head><body>\n"
-            "<h1>Server Performance Metrics</h1>\n"
-            "<p><strong>Total Requests:</strong> %ld</p>\n"
-            "<p><strong>Cache Hits:</strong> %ld</p>\n"
-            "<p><strong>Cache Misses:</strong> %ld</p>\n"
-            "<p><strong>Cache Hit Rate:</strong> %.2f%%</p>\n"
-            "<p><strong>Average Response Time:</strong> %.2f ms</p>\n"
-            "<p><strong>Cache Size:</strong> %d entries</p>\n"
-            "<p><em>Auto-refresh every 5 seconds</em></p>\n"
-            "<script>setTimeout(function(){location.reload();}, 5000);</script>\n"
-            "</body></html>",
-            total_requests, cache_hits, cache_misses, cache_hit_rate,
-            avg_response_time * 1000, cache_size);
+        serve_request(conn, req);
+        served++;
         
-        pthread_mutex_unlock(&metrics_mutex);
+        // Shift any pipelined bytes to the front of the buffer. The header
+        // slices point into it, so this waits until the request is served.
+        conn->in_len -= req->length;
+        memmove(conn->in, conn->in + req->length, conn->in_len);
+        http_parser_init(&conn->parser);
+    }
+    
+    return served;
+}
+
+void handle_client(int client_sock) {
+    Connection conn;
+    conn_init(&conn, client_sock, 0);
+    
+    struct sockaddr_in peer_addr;
+    socklen_t peer_len = sizeof(peer_addr);
+    if (getpeername(client_sock, (struct sockaddr *)&peer_addr, &peer_len) == 0) {
+        inet_ntop(AF_INET, &peer_addr.sin_addr, conn.peer, sizeof(conn.peer));
+    }
+    __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    
+    struct pollfd pfd;
+    pfd.fd = client_sock;
+    pfd.events = POLLIN;
+    
+    while (1) {
+        // Wait for the next request, but never longer than the idle timeout
+        if (poll(&pfd, 1, KEEPALIVE_TIMEOUT * 1000) <= 0) {
+            break;
+        }
         
-        send_response(client_sock, "200 OK", "text/html", metrics_body, strlen(metrics_body));
+        int bytes_read = recv(client_sock, conn.in + conn.in_len, BUFFER_SIZE - 1 - conn.in_len, 0);
+        if (bytes_read <= 0) {
+            break;
+        }
+        conn.in_len += bytes_read;
         
-        gettimeofday(&end_time, NULL);
-        double response_time = get_time_diff(start_time, end_time);
-        record_request(0, response_time);
-        return;
+        process_requests(&conn);
+        if (conn.close_after_write) {
+            break;
+        }
+    }
+    
+    conn_free(&conn);
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+// Send the response for one request and return its status code. Sets
+// *cache_hit when the body came from the cache.
+static int route_request(Connection *conn, HttpRequest *req, int *cache_hit) {
+    const char *method = req->method;
+    const char *path = req->path;
+    
+    // Handle special metrics endpoint: OpenMetrics for scrapers, the HTML
+    // page for browsers
+    if (strcmp(path, "/metrics") == 0) {
+        Buffer body = { NULL, 0, 0 };
+        if (req->accept_html) {
+            format_metrics_html(&body);
+            send_response(conn, "200 OK", "text/html", body.data, body.len);
+        } else {
+            format_openmetrics(&body);
+            send_response(conn, "200 OK", "application/openmetrics-text; version=1.0.0; charset=utf-8",
+                          body.data, body.len);
+        }
+        buffer_free(&body);
+        return 200;
     }
     
     // Only handle GET requests for files
     if (strcmp(method, "GET") != 0) {
-        send_404(client_sock);
-        gettimeofday(&end_time, NULL);
-        double response_time = get_time_diff(start_time, end_time);
-        record_request(0, response_time);
-        return;
+        send_404(conn);
+        return 404;
     }
     
     // Remove leading slash and handle root path
@@ -85,101 +198,579 @@ void handle_client(int client_sock) {
         strcpy(filename, path + 1); // Remove leading slash
     }
     
-    // Security: prevent directory traversal
-    if (strstr(filename, "..") != NULL) {
-        send_404(client_sock);
-        gettimeofday(&end_time, NULL);
-        double response_time = get_time_diff(start_time, end_time);
-        record_request(0, response_time);
-        return;
+    // Security: prevent directory traversal and absolute paths
+    if (strstr(filename, "..") != NULL || filename[0] == '/') {
+        send_404(conn);
+        return 404;
     }
     
-    int cache_hit = 0;
-    char *file_content = NULL;
-    size_t file_size = 0;
-    
-    // Try to get from cache first
-    CacheEntry *cached = get_from_cache(filename);
-    if (cached) {
-        file_content = cached->content;
-        file_size = cached->size;
-        cache_hit = 1;
-        printf("Cache HIT for %s\n", filename);
+    // Try to get from cache first. The blob comes back pinned, so it
+    // stays valid while we send it even if another thread evicts it.
+    CacheBlob *blob = cache_lookup(filename, req->accepted_encodings);
+    if (blob) {
+        *cache_hit = 1;
+        log_debug("Cache HIT for %s", filename);
     } else {
-        printf("Cache MISS for %s\n", filename);
+        log_debug("Cache MISS for %s", filename);
         
-        // Read file from disk
-        FILE *file = fopen(filename, "rb");
-        if (!file) {
-            send_404(client_sock);
-            gettimeofday(&end_time, NULL);
-            double response_time = get_time_diff(start_time, end_time);
-            record_request(0, response_time);
-            return;
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            if (fd >= 0) close(fd);
+            send_404(conn);
+            return 404;
         }
         
-        // Get file size
-        fseek(file, 0, SEEK_END);
-        file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        
-        // Read file content
-        char *buffer = malloc(file_size);
-        if (!buffer) {
-            fclose(file);
-            send_500(client_sock);
-            gettimeofday(&end_time, NULL);
-            double response_time = get_time_diff(start_time, end_time);
-            record_request(0, response_time);
-            return;
+        // Large files, and files the cache would reject anyway, go
+        // straight from the page cache to the socket
+        size_t file_size = st.st_size;
+        if (file_size >= sendfile_threshold || file_size > cache_max_entry_size()) {
+            return send_file_response(conn, req, filename, &st, fd);
         }
         
-        fread(buffer, 1, file_size, file);
-        fclose(file);
+        // Read file from disk straight into blobs the cache can adopt,
+        // unless another process on this host already did
+        CacheBlob *variants[ENCODING_COUNT];
+        int loaded = build_file_variants(fd, filename, &st, variants);
+        close(fd);
+        if (loaded < 0) {
+            send_500(conn);
+            return 500;
+        }
+        *cache_hit = loaded > 0;
         
-        // Add to cache
-        add_to_cache(filename, buffer, file_size);
-        file_content = buffer;
+        // Add to cache and watch for changes, then keep a pin on just the
+        // variant we send
+        if (cache_insert(filename, variants)) {
+            watch_cached_file(filename);
+        }
+        blob = select_variant(variants, req->accepted_encodings);
+        blob_retain(blob);
+        release_variants(variants);
     }
     
-    // Send response
-    char *content_type = get_content_type(filename);
-    send_response(client_sock, "200 OK", content_type, file_content, file_size);
+    int status = send_cached_response(conn, req, filename, blob);
+    blob_release(blob);
+    return status;
+}
+
+// Answer one parsed request, writing the response through conn_send().
+// Used by both the thread-pool workers and the epoll loops.
+void serve_request(Connection *conn, HttpRequest *req) {
+    struct timeval start_time, end_time;
+    gettimeofday(&start_time, NULL);
+    unsigned long long bytes_before = conn->bytes_out;
     
-    // Free allocated memory if not from cache
-    if (!cache_hit && file_content) {
-        free(file_content);
-    }
+    int cache_hit = 0;
+    int status = route_request(conn, req, &cache_hit);
     
     gettimeofday(&end_time, NULL);
     double response_time = get_time_diff(start_time, end_time);
-    record_request(cache_hit, response_time);
+    size_t bytes = conn->bytes_out - bytes_before;
+    record_request(req->method, status, cache_hit, req->length, bytes, response_time);
+    log_access(conn, req, status, cache_hit, bytes, response_time);
+}
+
+// One encoding of one version of a file, as described by its headers
+typedef struct {
+    const char *filename;
+    time_t mtime;                // Of the original file
+    size_t length;               // Body bytes in this encoding
+    int encoding;
+    int vary;                    // Other encodings exist
+    char etag[ETAG_SIZE];
+} FileVariant;
+
+// Strong validator derived from size, mtime and inode, made distinct per
+// encoding since the bytes differ
+static void init_variant(FileVariant *variant, const char *filename, const struct stat *st,
+                         size_t length, int encoding, int vary) {
+    variant->filename = filename;
+    variant->mtime = st->st_mtime;
+    variant->length = length;
+    variant->encoding = encoding;
+    variant->vary = vary;
+    snprintf(variant->etag, sizeof(variant->etag), "\"%llx-%llx-%llx%s%s\"",
+             (unsigned long long)st->st_size, (unsigned long long)st->st_mtime,
+             (unsigned long long)st->st_ino, encoding == ENCODING_IDENTITY ? "" : "-",
+             encoding == ENCODING_IDENTITY ? "" : encoding_name(encoding));
+}
+
+// Describe a cached blob the way init_variant() describes a file
+static void blob_variant(FileVariant *variant, const char *filename, const CacheBlob *blob) {
+    variant->filename = filename;
+    variant->mtime = blob->mtime;
+    variant->length = blob->size;
+    variant->encoding = blob->encoding;
+    variant->vary = blob->vary;
+    strcpy(variant->etag, blob->etag);
+}
+
+// Full response header for a file: 200, 304, or 206 with the caller's
+// Content-Type/Content-Length/Content-Range lines in content_headers.
+// Only the status and the Connection header depend on the request for
+// whole files, which is why cached blobs keep one copy of the 200 and 304
+// headers per combination.
+static int format_file_header(char *header, size_t header_size, const FileVariant *variant,
+                              int status, const char *content_headers, int close_after_write) {
+    char last_modified[64];
+    struct tm tm;
+    gmtime_r(&variant->mtime, &tm);
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    
+    char encoding_header[64] = "";
+    if (variant->encoding != ENCODING_IDENTITY) {
+        snprintf(encoding_header, sizeof(encoding_header), "Content-Encoding: %s\r\n",
+                 encoding_name(variant->encoding));
+    }
+    const char *vary_header = variant->vary ? "Vary: Accept-Encoding\r\n" : "";
+    
+    // A 304 repeats the validators but carries no body or body metadata
+    if (status == 304) {
+        return snprintf(header, header_size,
+            "HTTP/1.1 304 Not Modified\r\n"
+            "ETag: %s\r\n"
+            "Last-Modified: %s\r\n"
+            "Cache-Control: public, max-age=%d\r\n"
+            "%s"
+            "Connection: %s\r\n"
+            "Server: Advanced-Multithreaded-Server/1.0\r\n"
+            "\r\n",
+            variant->etag, last_modified, STATIC_MAX_AGE, vary_header,
+            close_after_write ? "close" : "keep-alive");
+    }
+    
+    char full_body_headers[256];
+    if (!content_headers) {
+        snprintf(full_body_headers, sizeof(full_body_headers),
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %zu\r\n",
+                 get_content_type(variant->filename), variant->length);
+        content_headers = full_body_headers;
+    }
+    
+    return snprintf(header, header_size,
+        "HTTP/1.1 %d %s\r\n"
+        "%s"
+        "Accept-Ranges: bytes\r\n"
+        "%s"
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "Cache-Control: public, max-age=%d\r\n"
+        "%s"
+        "Connection: %s\r\n"
+        "Server: Advanced-Multithreaded-Server/1.0\r\n"
+        "\r\n",
+        status, status_reason(status), content_headers, encoding_header,
+        variant->etag, last_modified, STATIC_MAX_AGE, vary_header,
+        close_after_write ? "close" : "keep-alive");
+}
+
+// Allocate a blob for a variant with all of its prebuilt response headers,
+// so cache hits need no formatting at all. The caller fills in the body.
+static CacheBlob *new_file_blob(const FileVariant *variant) {
+    char headers[2][2][1024];
+    int header_len[2][2];
+    size_t header_total = 0;
+    
+    for (int status = 0; status < 2; status++) {
+        for (int i = 0; i < 2; i++) {
+            header_len[status][i] = format_file_header(headers[status][i], sizeof(headers[status][i]),
+                                                       variant, status ? 304 : 200, NULL, i);
+            header_total += header_len[status][i];
+        }
+    }
+    
+    // Body first, then every header variant, all in one allocation
+    CacheBlob *blob = blob_alloc(variant->length, header_total);
+    if (!blob) {
+        return NULL;
+    }
+    
+    char *header_space = blob->data + blob->size;
+    for (int status = 0; status < 2; status++) {
+        for (int i = 0; i < 2; i++) {
+            memcpy(header_space, headers[status][i], header_len[status][i]);
+            blob->header[status][i] = header_space;
+            blob->header_len[status][i] = header_len[status][i];
+            header_space += header_len[status][i];
+        }
+    }
+    strcpy(blob->etag, variant->etag);
+    blob->mtime = variant->mtime;
+    blob->encoding = variant->encoding;
+    blob->vary = variant->vary;
+    return blob;
+}
+
+// Read a variant's body from fd into a new blob
+static CacheBlob *read_file_blob(int fd, const FileVariant *variant) {
+    CacheBlob *blob = new_file_blob(variant);
+    if (!blob) {
+        return NULL;
+    }
+    
+    size_t total = 0;
+    while (total < blob->size) {
+        ssize_t n = read(fd, blob->data + total, blob->size - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        total += n;
+    }
+    
+    if (total != blob->size) {
+        blob_release(blob);
+        return NULL;
+    }
+    return blob;
+}
+
+static void stamp_file(FileStamp *stamp, const struct stat *st) {
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->dev = st->st_dev;
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime = st->st_mtim;
+}
+
+// A precompressed sibling is served only if it is a regular file at least
+// as new as the file itself
+static int sibling_usable(const struct stat *sibling_st, const struct stat *st) {
+    return S_ISREG(sibling_st->st_mode) && sibling_st->st_mtime >= st->st_mtime;
+}
+
+// Build every encoding we can serve for an open file: the identity body,
+// precompressed .gz/.br siblings that are at least as new as the file,
+// and otherwise a gzip body compressed here, once per file version and
+// host. Returns 1 if the shared cache had them, 0 if they were built from
+// disk (and published to the shared cache) and -1 on failure;
+// variants[ENCODING_IDENTITY] is always set on success.
+int build_file_variants(int fd, const char *filename, const struct stat *st,
+                        CacheBlob *variants[ENCODING_COUNT]) {
+    int sibling_fd[ENCODING_COUNT];
+    struct stat sibling_st[ENCODING_COUNT];
+    FileStamp stamps[ENCODING_COUNT];
+    
+    // A shared copy is only good if the siblings are unchanged as well
+    memset(stamps, 0, sizeof(stamps));
+    stamp_file(&stamps[ENCODING_IDENTITY], st);
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODING_COUNT; i++) {
+        char sibling[MAX_FILENAME + 8];
+        snprintf(sibling, sizeof(sibling), "%s%s", filename, encoding_extension(i));
+        if (stat(sibling, &sibling_st[i]) == 0 && sibling_usable(&sibling_st[i], st)) {
+            stamp_file(&stamps[i], &sibling_st[i]);
+        }
+    }
+    if (shared_cache_load(filename, stamps, variants) == 0) {
+        return 1;
+    }
+    
+    int vary = is_compressible(get_content_type(filename));
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        variants[i] = NULL;
+        sibling_fd[i] = -1;
+    }
+    
+    // Stamps are taken again from what is actually read
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODING_COUNT; i++) {
+        char sibling[MAX_FILENAME + 8];
+        snprintf(sibling, sizeof(sibling), "%s%s", filename, encoding_extension(i));
+        memset(&stamps[i], 0, sizeof(stamps[i]));
+        int sfd = open(sibling, O_RDONLY | O_CLOEXEC);
+        if (sfd < 0) continue;
+        
+        if (fstat(sfd, &sibling_st[i]) == 0 && sibling_usable(&sibling_st[i], st)) {
+            sibling_fd[i] = sfd;
+            stamp_file(&stamps[i], &sibling_st[i]);
+            vary = 1;
+        } else {
+            close(sfd);
+        }
+    }
+    
+    FileVariant variant;
+    init_variant(&variant, filename, st, st->st_size, ENCODING_IDENTITY, vary);
+    variants[ENCODING_IDENTITY] = read_file_blob(fd, &variant);
+    
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODING_COUNT; i++) {
+        if (sibling_fd[i] < 0) continue;
+        if (variants[ENCODING_IDENTITY]) {
+            init_variant(&variant, filename, st, sibling_st[i].st_size, i, vary);
+            variants[i] = read_file_blob(sibling_fd[i], &variant);
+        }
+        close(sibling_fd[i]);
+    }
+    
+    if (!variants[ENCODING_IDENTITY]) {
+        return -1;
+    }
+    
+    // Compress text ourselves when no .gz was shipped, keeping the result
+    // only if it actually saves bytes
+    CacheBlob *identity = variants[ENCODING_IDENTITY];
+    if (!variants[ENCODING_GZIP] && is_compressible(get_content_type(filename)) &&
+        identity->size >= COMPRESS_MIN_SIZE) {
+        size_t gz_size;
+        char *gz = gzip_compress(identity->data, identity->size, &gz_size);
+        if (gz && gz_size < identity->size) {
+            init_variant(&variant, filename, st, gz_size, ENCODING_GZIP, vary);
+            variants[ENCODING_GZIP] = new_file_blob(&variant);
+            if (variants[ENCODING_GZIP]) {
+                memcpy(variants[ENCODING_GZIP]->data, gz, gz_size);
+            }
+        }
+        free(gz);
+    }
+    
+    shared_cache_store(filename, stamps, variants);
+    return 0;
+}
+
+// Load every encoding of a regular file. Returns -1 if the file is
+// missing, not a regular file, or cannot be read completely, otherwise
+// what build_file_variants() returns.
+int load_file_variants(const char *filename, CacheBlob *variants[ENCODING_COUNT]) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    
+    int result = build_file_variants(fd, filename, &st, variants);
+    close(fd);
+    return result;
+}
+
+void release_variants(CacheBlob *variants[ENCODING_COUNT]) {
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        if (variants[i]) {
+            blob_release(variants[i]);
+            variants[i] = NULL;
+        }
+    }
 }
 
-void send_response(int client_sock, const char *status, const char *content_type, 
+void send_response(Connection *conn, const char *status, const char *content_type, 
                    const char *body, size_t body_size) {
     char header[1024];
     snprintf(header, sizeof(header),
         "HTTP/1.1 %s\r\n"
         "Content-Type: %s\r\n"
         "Content-Length: %zu\r\n"
-        "Connection: close\r\n"
+        "Connection: %s\r\n"
+        "Server: Advanced-Multithreaded-Server/1.0\r\n"
+        "\r\n",
+        status, content_type, body_size,
+        conn->close_after_write ? "close" : "keep-alive");
+    
+    conn_queue(conn, header, strlen(header));
+    conn_queue(conn, body, body_size);
+    conn_flush(conn);
+}
+
+// Queue one slice of the body, from the blob when it is cached or from
+// the file otherwise
+static int queue_body(Connection *conn, CacheBlob *blob, int fd, size_t start, size_t length) {
+    if (blob) {
+        return conn_queue_blob(conn, blob, blob->data + start, length);
+    }
+    
+    // The connection closes each file segment's descriptor when done
+    int part_fd = dup(fd);
+    if (part_fd < 0) return -1;
+    return conn_queue_file(conn, part_fd, start, length);
+}
+
+// 416 for a Range header that does not overlap the body at all
+static void send_range_not_satisfiable(Connection *conn, size_t size) {
+    char header[256];
+    int len = snprintf(header, sizeof(header),
+        "HTTP/1.1 416 Range Not Satisfiable\r\n"
+        "Content-Range: bytes */%zu\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: %s\r\n"
         "Server: Advanced-Multithreaded-Server/1.0\r\n"
         "\r\n",
-        status, content_type, body_size);
+        size, conn->close_after_write ? "close" : "keep-alive");
+    conn_queue(conn, header, len);
+    conn_flush(conn);
+}
+
+// Answer a Range request with 206 Partial Content: a single range as is,
+// several as multipart/byteranges. The body comes from blob when it is
+// cached, otherwise from fd with sendfile(); fd stays owned by the caller.
+// Returns the status sent, or 0 if the Range header is to be ignored and
+// the whole body sent instead.
+static int send_partial_response(Connection *conn, HttpRequest *req, const FileVariant *variant,
+                                 CacheBlob *blob, int fd) {
+    if (!request_range_applies(req, variant->etag, variant->mtime)) return 0;
+    
+    RangeSet set;
+    int count = parse_range(req->range, variant->length, &set);
+    if (count == 0) return 0;
+    if (count < 0) {
+        send_range_not_satisfiable(conn, variant->length);
+        return 416;
+    }
+    
+    const char *content_type = get_content_type(variant->filename);
+    char content_headers[256];
+    char header[1024];
+    
+    if (count == 1) {
+        ByteRange *range = &set.ranges[0];
+        snprintf(content_headers, sizeof(content_headers),
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Content-Range: bytes %zu-%zu/%zu\r\n",
+                 content_type, range->length, range->start,
+                 range->start + range->length - 1, variant->length);
+        int header_len = format_file_header(header, sizeof(header), variant, 206,
+                                            content_headers, conn->close_after_write);
+        conn_queue(conn, header, header_len);
+        queue_body(conn, blob, fd, range->start, range->length);
+        conn_flush(conn);
+        return 206;
+    }
+    
+    // Each part gets its own small header; the boundary only has to be
+    // absent from the body, so a per-response counter will do
+    static unsigned long boundary_counter = 0;
+    char boundary[48];
+    snprintf(boundary, sizeof(boundary), "byteranges-%lx-%lx", (unsigned long)variant->mtime,
+             __atomic_add_fetch(&boundary_counter, 1, __ATOMIC_RELAXED));
+    
+    char parts[MAX_RANGES][192];
+    int part_len[MAX_RANGES];
+    char closing[64];
+    int closing_len = snprintf(closing, sizeof(closing), "\r\n--%s--\r\n", boundary);
+    size_t content_length = closing_len;
+    
+    for (int i = 0; i < count; i++) {
+        ByteRange *range = &set.ranges[i];
+        part_len[i] = snprintf(parts[i], sizeof(parts[i]),
+                               "\r\n--%s\r\n"
+                               "Content-Type: %s\r\n"
+                               "Content-Range: bytes %zu-%zu/%zu\r\n"
+                               "\r\n",
+                               boundary, content_type, range->start,
+                               range->start + range->length - 1, variant->length);
+        content_length += part_len[i] + range->length;
+    }
+    
+    snprintf(content_headers, sizeof(content_headers),
+             "Content-Type: multipart/byteranges; boundary=%s\r\n"
+             "Content-Length: %zu\r\n",
+             boundary, content_length);
+    int header_len = format_file_header(header, sizeof(header), variant, 206,
+                                        content_headers, conn->close_after_write);
+    conn_queue(conn, header, header_len);
+    for (int i = 0; i < count; i++) {
+        conn_queue(conn, parts[i], part_len[i]);
+        queue_body(conn, blob, fd, set.ranges[i].start, set.ranges[i].length);
+    }
+    conn_queue(conn, closing, closing_len);
+    conn_flush(conn);
+    return 206;
+}
+
+// Send a cached file. A whole body needs no copying or formatting at all:
+// the prebuilt header and the body leave in a single sendmsg(). The
+// connection keeps the blob pinned for as long as part of it is still
+// queued.
+// Returns the status code sent
+int send_cached_response(Connection *conn, HttpRequest *req, const char *filename,
+                         CacheBlob *blob) {
+    int not_modified = request_not_modified(req, blob->etag, blob->mtime);
+    
+    if (!not_modified && req->range.data) {
+        FileVariant variant;
+        blob_variant(&variant, filename, blob);
+        int status = send_partial_response(conn, req, &variant, blob, -1);
+        if (status) return status;
+    }
+    
+    int variant = conn->close_after_write ? 1 : 0;
+    conn_queue_blob(conn, blob, blob->header[not_modified][variant],
+                    blob->header_len[not_modified][variant]);
+    if (!not_modified) {
+        conn_queue_blob(conn, blob, blob->data, blob->size);
+    }
+    conn_flush(conn);
+    return not_modified ? 304 : 200;
+}
+
+// Send an open file with sendfile(). The header is queued first so it
+// leaves with MSG_MORE and shares a segment with the start of the body.
+// Takes ownership of fd.
+// Returns the status code sent
+int send_file_response(Connection *conn, HttpRequest *req, const char *filename,
+                       const struct stat *st, int fd) {
+    FileVariant variant;
+    char header[1024];
+    
+    init_variant(&variant, filename, st, st->st_size, ENCODING_IDENTITY, 0);
+    int not_modified = request_not_modified(req, variant.etag, st->st_mtime);
     
-    send(client_sock, header, strlen(header), 0);
-    send(client_sock, body, body_size, 0);
+    if (!not_modified && req->range.data) {
+        int status = send_partial_response(conn, req, &variant, NULL, fd);
+        if (status) {
+            close(fd);
+            return status;
+        }
+    }
+    
+    int header_len = format_file_header(header, sizeof(header), &variant,
+                                        not_modified ? 304 : 200, NULL, conn->close_after_write);
+    conn_queue(conn, header, header_len);
+    if (not_modified) {
+        close(fd);
+    } else {
+        conn_queue_file(conn, fd, 0, st->st_size);
+    }
+    conn_flush(conn);
+    return not_modified ? 304 : 200;
+}
+
+const char *status_reason(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 413: return "Content Too Large";
+    case 414: return "URI Too Long";
+    case 416: return "Range Not Satisfiable";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Internal Server Error";
+    }
+}
+
+// Small HTML error page for any status
+void send_error(Connection *conn, int status) {
+    char status_line[64];
+    char body[256];
+    snprintf(status_line, sizeof(status_line), "%d %s", status, status_reason(status));
+    int body_len = snprintf(body, sizeof(body),
+                            "<!DOCTYPE html><html><body><h1>%s</h1></body></html>", status_line);
+    send_response(conn, status_line, "text/html", body, body_len);
 }
 
-void send_404(int client_sock) {
-    const char *body = "<!DOCTYPE html><html><body><h1>404 Not Found</h1></body></html>";
-    send_response(client_sock, "404 Not Found", "text/html", body, strlen(body));
+void send_404(Connection *conn) {
+    send_error(conn, 404);
 }
 
-void send_500(int client_sock) {
-    const char *body = "<!DOCTYPE html><html><body><h1>500 Internal Server Error</h1></body></html>";
-    send_response(client_sock, "500 Internal Server Error", "text/html", body, strlen(body));
+void send_500(Connection *conn) {
+    send_error(conn, 500);
 }
 
 char *get_content_type(const char *filename) {
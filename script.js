@@ -112,7 +112,7 @@ async function viewMetrics() {
     testResults.innerHTML = '<div class="loading"></div> Fetching live metrics...';
     
     try {
-        const response = await fetch('/metrics');
+        const response = await fetch('/metrics', { headers: { 'Accept': 'text/html' } });
         const html = await response.text();
         
         // Extract metrics from the HTML response
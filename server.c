@@ -10,20 +10,13 @@ void cleanup_server() {
     server_running = 0;
     
     // Clean up cache
-    pthread_mutex_lock(&cache_mutex);
-    CacheEntry *curr = cache_head;
-    while (curr) {
-        CacheEntry *next = curr->next;
-        free(curr->content);
-        free(curr);
-        curr = next;
-    }
-    cache_head = cache_tail = NULL;
-    cache_size = 0;
-    pthread_mutex_unlock(&cache_mutex);
+    cache_destroy();
+    
+    // Write out any buffered log lines
+    log_flush();
     
     // Wake up all waiting threads
-    pthread_cond_broadcast(&queue_not_empty);
+    scheduler_stop();
     
     printf("Server cleanup completed\n");
 }
@@ -34,13 +27,102 @@ void signal_handler(int signum) {
     exit(0);
 }
 
-int main() {
+// Classic mode: one accept thread feeding the worker pool's run queues
+static int run_thread_pool(int port, int num_workers, int queue_limit, int reuseport) {
     int server_fd, client_sock;
-    struct sockaddr_in server_addr, client_addr;
+    struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
-    pthread_t worker_threads[MAX_THREADS];
+    
+    pthread_t *worker_threads = calloc(num_workers, sizeof(pthread_t));
+    int *thread_ids = calloc(num_workers, sizeof(int));
+    if (!worker_threads || !thread_ids || scheduler_init(num_workers, queue_limit) < 0) {
+        perror("Failed to set up worker pool");
+        return -1;
+    }
+    
+    server_fd = create_listener(port, reuseport);
+    if (server_fd < 0) {
+        return -1;
+    }
+    
+    printf("Server listening on port %d...\n", port);
+    
+    // Create worker threads
+    for (int i = 0; i < num_workers; i++) {
+        thread_ids[i] = i;
+        if (pthread_create(&worker_threads[i], NULL, worker, &thread_ids[i]) != 0) {
+            perror("Failed to create worker thread");
+            close(server_fd);
+            return -1;
+        }
+    }
+    
+    printf("All worker threads started\n");
+    
+    // Accept connections
+    while (server_running) {
+        client_sock = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+        
+        if (client_sock < 0) {
+            if (server_running) {
+                perror("Accept failed");
+            }
+            continue;
+        }
+        
+        log_debug("New client connected: %s:%d (socket %d)",
+                  inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_sock);
+        
+        // Hand off to a worker, or shed load past the admission limit
+        if (enqueue(client_sock) < 0) {
+            reject_connection(client_sock);
+        }
+    }
+    
+    // Wait for all threads to finish
+    printf("Waiting for worker threads to finish...\n");
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(worker_threads[i], NULL);
+    }
+    
+    free(worker_threads);
+    free(thread_ids);
+    close(server_fd);
+    return 0;
+}
+
+// Reactor mode: non-blocking epoll or io_uring loops (one per CPU in a
+// single process), each with its own SO_REUSEPORT listener. Kernels that
+// can't run the io_uring loops get the epoll ones.
+static int run_event_loops(int port, long num_loops, int pin_loops, int use_uring) {
+    pthread_t *loop_threads = calloc(num_loops, sizeof(pthread_t));
+    if (!loop_threads) {
+        return -1;
+    }
+    
+    if (use_uring && start_uring_loops(port, num_loops, pin_loops, loop_threads) < 0) {
+        printf("io_uring unavailable, using epoll event loops\n");
+        use_uring = 0;
+    }
+    if (!use_uring && start_event_loops(port, num_loops, pin_loops, loop_threads) < 0) {
+        free(loop_threads);
+        return -1;
+    }
+    
+    printf("Server listening on port %d with %ld %s loops...\n", port, num_loops,
+           use_uring ? "io_uring" : "event");
+    
+    for (long i = 0; i < num_loops; i++) {
+        pthread_join(loop_threads[i], NULL);
+    }
+    
+    free(loop_threads);
+    return 0;
+}
+
+int main() {
     pthread_t metrics_tid;
-    int thread_ids[MAX_THREADS];
+    pthread_t watcher_tid;
     
     // Allow port to be overridden by environment variable
     int port = PORT;
@@ -53,98 +135,204 @@ int main() {
         }
     }
     
-    printf(" Starting Advanced Multithreaded Web Server\n");
-    printf("Features: Thread Pooling, Caching, Performance Metrics\n");
-    printf("Port: %d, Threads: %d, Cache Size: %d\n\n", port, MAX_THREADS, MAX_CACHE_SIZE);
+    // Cache budget in bytes
+    size_t cache_bytes = CACHE_MAX_BYTES;
+    char *cache_env = getenv("CACHE_BYTES");
+    if (cache_env) {
+        char *end;
+        unsigned long long value = strtoull(cache_env, &end, 10);
+        if (end == cache_env || *end != '\0') {
+            printf("Invalid CACHE_BYTES environment variable: %s, using default %d\n",
+                   cache_env, CACHE_MAX_BYTES);
+        } else {
+            cache_bytes = value;
+        }
+    }
     
-    // Set up signal handlers for graceful shutdown
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    // Host-wide shared cache budget in bytes, off unless set
+    size_t shared_cache_bytes = 0;
+    char *shared_env = getenv("SHARED_CACHE_BYTES");
+    if (shared_env) {
+        char *end;
+        unsigned long long value = strtoull(shared_env, &end, 10);
+        if (end == shared_env || *end != '\0') {
+            printf("Invalid SHARED_CACHE_BYTES environment variable: %s, not using a shared cache\n",
+                   shared_env);
+        } else {
+            shared_cache_bytes = value;
+        }
+    }
+    char *shared_name = getenv("SHARED_CACHE_NAME");
+    if (!shared_name || shared_name[0] != '/') {
+        if (shared_name) {
+            printf("Invalid SHARED_CACHE_NAME environment variable: %s, using default %s\n",
+                   shared_name, SHARED_CACHE_NAME);
+        }
+        shared_name = SHARED_CACHE_NAME;
+    }
     
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("Socket creation failed");
-        exit(1);
+    // Files at least this large bypass the cache and use sendfile()
+    char *sendfile_env = getenv("SENDFILE_MIN_BYTES");
+    if (sendfile_env) {
+        char *end;
+        unsigned long long value = strtoull(sendfile_env, &end, 10);
+        if (end == sendfile_env || *end != '\0') {
+            printf("Invalid SENDFILE_MIN_BYTES environment variable: %s, using default %d\n",
+                   sendfile_env, SENDFILE_THRESHOLD);
+        } else {
+            sendfile_threshold = value;
+        }
     }
     
-    // Set socket options
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt failed");
-        close(server_fd);
-        exit(1);
+    // Select the connection handling model
+    int mode = SERVER_MODE_THREADPOOL;
+    char *mode_env = getenv("SERVER_MODE");
+    if (mode_env) {
+        if (strcmp(mode_env, "epoll") == 0) {
+            mode = SERVER_MODE_EPOLL;
+        } else if (strcmp(mode_env, "uring") == 0) {
+            mode = SERVER_MODE_URING;
+        } else if (strcmp(mode_env, "threadpool") != 0) {
+            printf("Invalid SERVER_MODE environment variable: %s, using threadpool\n", mode_env);
+        }
     }
     
-    // Bind socket
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    // Prefork: a master process supervising this many worker processes
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1) {
+        num_cpus = 1;
+    }
+    int num_processes = 0;
+    char *processes_env = getenv("WORKER_PROCESSES");
+    if (processes_env) {
+        int value = atoi(processes_env);
+        if (strcmp(processes_env, "auto") == 0) {
+            num_processes = num_cpus;
+        } else if (value < 0 || (value == 0 && strcmp(processes_env, "0") != 0)) {
+            printf("Invalid WORKER_PROCESSES environment variable: %s, using a single process\n",
+                   processes_env);
+        } else {
+            num_processes = value;
+        }
+    }
+    char *affinity_env = getenv("WORKER_CPU_AFFINITY");
+    int pin_processes = num_processes > 0 && affinity_env && strcmp(affinity_env, "0") != 0;
     
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server_fd);
-        exit(1);
+    // Worker pool size and admission limit for thread-pool mode. Each
+    // prefork worker process takes one CPU's share.
+    int num_workers = (num_processes > 0 ? 1 : num_cpus) * WORKERS_PER_CPU;
+    char *workers_env = getenv("WORKER_THREADS");
+    if (workers_env) {
+        int value = atoi(workers_env);
+        if (value <= 0) {
+            printf("Invalid WORKER_THREADS environment variable: %s, using %d\n",
+                   workers_env, num_workers);
+        } else {
+            num_workers = value;
+        }
     }
     
-    // Listen for connections
-    if (listen(server_fd, MAX_QUEUE) < 0) {
-        perror("Listen failed");
-        close(server_fd);
-        exit(1);
+    int queue_limit = MAX_QUEUE;
+    char *limit_env = getenv("QUEUE_LIMIT");
+    if (limit_env) {
+        int value = atoi(limit_env);
+        if (value <= 0) {
+            printf("Invalid QUEUE_LIMIT environment variable: %s, using default %d\n",
+                   limit_env, MAX_QUEUE);
+        } else {
+            queue_limit = value;
+        }
     }
     
-    printf("Server listening on port %d...\n", port);
+    printf(" Starting Advanced Multithreaded Web Server\n");
+    printf("Features: Thread Pooling, Event Loops, Caching, Performance Metrics\n");
+    printf("Port: %d, Mode: %s, Threads: %d, Cache: %zu bytes in %d shards\n", port,
+           mode == SERVER_MODE_URING ? "uring" : mode == SERVER_MODE_EPOLL ? "epoll" : "threadpool",
+           num_workers,
+           cache_bytes, CACHE_SHARDS);
+    if (num_processes > 0) {
+        printf("Worker processes: %d, each with its own threads and cache\n", num_processes);
+    }
+    if (shared_cache_bytes > 0) {
+        printf("Shared cache: %zu bytes in %s\n", shared_cache_bytes, shared_name);
+    }
+    printf("\n");
     
-    // Create worker threads
-    for (int i = 0; i < MAX_THREADS; i++) {
-        thread_ids[i] = i;
-        if (pthread_create(&worker_threads[i], NULL, worker, &thread_ids[i]) != 0) {
-            perror("Failed to create worker thread");
-            cleanup_server();
-            close(server_fd);
-            exit(1);
-        }
+    // Everything below runs in each worker process; threads do not survive
+    // fork(), so none may be started before this point
+    int worker_id = -1;
+    if (num_processes > 0) {
+        worker_id = start_worker_processes(num_processes, pin_processes);
     }
     
+    // Request-path logging goes through the asynchronous logger
+    log_init();
+    cache_init(cache_bytes);
+    if (shared_cache_bytes > 0 && shared_cache_init(shared_name, shared_cache_bytes) < 0) {
+        printf("Shared cache unavailable, files are cached per process\n");
+    }
+    
+    // Set up signal handlers for graceful shutdown
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    
     // Create metrics thread
     if (pthread_create(&metrics_tid, NULL, metrics_thread, NULL) != 0) {
         perror("Failed to create metrics thread");
         cleanup_server();
-        close(server_fd);
         exit(1);
     }
     
-    printf("All worker threads and metrics thread started\n");
-    printf("Visit http://localhost:%d/metrics to see performance metrics\n\n", port);
+    // Invalidate cached files when they change on disk
+    int watching = start_file_watcher(&watcher_tid) == 0;
+    if (!watching) {
+        printf("File watcher unavailable, cached files will not be refreshed\n");
+    }
     
-    // Accept connections
-    while (server_running) {
-        client_sock = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        
-        if (client_sock < 0) {
-            if (server_running) {
-                perror("Accept failed");
-            }
-            continue;
+    // Optionally fill the cache before accepting any connections
+    char *warmup_env = getenv("CACHE_WARMUP");
+    char *manifest_env = getenv("CACHE_WARMUP_MANIFEST");
+    if ((warmup_env && strcmp(warmup_env, "0") != 0) || manifest_env) {
+        int warmup_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        char *threads_env = getenv("CACHE_WARMUP_THREADS");
+        if (threads_env) {
+            warmup_threads = atoi(threads_env);
         }
         
-        printf("New client connected: %s:%d (socket %d)\n", 
-               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_sock);
-        
-        // Add to task queue
-        enqueue(client_sock);
+        struct timeval start_time, end_time;
+        gettimeofday(&start_time, NULL);
+        int loaded = cache_warmup(manifest_env, warmup_threads);
+        gettimeofday(&end_time, NULL);
+        printf("Cache warm-up loaded %d files (%zu bytes) in %.2f ms\n", loaded,
+               cache_bytes_used(), get_time_diff(start_time, end_time) * 1000);
     }
     
-    // Wait for all threads to finish
-    printf("Waiting for worker threads to finish...\n");
-    for (int i = 0; i < MAX_THREADS; i++) {
-        pthread_join(worker_threads[i], NULL);
+    if (worker_id < 0) {
+        printf("Visit http://localhost:%d/metrics to see performance metrics\n\n", port);
+    } else {
+        printf("Worker %d running as pid %d\n", worker_id, (int)getpid());
+    }
+    
+    // Worker processes share the port with SO_REUSEPORT and run a single
+    // event loop each; their CPU pinning, if any, is per process
+    int result;
+    if (mode == SERVER_MODE_EPOLL || mode == SERVER_MODE_URING) {
+        result = run_event_loops(port, worker_id < 0 ? num_cpus : 1, worker_id < 0,
+                                 mode == SERVER_MODE_URING);
+    } else {
+        result = run_thread_pool(port, num_workers, queue_limit, worker_id >= 0);
+    }
+    
+    if (result < 0) {
+        cleanup_server();
+        exit(1);
     }
     
     pthread_join(metrics_tid, NULL);
+    if (watching) {
+        pthread_join(watcher_tid, NULL);
+    }
     
-    close(server_fd);
     cleanup_server();
     
     printf("Server shutdown complete\n");
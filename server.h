@@ -1,6 +1,8 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,65 +17,381 @@
 #include <time.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sched.h>
+#include <poll.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <sys/uio.h>
 
 // Configuration constants
 #define PORT 8080
-#define MAX_THREADS 10
-#define MAX_QUEUE 100
+#define WORKERS_PER_CPU 4                     // thread-pool workers block on keep-alive clients
+#define MAX_QUEUE 100                         // default admission limit (queued connections)
+#define RETRY_AFTER_SECONDS 1
 #define BUFFER_SIZE 4096
 #define MAX_FILENAME 256
-#define MAX_CACHE_SIZE 50
+#define MAX_HEADERS 64                        // more get 431 Request Header Fields Too Large
+#define MAX_RANGES 16                         // Range requests asking for more get the whole file
+#define CACHE_MAX_BYTES (64 * 1024 * 1024)   // default budget, override with CACHE_BYTES
+#define CACHE_SHARDS 16
+#define SHARED_CACHE_NAME "/webserver-cache"   // shm segment, override with SHARED_CACHE_NAME
+#define SHARED_CACHE_SLOT_BYTES 4096          // one shared index slot per this much budget
+#define SHARED_CACHE_PROBES 8                 // index slots a file may live in
+#define ETAG_SIZE 64
+#define COMPRESS_MIN_SIZE 256                 // smaller text files are sent as is
+#define STATIC_MAX_AGE 300                    // Cache-Control max-age for files
+#define SENDFILE_THRESHOLD (256 * 1024)       // default, override with SENDFILE_MIN_BYTES
 #define METRICS_INTERVAL 10
+#define LATENCY_SUB_BITS 4                    // 16 sub-buckets per power of two (~6% precision)
+#define LATENCY_BUCKETS ((32 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)  // up to 2^32 us
+#define STATUS_CLASSES 5                      // 1xx to 5xx
+#define METRIC_METHODS 4                      // GET, HEAD, POST, other
+#define METRIC_CODES 14                       // status codes we send, plus other
+#define MAX_EVENTS 256
+#define URING_ENTRIES 1024                    // submission queue entries per io_uring loop
+#define URING_RECV_BUFFERS 1024               // provided receive buffers per loop, a power of two
+#define URING_FILE_BUFFERS 16                 // registered bounce buffers per loop
+#define URING_FILE_CHUNK (64 * 1024)          // bytes per linked file read and send
+#define KEEPALIVE_TIMEOUT 5          // seconds an idle connection is kept open
+#define KEEPALIVE_MAX_REQUESTS 100   // requests served per connection
+#define WORKER_RESTART_DELAY 1       // seconds; prefork workers dying sooner are restarted after a pause
+
+// Content encodings, also bit positions in HttpRequest.accepted_encodings
+#define ENCODING_IDENTITY 0
+#define ENCODING_GZIP 1
+#define ENCODING_BROTLI 2
+#define ENCODING_COUNT 3
+
+// Log levels. Calls below LOG_COMPILE_LEVEL compile to nothing (debug
+// chatter is gone from -DNDEBUG release builds); LOG_LEVEL filters the
+// rest at runtime.
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#define LOG_AT(level, ...) do { \
+        if ((level) >= LOG_COMPILE_LEVEL && (level) >= log_level) log_write((level), __VA_ARGS__); \
+    } while (0)
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Access log formats (selected at startup with ACCESS_LOG)
+#define ACCESS_LOG_COMMON 0
+#define ACCESS_LOG_JSON 1
+#define ACCESS_LOG_OFF 2
+
+// Server modes (selected at startup with SERVER_MODE)
+#define SERVER_MODE_THREADPOOL 0
+#define SERVER_MODE_EPOLL 1
+#define SERVER_MODE_URING 2
+
+// Identity of a file version on disk. All zero for a precompressed
+// sibling that is missing, or too old to be served.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} FileStamp;
+
+// Immutable file contents shared by the cache and in-flight responses.
+// The cache holds one reference and every response that is sending the
+// blob pins another, so eviction never frees memory still being sent.
+// The finished response headers (200 and 304, each for keep-alive and for
+// close) are stored after the body, so a hit is a single gathered write.
+typedef struct CacheBlob {
+    int refcount;            // Updated with __atomic builtins
+    size_t size;             // Body bytes
+    size_t total_size;       // Body plus headers, charged to the cache
+    const char *header[2][2];  // [not_modified][close_after_write]
+    size_t header_len[2][2];
+    char etag[ETAG_SIZE];
+    time_t mtime;
+    int encoding;
+    int vary;                // Other encodings exist
+    char data[];
+} CacheBlob;
 
 // Cache entry structure
-//Doubly Linkedlist 
+// Lives in one shard's hash index and on that shard's doubly linked LRU list
 typedef struct CacheEntry {
     char filename[MAX_FILENAME];
-    char *content;
-    size_t size;
+    unsigned long long hash;
+    CacheBlob *variants[ENCODING_COUNT];  // Identity always set, others optional
+    size_t size;                          // Bytes charged to the shard
     time_t last_accessed;
     struct CacheEntry *prev;
     struct CacheEntry *next;
 } CacheEntry;
 
-// Global variables
-extern int task_queue[MAX_QUEUE];
-extern int front, rear, count;
-extern pthread_mutex_t queue_mutex;
-extern pthread_cond_t queue_not_empty;
-
-extern CacheEntry *cache_head;
-extern CacheEntry *cache_tail;
-extern int cache_size;
-extern pthread_mutex_t cache_mutex;
-
-extern long total_requests;
-extern long cache_hits;
-extern long cache_misses;
-extern double total_response_time;
-extern pthread_mutex_t metrics_mutex;
+// Queued output. Header bytes are copied into Connection.out, cached
+// bodies are referenced in place with the blob pinned, and uncached files
+// are sent from their descriptor with sendfile().
+typedef struct {
+    CacheBlob *blob;         // NULL for bytes stored in Connection.out
+    const char *data;        // Blob segments only
+    size_t offset;           // Buffer segments: position in Connection.out
+    int file_fd;             // File segments only, -1 otherwise
+    off_t file_offset;
+    size_t len;
+} OutputSegment;
+
+// Growable byte buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+// A view into the receive buffer, not NUL-terminated
+typedef struct {
+    const char *data;
+    size_t len;
+} Slice;
+
+typedef struct {
+    Slice name;
+    Slice value;
+} HttpHeader;
+
+// Parsed HTTP request. Headers are slices into the connection's input
+// buffer and stay valid until the request has been served.
+typedef struct {
+    char method[16];
+    char path[MAX_FILENAME];   // Target without the query string
+    char protocol[16];
+    Slice query;
+    HttpHeader headers[MAX_HEADERS];
+    int num_headers;
+    
+    // Headers the server acts on (also listed in headers[])
+    Slice host;
+    Slice connection;
+    Slice accept;
+    Slice accept_encoding;
+    Slice if_none_match;
+    Slice if_modified_since;
+    Slice range;
+    Slice if_range;
+    
+    int keep_alive;
+    size_t length;             // Bytes of headers plus body in the buffer
+    
+    // Derived from the headers above once parsing is complete
+    int accepted_encodings;    // Bitmask of (1 << ENCODING_*)
+    int accept_html;           // Accept lists text/html (a browser)
+    time_t modified_since;     // 0 when absent or unparseable
+} HttpRequest;
+
+// Byte ranges of a Range request, sorted and without overlaps
+typedef struct {
+    size_t start;
+    size_t length;
+} ByteRange;
+
+typedef struct {
+    ByteRange ranges[MAX_RANGES];
+    int count;
+} RangeSet;
 
+// Incremental request parser. Feed it the whole buffered input each time
+// more arrives; it resumes where the previous call stopped.
+typedef struct {
+    int state;
+    size_t pos;                // Scan resumes here
+    size_t body_len;
+    int error_status;          // Status to answer with once parsing fails
+    HttpRequest req;
+} HttpParser;
+
+// Per-connection state shared by the thread-pool and epoll modes.
+// Responses are written through conn_send(), which queues whatever the
+// socket does not accept immediately so non-blocking sockets never stall.
+typedef struct Connection {
+    int fd;
+    int nonblocking;
+    int deferred;                // io_uring mode: output is only queued, the ring sends it
+    char in[BUFFER_SIZE];
+    size_t in_len;
+    HttpParser parser;           // State for the request at the front of in
+    Buffer out;
+    OutputSegment *segments;
+    int num_segments;
+    int segment_cap;
+    int segment_pos;             // First segment not fully sent
+    size_t segment_sent;         // Bytes of that segment already sent
+    int close_after_write;
+    int requests_served;
+    unsigned long long bytes_out; // Response bytes queued so far
+    char peer[INET_ADDRSTRLEN];  // Client address for the access log
+    time_t last_active;
+    struct Connection *prev;     // idle-timeout list (epoll mode)
+    struct Connection *next;
+} Connection;
+
+// Log-bucketed latency histogram in microseconds, HDR style: exact below
+// 16 us, then 16 linear sub-buckets per power of two
+typedef struct {
+    unsigned long long count;
+    unsigned long long total_us;
+    unsigned long long buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// Request metrics by status class and cache hit. Each thread records into
+// its own cache-line-aligned copy; readers add the copies up.
+typedef struct MetricsShard {
+    LatencyHistogram latency[STATUS_CLASSES][2];  // [status / 100 - 1][cache hit]
+    unsigned long long requests[METRIC_METHODS][METRIC_CODES];
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    struct MetricsShard *next;
+} __attribute__((aligned(64))) MetricsShard;
+
+// Global variables
+extern int active_connections;
+extern int log_level;
+extern int access_log_format;
 extern int server_running;
+extern size_t sendfile_threshold;
 
 // Function prototypes
-void enqueue(int client_sock);
-int dequeue();
+int scheduler_init(int workers, int limit);
+int enqueue(int client_sock);
+int dequeue(int worker_id);
+void scheduler_stop();
+int queue_depth();
+void reject_connection(int client_sock);
 void *worker(void *arg);
 void handle_client(int client_sock);
-void send_response(int client_sock, const char *status, const char *content_type, 
+void http_parser_init(HttpParser *parser);
+int http_parse(HttpParser *parser, const char *buf, size_t len);
+int slice_equals(Slice slice, const char *str);
+int slice_contains_token(Slice slice, const char *token);
+int parse_range(Slice value, size_t size, RangeSet *set);
+int process_requests(Connection *conn);
+void serve_request(Connection *conn, HttpRequest *req);
+void send_response(Connection *conn, const char *status, const char *content_type, 
                    const char *body, size_t body_size);
-void send_404(int client_sock);
-void send_500(int client_sock);
+void send_error(Connection *conn, int status);
+const char *status_reason(int status);
+void send_404(Connection *conn);
+void send_500(Connection *conn);
+int send_cached_response(Connection *conn, HttpRequest *req, const char *filename,
+                         CacheBlob *blob);
+int send_file_response(Connection *conn, HttpRequest *req, const char *filename,
+                       const struct stat *st, int fd);
+int build_file_variants(int fd, const char *filename, const struct stat *st,
+                        CacheBlob *variants[ENCODING_COUNT]);
+int load_file_variants(const char *filename, CacheBlob *variants[ENCODING_COUNT]);
+void release_variants(CacheBlob *variants[ENCODING_COUNT]);
+
+// Content encoding functions
+const char *encoding_name(int encoding);
+const char *encoding_extension(int encoding);
+int is_compressible(const char *content_type);
+int parse_accept_encoding(const char *value, size_t len);
+char *gzip_compress(const char *data, size_t size, size_t *out_size);
 char *get_content_type(const char *filename);
 
+// Buffer functions
+int buffer_append(Buffer *buf, const void *data, size_t len);
+int buffer_printf(Buffer *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void buffer_free(Buffer *buf);
+
+// Connection functions
+void conn_init(Connection *conn, int fd, int nonblocking);
+void conn_free(Connection *conn);
+int conn_send(Connection *conn, const void *data, size_t len);
+int conn_queue(Connection *conn, const void *data, size_t len);
+int conn_queue_blob(Connection *conn, CacheBlob *blob, const char *data, size_t len);
+int conn_queue_file(Connection *conn, int fd, off_t offset, size_t len);
+int conn_flush(Connection *conn);
+int conn_gather(Connection *conn, struct iovec *iov, int max_iov, int *more);
+void conn_advance(Connection *conn, size_t sent);
+int conn_has_pending_output(Connection *conn);
+
+// Event loop (epoll mode)
+int create_listener(int port, int reuseport);
+int start_event_loops(int port, int num_loops, int pin_loops, pthread_t *threads);
+void *event_loop_thread(void *arg);
+
+// io_uring mode
+int start_uring_loops(int port, int num_loops, int pin_loops, pthread_t *threads);
+void *uring_loop_thread(void *arg);
+
+// Prefork mode
+int start_worker_processes(int processes, int pin_cpus);
+
 // Cache functions
-CacheEntry* get_from_cache(const char *filename);
-void add_to_cache(const char *filename, const char *data, size_t size);
-void remove_lru_entry();
-void move_to_front(CacheEntry *entry);
+void cache_init(size_t capacity_bytes);
+CacheBlob *blob_alloc(size_t size, size_t extra);
+void blob_retain(CacheBlob *blob);
+void blob_release(CacheBlob *blob);
+CacheBlob *select_variant(CacheBlob *variants[ENCODING_COUNT], int accept_encoding);
+CacheBlob *cache_lookup(const char *filename, int accept_encoding);
+int cache_insert(const char *filename, CacheBlob *variants[ENCODING_COUNT]);
+int cache_preload(const char *filename, CacheBlob *variants[ENCODING_COUNT]);
+int cache_contains(const char *filename);
+int cache_remove(const char *filename);
+int cache_replace(const char *filename, CacheBlob *variants[ENCODING_COUNT]);
+size_t cache_max_entry_size();
+int cache_entry_count();
+size_t cache_capacity();
+unsigned long long cache_eviction_count();
+size_t cache_bytes_used();
+void cache_destroy();
+
+// Shared (host-wide) cache functions
+int shared_cache_init(const char *name, size_t capacity);
+int shared_cache_enabled();
+int shared_cache_load(const char *filename, const FileStamp stamps[ENCODING_COUNT],
+                      CacheBlob *variants[ENCODING_COUNT]);
+int shared_cache_store(const char *filename, const FileStamp stamps[ENCODING_COUNT],
+                       CacheBlob *variants[ENCODING_COUNT]);
+int shared_cache_entry_count();
+size_t shared_cache_bytes_used();
+size_t shared_cache_capacity();
+unsigned long long shared_cache_hit_count();
+unsigned long long shared_cache_miss_count();
+unsigned long long shared_cache_eviction_count();
+
+// Warm-up functions
+int cache_warmup(const char *manifest, int num_threads);
+
+// Logging functions
+int log_init();
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_access(Connection *conn, HttpRequest *req, int status, int cache_hit,
+                size_t bytes, double response_time);
+void log_flush();
+
+// File watcher functions
+int start_file_watcher(pthread_t *thread);
+void watch_cached_file(const char *filename);
+void *file_watcher_thread(void *arg);
 
 // Metrics functions
-void record_request(int cache_hit, double response_time);
+void record_request(const char *method, int status, int cache_hit, size_t bytes_in,
+                    size_t bytes_out, double response_time);
+void format_metrics_html(Buffer *out);
+void format_openmetrics(Buffer *out);
+MetricsShard *metrics_snapshot();
+void latency_merge(LatencyHistogram *total, const LatencyHistogram *histogram);
+void metrics_totals(const MetricsShard *snapshot, LatencyHistogram *all,
+                    unsigned long long *cache_hits, unsigned long long *cache_misses);
+double latency_percentile(const LatencyHistogram *histogram, double percentile);
 void *metrics_thread(void *arg);
 void print_metrics();
 
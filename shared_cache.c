@@ -0,0 +1,499 @@
+#include "server.h"
+#include <sys/mman.h>
+#include <sys/file.h>
+
+// Host-wide second-level cache in a POSIX shared memory segment. Every
+// webserver process on the machine maps the same segment, so a file is
+// read (and compressed) once per host instead of once per process, and a
+// process that starts later finds the files another one already loaded.
+// Processes copy what they find here into their own cache, which keeps
+// the hot files and serves them without touching the segment.
+//
+// Records are appended to a ring in the data area and the oldest are
+// dropped when it is full. The index is an array of slots, each guarded
+// by a sequence number: writers, serialized by a process-shared mutex,
+// make it odd while they change or drop the slot, and readers copy the
+// record out without locking and discard the copy if the number moved.
+// A record also carries the identity of the file it was built from and of
+// its precompressed siblings, so a version changed on disk is never
+// served, whoever loaded it.
+
+#define SHARED_MAGIC 0x57534332      // "WSC2", changes with the layout
+#define NO_SLOT 0xffffffffu
+#define RECORD_ALIGN 64
+
+typedef struct {
+    unsigned int seq;                // Odd while a writer changes the slot
+    unsigned long long hash;         // 0 for an empty slot
+    unsigned long long position;     // Ring position of the record
+    size_t length;
+    char filename[MAX_FILENAME];
+} SharedSlot;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int num_slots;          // Power of two
+    size_t capacity;                 // Bytes in the data area
+    pthread_mutex_t lock;            // Writers only
+    unsigned long long head;         // Ring position of the next record
+    unsigned long long tail;         // Ring position of the oldest record
+    int entries;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+} SharedHeader;
+
+// Start of every record in the ring
+typedef struct {
+    unsigned int slot;               // NO_SLOT for padding up to the ring end
+    unsigned int num_variants;
+    size_t length;                   // Whole record, a multiple of RECORD_ALIGN
+    FileStamp stamps[ENCODING_COUNT];  // The file and siblings it was built from
+} SharedRecord;
+
+// One encoding, followed by its body and prebuilt headers
+typedef struct {
+    int encoding;
+    int vary;
+    time_t mtime;
+    size_t size;
+    size_t header_len[2][2];
+    char etag[ETAG_SIZE];
+} SharedVariant;
+
+static SharedHeader *header = NULL;
+static SharedSlot *slots = NULL;
+static char *ring = NULL;
+
+static size_t align_up(size_t n, size_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+static size_t slots_offset() {
+    return align_up(sizeof(SharedHeader), RECORD_ALIGN);
+}
+
+static size_t ring_offset(size_t num_slots) {
+    return align_up(slots_offset() + num_slots * sizeof(SharedSlot), 4096);
+}
+
+// FNV-1a, never 0 so that 0 can mark an empty slot
+static unsigned long long hash_key(const char *filename) {
+    unsigned long long hash = 14695981039346656037ULL;
+    while (*filename) {
+        hash ^= (unsigned char)*filename++;
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+// Writer side of a slot's sequence number: readers that copied the slot's
+// record before this call see the change
+static void clear_slot(SharedSlot *slot) {
+    __atomic_store_n(&slot->seq, slot->seq | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->hash, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Drop every entry. Used when a process died while holding the lock and
+// may have left the index half updated.
+static void reset_index() {
+    for (unsigned int i = 0; i < header->num_slots; i++) {
+        if (slots[i].hash || (slots[i].seq & 1)) {
+            clear_slot(&slots[i]);
+        }
+    }
+    header->head = header->tail = 0;
+    header->entries = 0;
+}
+
+static int lock_writer() {
+    int err = pthread_mutex_lock(&header->lock);
+    if (err == EOWNERDEAD) {
+        log_warn("A process died while updating the shared cache, clearing it");
+        reset_index();
+        pthread_mutex_consistent(&header->lock);
+        err = 0;
+    }
+    return err;
+}
+
+static void init_segment(unsigned int num_slots, size_t capacity) {
+    memset(header, 0, sizeof(SharedHeader));
+    memset(slots, 0, num_slots * sizeof(SharedSlot));
+    header->num_slots = num_slots;
+    header->capacity = capacity;
+    
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    
+    __atomic_store_n(&header->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Map the segment called name, creating it with room for capacity bytes
+// of records if it does not exist yet. Returns -1, leaving the shared
+// cache off, if it cannot be used.
+int shared_cache_init(const char *name, size_t capacity) {
+    capacity = align_up(capacity, RECORD_ALIGN);
+    unsigned int num_slots = 256;
+    while (num_slots < capacity / SHARED_CACHE_SLOT_BYTES && num_slots < (1u << 24)) {
+        num_slots *= 2;
+    }
+    
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("shm_open failed");
+        return -1;
+    }
+    
+    // Processes starting together take turns; the first one sets it up
+    struct stat st;
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        perror("Failed to lock shared cache");
+        close(fd);
+        return -1;
+    }
+    
+    // A segment whose creator died before finishing is set up again
+    size_t size = st.st_size;
+    unsigned int magic = 0;
+    if (size > 0 && (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) || magic == 0)) {
+        size = 0;
+    }
+    
+    int fresh = size == 0;
+    if (fresh) {
+        size = ring_offset(num_slots) + capacity;
+        // Reserve the memory now: touching a page tmpfs cannot back later
+        // would kill the process with SIGBUS
+        int err = ftruncate(fd, 0) < 0 ? errno : posix_fallocate(fd, 0, size);
+        if (err) {
+            errno = err;
+            perror("Failed to allocate shared cache");
+            ftruncate(fd, 0);
+            close(fd);
+            return -1;
+        }
+    } else if (size < ring_offset(0)) {
+        printf("Shared cache %s is damaged, running without it\n", name);
+        close(fd);
+        return -1;
+    }
+    
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("Failed to map shared cache");
+        close(fd);
+        return -1;
+    }
+    header = base;
+    slots = (SharedSlot *)((char *)base + slots_offset());
+    
+    if (fresh) {
+        init_segment(num_slots, capacity);
+    } else if (header->magic != SHARED_MAGIC ||
+               ring_offset(header->num_slots) + header->capacity > size) {
+        printf("Shared cache %s has an unknown layout, running without it\n", name);
+        munmap(base, size);
+        header = NULL;
+        close(fd);
+        return -1;
+    } else if (header->capacity != capacity) {
+        printf("Shared cache %s already exists, using its %zu bytes\n", name, header->capacity);
+    }
+    ring = (char *)base + ring_offset(header->num_slots);
+    
+    flock(fd, LOCK_UN);
+    close(fd);
+    return 0;
+}
+
+int shared_cache_enabled() {
+    return header != NULL;
+}
+
+static int same_files(const SharedRecord *record, const FileStamp stamps[ENCODING_COUNT]) {
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        const FileStamp *a = &record->stamps[i];
+        const FileStamp *b = &stamps[i];
+        if (a->dev != b->dev || a->ino != b->ino || a->size != b->size ||
+            a->mtime.tv_sec != b->mtime.tv_sec || a->mtime.tv_nsec != b->mtime.tv_nsec) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static size_t variant_length(const CacheBlob *blob) {
+    return align_up(sizeof(SharedVariant) + blob->total_size, 8);
+}
+
+// Rebuild blobs from a private copy of a record
+static int unpack_record(const char *record, size_t length, CacheBlob *variants[ENCODING_COUNT]) {
+    const SharedRecord *rec = (const SharedRecord *)record;
+    size_t pos = sizeof(SharedRecord);
+    
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        variants[i] = NULL;
+    }
+    
+    for (unsigned int n = 0; n < rec->num_variants; n++) {
+        if (pos + sizeof(SharedVariant) > length) goto fail;
+        SharedVariant var;
+        memcpy(&var, record + pos, sizeof(var));
+        
+        size_t header_total = 0;
+        for (int s = 0; s < 2; s++) {
+            for (int c = 0; c < 2; c++) {
+                header_total += var.header_len[s][c];
+            }
+        }
+        if (var.encoding < 0 || var.encoding >= ENCODING_COUNT || variants[var.encoding] ||
+            var.size + header_total > length - pos - sizeof(SharedVariant)) {
+            goto fail;
+        }
+        
+        CacheBlob *blob = blob_alloc(var.size, header_total);
+        if (!blob) goto fail;
+        memcpy(blob->data, record + pos + sizeof(SharedVariant), var.size + header_total);
+        
+        char *header_space = blob->data + blob->size;
+        for (int s = 0; s < 2; s++) {
+            for (int c = 0; c < 2; c++) {
+                blob->header[s][c] = header_space;
+                blob->header_len[s][c] = var.header_len[s][c];
+                header_space += var.header_len[s][c];
+            }
+        }
+        var.etag[ETAG_SIZE - 1] = '\0';
+        strcpy(blob->etag, var.etag);
+        blob->mtime = var.mtime;
+        blob->encoding = var.encoding;
+        blob->vary = var.vary;
+        variants[var.encoding] = blob;
+        pos += align_up(sizeof(SharedVariant) + var.size + header_total, 8);
+    }
+    
+    if (variants[ENCODING_IDENTITY]) {
+        return 0;
+    }
+
+fail:
+    release_variants(variants);
+    return -1;
+}
+
+// Look for the version of filename (and of its siblings) described by
+// stamps. Fills variants with blobs of the caller's own and returns 0 if
+// the shared cache has it.
+int shared_cache_load(const char *filename, const FileStamp stamps[ENCODING_COUNT],
+                      CacheBlob *variants[ENCODING_COUNT]) {
+    if (!header) return -1;
+    
+    unsigned long long hash = hash_key(filename);
+    unsigned int mask = header->num_slots - 1;
+    
+    for (unsigned int probe = 0; probe < SHARED_CACHE_PROBES; probe++) {
+        SharedSlot *slot = &slots[(hash + probe) & mask];
+        unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) || __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash ||
+            strncmp(slot->filename, filename, MAX_FILENAME) != 0) {
+            continue;
+        }
+        
+        // Anything read before the sequence number is checked again may
+        // be torn, so only bounds are trusted until then
+        unsigned long long position = __atomic_load_n(&slot->position, __ATOMIC_RELAXED);
+        size_t length = __atomic_load_n(&slot->length, __ATOMIC_RELAXED);
+        size_t offset = position % header->capacity;
+        if (length < sizeof(SharedRecord) || offset + length > header->capacity) continue;
+        
+        char *copy = malloc(length);
+        if (!copy) break;
+        memcpy(copy, ring + offset, length);
+        
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            free(copy);
+            continue;  // Replaced or evicted while we copied
+        }
+        
+        int result = -1;
+        if (same_files((const SharedRecord *)copy, stamps)) {
+            result = unpack_record(copy, length, variants);
+        }
+        free(copy);
+        if (result == 0) {
+            __atomic_fetch_add(&header->hits, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        break;
+    }
+    
+    __atomic_fetch_add(&header->misses, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+// Free ring space for need more bytes, dropping the oldest records
+static void make_room(size_t need) {
+    while (header->head + need - header->tail > header->capacity) {
+        SharedRecord *rec = (SharedRecord *)(ring + header->tail % header->capacity);
+        if (rec->slot != NO_SLOT) {
+            SharedSlot *slot = &slots[rec->slot];
+            if (slot->hash && slot->position == header->tail) {
+                clear_slot(slot);
+                header->entries--;
+                header->evictions++;
+            }
+        }
+        header->tail += rec->length;
+    }
+}
+
+// Publish every encoding of a file built from the versions stamps
+// describes. Returns 1 if the shared cache holds them afterwards.
+int shared_cache_store(const char *filename, const FileStamp stamps[ENCODING_COUNT],
+                       CacheBlob *variants[ENCODING_COUNT]) {
+    if (!header || strlen(filename) >= MAX_FILENAME) return 0;
+    
+    size_t length = sizeof(SharedRecord);
+    unsigned int num_variants = 0;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        if (variants[i]) {
+            length += variant_length(variants[i]);
+            num_variants++;
+        }
+    }
+    length = align_up(length, RECORD_ALIGN);
+    if (length > header->capacity / 8) return 0;
+    
+    unsigned long long hash = hash_key(filename);
+    unsigned int mask = header->num_slots - 1;
+    if (lock_writer() != 0) return 0;
+    
+    // The slot already holding this file, else an empty one, else the one
+    // whose record is oldest
+    SharedSlot *target = NULL;
+    for (unsigned int probe = 0; probe < SHARED_CACHE_PROBES; probe++) {
+        SharedSlot *slot = &slots[(hash + probe) & mask];
+        if (slot->hash == hash && strcmp(slot->filename, filename) == 0) {
+            if (same_files((SharedRecord *)(ring + slot->position % header->capacity), stamps)) {
+                pthread_mutex_unlock(&header->lock);
+                return 1;  // Another process got there first
+            }
+            target = slot;
+            break;
+        }
+    }
+    
+    // Records never wrap around the end of the ring
+    size_t offset = header->head % header->capacity;
+    if (offset + length > header->capacity) {
+        size_t pad = header->capacity - offset;
+        make_room(pad);
+        SharedRecord *rec = (SharedRecord *)(ring + offset);
+        rec->slot = NO_SLOT;
+        rec->length = pad;
+        header->head += pad;
+    }
+    make_room(length);
+    
+    if (!target) {
+        for (unsigned int probe = 0; probe < SHARED_CACHE_PROBES; probe++) {
+            SharedSlot *slot = &slots[(hash + probe) & mask];
+            if (!slot->hash) {
+                target = slot;
+                break;
+            }
+            if (!target || slot->position < target->position) {
+                target = slot;
+            }
+        }
+    }
+    if (target->hash) {
+        header->entries--;
+        if (strcmp(target->filename, filename) != 0) {
+            header->evictions++;
+        }
+    }
+    
+    // Readers cannot reach the new record before the slot points at it
+    unsigned long long position = header->head;
+    char *out = ring + position % header->capacity;
+    SharedRecord *rec = (SharedRecord *)out;
+    rec->slot = target - slots;
+    rec->num_variants = num_variants;
+    rec->length = length;
+    memcpy(rec->stamps, stamps, sizeof(rec->stamps));
+    
+    size_t pos = sizeof(SharedRecord);
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        CacheBlob *blob = variants[i];
+        if (!blob) continue;
+        
+        SharedVariant var;
+        memset(&var, 0, sizeof(var));
+        var.encoding = blob->encoding;
+        var.vary = blob->vary;
+        var.mtime = blob->mtime;
+        var.size = blob->size;
+        memcpy(var.header_len, blob->header_len, sizeof(var.header_len));
+        strcpy(var.etag, blob->etag);
+        memcpy(out + pos, &var, sizeof(var));
+        
+        // Body, then the headers, which each have their own pointer
+        char *data = out + pos + sizeof(var);
+        memcpy(data, blob->data, blob->size);
+        data += blob->size;
+        for (int s = 0; s < 2; s++) {
+            for (int c = 0; c < 2; c++) {
+                memcpy(data, blob->header[s][c], blob->header_len[s][c]);
+                data += blob->header_len[s][c];
+            }
+        }
+        pos += variant_length(blob);
+    }
+    header->head += length;
+    
+    __atomic_store_n(&target->seq, target->seq | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&target->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&target->position, position, __ATOMIC_RELAXED);
+    __atomic_store_n(&target->length, length, __ATOMIC_RELAXED);
+    strcpy(target->filename, filename);
+    __atomic_store_n(&target->seq, target->seq + 1, __ATOMIC_RELEASE);
+    header->entries++;
+    
+    pthread_mutex_unlock(&header->lock);
+    return 1;
+}
+
+int shared_cache_entry_count() {
+    return header ? __atomic_load_n(&header->entries, __ATOMIC_RELAXED) : 0;
+}
+
+size_t shared_cache_bytes_used() {
+    if (!header) return 0;
+    return __atomic_load_n(&header->head, __ATOMIC_RELAXED) - __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+}
+
+size_t shared_cache_capacity() {
+    return header ? header->capacity : 0;
+}
+
+unsigned long long shared_cache_hit_count() {
+    return header ? __atomic_load_n(&header->hits, __ATOMIC_RELAXED) : 0;
+}
+
+unsigned long long shared_cache_miss_count() {
+    return header ? __atomic_load_n(&header->misses, __ATOMIC_RELAXED) : 0;
+}
+
+unsigned long long shared_cache_eviction_count() {
+    return header ? __atomic_load_n(&header->evictions, __ATOMIC_RELAXED) : 0;
+}
@@ -1,44 +1,129 @@
 #include "server.h"
+#include <semaphore.h>
 
-// Global thread pool variables (defined here, declared in server.h)
-int task_queue[MAX_QUEUE];
-int front = 0, rear = 0, count = 0;
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
-
-void enqueue(int client_sock) {
-    pthread_mutex_lock(&queue_mutex);
-    
-    // If queue is full, we could either block or drop the request
-    // For this implementation, we'll wait for space
-    while (count == MAX_QUEUE) {
-        printf("Queue is full, waiting...\n");
-        pthread_mutex_unlock(&queue_mutex);
-        usleep(1000); // Sleep for 1ms
-        pthread_mutex_lock(&queue_mutex);
+// Each worker has its own bounded run queue. The accept thread deals new
+// connections out round-robin; a worker serves its own queue first and
+// steals the oldest connection from its peers when that is empty, so a
+// worker stuck on a slow keep-alive client does not hold up whatever was
+// queued behind it. One semaphore counts the connections queued across
+// all workers. Past the admission limit new connections are turned away
+// with a 503 instead of stalling accept().
+typedef struct {
+    pthread_mutex_t lock;
+    int *sockets;
+    int head;                // Oldest queued connection
+    int len;
+} RunQueue;
+
+static RunQueue *run_queues = NULL;
+static int num_workers = 0;
+static int queue_limit = MAX_QUEUE;
+static int pending = 0;      // Connections queued across all workers
+static int next_queue = 0;   // Only touched by the accept thread
+static sem_t work_available;
+
+int scheduler_init(int workers, int limit) {
+    num_workers = workers;
+    queue_limit = limit;
+    
+    run_queues = calloc(workers, sizeof(RunQueue));
+    if (!run_queues) return -1;
+    
+    // Any single queue may end up holding everything that was admitted
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&run_queues[i].lock, NULL);
+        run_queues[i].sockets = malloc(limit * sizeof(int));
+        if (!run_queues[i].sockets) return -1;
     }
     
-    task_queue[rear] = client_sock;
-    rear = (rear + 1) % MAX_QUEUE;
-    count++;
+    return sem_init(&work_available, 0, 0);
+}
+
+// Hand a connection to a worker. Returns -1 without queueing it once the
+// admission limit has been reached.
+int enqueue(int client_sock) {
+    if (__atomic_add_fetch(&pending, 1, __ATOMIC_ACQ_REL) > queue_limit) {
+        __atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL);
+        return -1;
+    }
     
-    pthread_cond_signal(&queue_not_empty);
-    pthread_mutex_unlock(&queue_mutex);
+    RunQueue *queue = &run_queues[next_queue];
+    next_queue = (next_queue + 1) % num_workers;
+    
+    pthread_mutex_lock(&queue->lock);
+    queue->sockets[(queue->head + queue->len) % queue_limit] = client_sock;
+    queue->len++;
+    pthread_mutex_unlock(&queue->lock);
+    
+    sem_post(&work_available);
+    return 0;
 }
 
-int dequeue() {
-    pthread_mutex_lock(&queue_mutex);
+static int take_from(RunQueue *queue) {
+    int sock = -1;
     
-    while (count == 0) {
-        pthread_cond_wait(&queue_not_empty, &queue_mutex);
+    pthread_mutex_lock(&queue->lock);
+    if (queue->len > 0) {
+        sock = queue->sockets[queue->head];
+        queue->head = (queue->head + 1) % queue_limit;
+        queue->len--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return sock;
+}
+
+// Wait for a connection, own queue first, then the others. Returns -1 when
+// the server is shutting down.
+int dequeue(int worker_id) {
+    while (sem_wait(&work_available) < 0) {
+        if (errno != EINTR) return -1;
     }
+    if (!server_running) return -1;
     
-    int sock = task_queue[front];
-    front = (front + 1) % MAX_QUEUE;
-    count--;
+    // Our semaphore token guarantees a connection is queued somewhere, but
+    // a peer may take the one we saw first, so keep looking until we win one
+    while (1) {
+        for (int i = 0; i < num_workers; i++) {
+            int sock = take_from(&run_queues[(worker_id + i) % num_workers]);
+            if (sock >= 0) {
+                __atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL);
+                return sock;
+            }
+        }
+    }
+}
+
+// Wake every worker so it notices server_running has been cleared
+void scheduler_stop() {
+    for (int i = 0; i < num_workers; i++) {
+        sem_post(&work_available);
+    }
+}
+
+// Connections waiting for a worker. Read without a lock so a metrics
+// scrape never holds up the accept thread.
+int queue_depth() {
+    return __atomic_load_n(&pending, __ATOMIC_RELAXED);
+}
+
+// Refuse a connection over the admission limit. The write must not block
+// the accept thread, so a full socket buffer just loses the response.
+void reject_connection(int client_sock) {
+    char response[256];
+    const char *body = "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>";
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: %zu\r\n"
+        "Retry-After: %d\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "%s", strlen(body), RETRY_AFTER_SECONDS, body);
     
-    pthread_mutex_unlock(&queue_mutex);
-    return sock;
+    send(client_sock, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_sock);
+    record_request("", 503, 0, 0, len, 0.0);
+    log_debug("Rejected client %d, %d connections already queued", client_sock, queue_limit);
 }
 
 void *worker(void *arg) {
@@ -46,18 +131,21 @@ void *worker(void *arg) {
     printf("Worker thread %d started\n", thread_id);
     
     while (server_running) {
-        int client_sock = dequeue();
+        int client_sock = dequeue(thread_id);
+        if (client_sock < 0) {
+            break;
+        }
         
         if (!server_running) {
             close(client_sock);
             break;
         }
         
-        printf("Thread %d handling client %d\n", thread_id, client_sock);
+        log_debug("Thread %d handling client %d", thread_id, client_sock);
         handle_client(client_sock);
         close(client_sock);
     }
     
     printf("Worker thread %d stopping\n", thread_id);
     pthread_exit(NULL);
-}
\ No newline at end of file
+}
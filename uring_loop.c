@@ -0,0 +1,714 @@
+#include "server.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+// io_uring mode: one ring per CPU, each with its own SO_REUSEPORT listener,
+// driven through the raw system calls. Work is queued as submission
+// entries and handed to the kernel by the same io_uring_enter() call that
+// waits for completions, so a busy loop makes one system call per batch of
+// events instead of one per accept, recv and send:
+// - a single multishot accept on the listener (a registered file) reports
+//   every new connection;
+// - receives take a buffer from a provided buffer ring only once data has
+//   arrived, so idle keep-alive connections hold none;
+// - responses are queued on the connection as in the other modes, and all
+//   the responses to a batch of pipelined requests go out in one sendmsg;
+// - files too large to cache are streamed as linked read -> send pairs
+//   through registered bounce buffers instead of with sendfile().
+
+// What a completion is for, kept in the low bits of user_data next to the
+// connection pointer. Completions with user_data 0 need no handling.
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_FILE_READ 4
+#define OP_FILE_SEND 5
+#define OP_MASK 7
+
+#define URING_IOV_MAX 16
+
+typedef struct {
+    Connection conn;             // First, so idle list entries cast back
+    struct msghdr msg;           // Of the sendmsg in flight
+    struct iovec iov[URING_IOV_MAX];
+    int ops;                     // Requests in flight for this connection
+    int recv_armed;
+    int sending;
+    int peer_closed;
+    int closing;
+    char *bounce;                // File data buffer, while streaming a file
+    int bounce_index;            // Its registered buffer, -1 if malloc'd
+    size_t file_chunk;           // Bytes read into the bounce buffer
+    size_t file_sent;            // Of those, bytes already sent
+    int file_read;               // What the read returned
+} UringConn;
+
+typedef struct {
+    int id;
+    int listen_fd;
+    int ring_fd;
+    int enter_fd;                // ring_fd, or its registered index
+    unsigned int enter_flags;
+    
+    // Submission queue
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;  // Entries filled in, published on enter
+    struct io_uring_sqe *sqes;
+    
+    // Completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    
+    void *ring_mem;
+    size_t ring_mem_size;
+    size_t sqes_size;
+    
+    // Provided receive buffers
+    struct io_uring_buf_ring *buf_ring;
+    char *recv_buffers;
+    unsigned short buf_tail;
+    
+    // Registered bounce buffers for file data
+    char *file_buffers;
+    int free_file_buffers[URING_FILE_BUFFERS];
+    int num_free_file_buffers;
+    
+    int accept_armed;
+    time_t accept_retry;         // Re-arm a failed accept from then on
+    time_t now;
+    Connection *idle_head;       // least recently active connection
+    Connection *idle_tail;
+} UringLoop;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                       unsigned int flags, void *arg, size_t arg_size) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned long long op_data(UringConn *uc, int op) {
+    return (unsigned long long)(uintptr_t)uc | op;
+}
+
+// ---- Submission and completion queues ----
+
+// Hand everything queued so far to the kernel and, if wait is set, sleep
+// until at least one completion arrives or a second has passed
+static void ring_enter(UringLoop *loop, int wait) {
+    __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned int to_submit = loop->sq_local_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && !wait) return;
+    
+    struct __kernel_timespec ts = { .tv_sec = 1, .tv_nsec = 0 };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long long)(uintptr_t)&ts;
+    
+    unsigned int flags = loop->enter_flags;
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+    
+    int ret = uring_enter(loop->enter_fd, to_submit, wait ? 1 : 0, flags,
+                          wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        perror("io_uring_enter failed");
+    }
+}
+
+static unsigned int sq_space(UringLoop *loop) {
+    return loop->sq_entries - (loop->sq_local_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Next free submission entry, cleared. Submits what is queued first if the
+// queue is full, so callers needing n entries in one batch (linked
+// requests) make sure of sq_space() beforehand.
+static struct io_uring_sqe *get_sqe(UringLoop *loop) {
+    while (sq_space(loop) == 0) {
+        ring_enter(loop, 0);
+    }
+    
+    struct io_uring_sqe *sqe = &loop->sqes[loop->sq_local_tail & loop->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sq_local_tail++;
+    return sqe;
+}
+
+static void recycle_buffer(UringLoop *loop, int bid) {
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (unsigned long long)(uintptr_t)(loop->recv_buffers + (size_t)bid * BUFFER_SIZE);
+    buf->len = BUFFER_SIZE;
+    buf->bid = bid;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+// ---- Connections ----
+
+static void idle_list_remove(UringLoop *loop, Connection *conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->idle_head = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    } else {
+        loop->idle_tail = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+}
+
+static void idle_list_append(UringLoop *loop, Connection *conn) {
+    conn->prev = loop->idle_tail;
+    conn->next = NULL;
+    if (loop->idle_tail) {
+        loop->idle_tail->next = conn;
+    } else {
+        loop->idle_head = conn;
+    }
+    loop->idle_tail = conn;
+}
+
+// Closing connections are off the idle list for good
+static void touch_connection(UringLoop *loop, UringConn *uc) {
+    uc->conn.last_active = loop->now;
+    if (!uc->closing && loop->idle_tail != &uc->conn) {
+        idle_list_remove(loop, &uc->conn);
+        idle_list_append(loop, &uc->conn);
+    }
+}
+
+static void release_bounce(UringLoop *loop, UringConn *uc) {
+    if (!uc->bounce) return;
+    if (uc->bounce_index >= 0) {
+        loop->free_file_buffers[loop->num_free_file_buffers++] = uc->bounce_index;
+    } else {
+        free(uc->bounce);
+    }
+    uc->bounce = NULL;
+    uc->bounce_index = -1;
+}
+
+// Free a connection once nothing the kernel is doing refers to it
+static void finish_close(UringLoop *loop, UringConn *uc) {
+    if (uc->ops > 0) return;
+    
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = uc->conn.fd;
+    
+    release_bounce(loop, uc);
+    conn_free(&uc->conn);
+    free(uc);
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+// Shutting the socket down completes whatever is still pending on it;
+// finish_close() frees the connection after that
+static void close_connection(UringLoop *loop, UringConn *uc) {
+    if (uc->closing) return;
+    uc->closing = 1;
+    idle_list_remove(loop, &uc->conn);
+    
+    if (uc->ops > 0) {
+        struct io_uring_sqe *sqe = get_sqe(loop);
+        sqe->opcode = IORING_OP_SHUTDOWN;
+        sqe->fd = uc->conn.fd;
+        sqe->len = SHUT_RDWR;
+    }
+}
+
+static void arm_accept(UringLoop *loop) {
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = 0;                 // The listener, registered file 0
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+    loop->accept_armed = 1;
+}
+
+// The kernel picks the buffer when data arrives; never more than the
+// input buffer can take
+static void arm_recv(UringLoop *loop, UringConn *uc) {
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->conn.fd;
+    sqe->len = BUFFER_SIZE - 1 - uc->conn.in_len;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = op_data(uc, OP_RECV);
+    uc->recv_armed = 1;
+    uc->ops++;
+}
+
+// Read the next chunk of a file segment into the bounce buffer and send
+// it, as one linked pair, or send what a partial send left of the chunk
+static void send_file_chunk(UringLoop *loop, UringConn *uc, OutputSegment *seg) {
+    if (!uc->bounce) {
+        if (loop->num_free_file_buffers > 0) {
+            uc->bounce_index = loop->free_file_buffers[--loop->num_free_file_buffers];
+            uc->bounce = loop->file_buffers + (size_t)uc->bounce_index * URING_FILE_CHUNK;
+        } else if (!(uc->bounce = malloc(URING_FILE_CHUNK))) {
+            close_connection(loop, uc);
+            return;
+        }
+    }
+    
+    Connection *conn = &uc->conn;
+    size_t left = seg->len - conn->segment_sent;
+    struct io_uring_sqe *sqe;
+    
+    if (uc->file_sent < uc->file_chunk) {
+        size_t rest = uc->file_chunk - uc->file_sent;
+        int more = rest < left || conn->segment_pos + 1 < conn->num_segments;
+        sqe = get_sqe(loop);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (unsigned long long)(uintptr_t)(uc->bounce + uc->file_sent);
+        sqe->len = rest;
+        sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        sqe->user_data = op_data(uc, OP_FILE_SEND);
+        uc->sending = 1;
+        uc->ops++;
+        return;
+    }
+    
+    size_t chunk = left < URING_FILE_CHUNK ? left : URING_FILE_CHUNK;
+    int more = chunk < left || conn->segment_pos + 1 < conn->num_segments;
+    
+    if (sq_space(loop) < 2) {
+        ring_enter(loop, 0);
+    }
+    
+    sqe = get_sqe(loop);
+    sqe->opcode = uc->bounce_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = seg->file_fd;
+    sqe->addr = (unsigned long long)(uintptr_t)uc->bounce;
+    sqe->len = chunk;
+    sqe->off = seg->file_offset + conn->segment_sent;
+    sqe->buf_index = uc->bounce_index >= 0 ? uc->bounce_index : 0;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = op_data(uc, OP_FILE_READ);
+    
+    sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)uc->bounce;
+    sqe->len = chunk;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    sqe->user_data = op_data(uc, OP_FILE_SEND);
+    
+    uc->file_chunk = chunk;
+    uc->file_sent = 0;
+    uc->file_read = -1;
+    uc->sending = 1;
+    uc->ops += 2;
+}
+
+// Send the front of the output queue: every memory segment up to the next
+// file in one sendmsg, or the next chunk of that file. No MSG_WAITALL: a
+// slow reader completes partial sends, each of which counts as activity
+// for the idle timeout, and the rest is sent from the next completion.
+static void send_output(UringLoop *loop, UringConn *uc) {
+    Connection *conn = &uc->conn;
+    OutputSegment *seg = &conn->segments[conn->segment_pos];
+    if (seg->file_fd >= 0) {
+        send_file_chunk(loop, uc, seg);
+        return;
+    }
+    
+    int more;
+    memset(&uc->msg, 0, sizeof(uc->msg));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = conn_gather(conn, uc->iov, URING_IOV_MAX, &more);
+    
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)&uc->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    sqe->user_data = op_data(uc, OP_SEND);
+    uc->sending = 1;
+    uc->ops++;
+}
+
+// Decide what a connection does next after any completion. Requests are
+// only parsed while no send is in flight, since queuing more output could
+// move the buffer the kernel is sending from. This is the only place a
+// connection is freed, so handlers may close it and carry on.
+static void advance_connection(UringLoop *loop, UringConn *uc) {
+    Connection *conn = &uc->conn;
+    
+    if (!uc->closing && !uc->sending) {
+        if (!conn_has_pending_output(conn) && !conn->close_after_write) {
+            process_requests(conn);
+        }
+        
+        // A half-closed client still gets answers to what it already sent
+        if (conn_has_pending_output(conn)) {
+            send_output(loop, uc);
+        } else if (conn->close_after_write || uc->peer_closed) {
+            close_connection(loop, uc);
+        }
+    }
+    
+    if (!uc->recv_armed && !uc->peer_closed && !uc->closing && !conn->close_after_write &&
+        conn->in_len < BUFFER_SIZE - 1) {
+        arm_recv(loop, uc);
+    }
+    
+    if (uc->closing) {
+        finish_close(loop, uc);
+    }
+}
+
+static void accept_connection(UringLoop *loop, int client_sock) {
+    UringConn *uc = malloc(sizeof(UringConn));
+    if (!uc) {
+        close(client_sock);
+        return;
+    }
+    
+    conn_init(&uc->conn, client_sock, 1);
+    uc->conn.deferred = 1;
+    uc->ops = 0;
+    uc->recv_armed = uc->sending = uc->peer_closed = uc->closing = 0;
+    uc->bounce = NULL;
+    uc->bounce_index = -1;
+    uc->file_chunk = uc->file_sent = 0;
+    
+    // The access log is the only reader of the address, so skip the
+    // system call when it is off
+    if (access_log_format != ACCESS_LOG_OFF) {
+        struct sockaddr_in peer_addr;
+        socklen_t peer_len = sizeof(peer_addr);
+        if (getpeername(client_sock, (struct sockaddr *)&peer_addr, &peer_len) == 0) {
+            inet_ntop(AF_INET, &peer_addr.sin_addr, uc->conn.peer, sizeof(uc->conn.peer));
+        }
+    }
+    log_debug("New client connected: %s (socket %d, ring %d)", uc->conn.peer, client_sock, loop->id);
+    
+    uc->conn.last_active = loop->now;
+    idle_list_append(loop, &uc->conn);
+    __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    arm_recv(loop, uc);
+}
+
+static void handle_completion(UringLoop *loop, struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & OP_MASK;
+    UringConn *uc = (UringConn *)(uintptr_t)(cqe->user_data & ~(unsigned long long)OP_MASK);
+    int res = cqe->res;
+    
+    if (op == OP_ACCEPT) {
+        if (res >= 0) {
+            accept_connection(loop, res);
+        } else if (res != -EAGAIN && res != -EINTR && server_running) {
+            errno = -res;
+            perror("Accept failed");
+            loop->accept_retry = loop->now + 1;  // Out of descriptors, most likely
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            loop->accept_armed = 0;
+        }
+        return;
+    }
+    if (!uc) return;
+    
+    uc->ops--;
+    switch (op) {
+    case OP_RECV:
+        uc->recv_armed = 0;
+        if (res > 0) {
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            memcpy(uc->conn.in + uc->conn.in_len, loop->recv_buffers + (size_t)bid * BUFFER_SIZE, res);
+            uc->conn.in_len += res;
+            recycle_buffer(loop, bid);
+            touch_connection(loop, uc);
+        } else if (res == 0) {
+            uc->peer_closed = 1;
+        } else if (res != -ENOBUFS) {
+            close_connection(loop, uc);  // -ENOBUFS is retried below
+        }
+        break;
+    
+    case OP_SEND:
+        uc->sending = 0;
+        if (res < 0) {
+            close_connection(loop, uc);
+        } else {
+            conn_advance(&uc->conn, res);
+            touch_connection(loop, uc);
+        }
+        break;
+    
+    case OP_FILE_READ:
+        uc->file_read = res;
+        return;  // The linked send completes the pair
+    
+    case OP_FILE_SEND:
+        uc->sending = 0;
+        // A short read means the file shrank: Content-Length can't be met
+        if (res < 0 || uc->file_read != (int)uc->file_chunk) {
+            close_connection(loop, uc);
+            break;
+        }
+        conn_advance(&uc->conn, res);
+        uc->file_sent += res;
+        if (!conn_has_pending_output(&uc->conn) ||
+            uc->conn.segments[uc->conn.segment_pos].file_fd < 0) {
+            release_bounce(loop, uc);
+        }
+        touch_connection(loop, uc);
+        break;
+    }
+    
+    advance_connection(loop, uc);
+}
+
+// Close connections that have been idle (or stalled writing) too long
+static void sweep_idle_connections(UringLoop *loop) {
+    while (loop->idle_head &&
+           loop->now - loop->idle_head->last_active >= KEEPALIVE_TIMEOUT) {
+        UringConn *uc = (UringConn *)loop->idle_head;
+        close_connection(loop, uc);
+        finish_close(loop, uc);
+    }
+}
+
+void *uring_loop_thread(void *arg) {
+    UringLoop *loop = arg;
+    
+    // The ring was created disabled so that this thread becomes its only
+    // submitter; registering it saves a file lookup on every enter
+    if (uring_register(loop->ring_fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+        perror("Failed to enable io_uring");
+        return NULL;
+    }
+    struct io_uring_rsrc_update reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.offset = -1U;
+    reg.data = loop->ring_fd;
+    if (uring_register(loop->ring_fd, IORING_REGISTER_RING_FDS, &reg, 1) == 1) {
+        loop->enter_fd = reg.offset;
+        loop->enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+    
+    printf("io_uring loop %d started (listener %d)\n", loop->id, loop->listen_fd);
+    
+    loop->now = time(NULL);
+    arm_accept(loop);
+    
+    while (server_running) {
+        ring_enter(loop, 1);
+        loop->now = time(NULL);
+        
+        unsigned int head = *loop->cq_head;
+        while (head != __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE)) {
+            handle_completion(loop, &loop->cqes[head & loop->cq_mask]);
+            head++;
+            __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+        }
+        
+        if (!loop->accept_armed && loop->now >= loop->accept_retry) {
+            arm_accept(loop);
+        }
+        sweep_idle_connections(loop);
+    }
+    
+    printf("io_uring loop %d stopping\n", loop->id);
+    close(loop->listen_fd);
+    close(loop->ring_fd);
+    return NULL;
+}
+
+// ---- Setup ----
+
+static void destroy_loop(UringLoop *loop) {
+    if (loop->ring_fd >= 0) close(loop->ring_fd);
+    if (loop->listen_fd >= 0) close(loop->listen_fd);
+    if (loop->ring_mem) munmap(loop->ring_mem, loop->ring_mem_size);
+    if (loop->sqes) munmap(loop->sqes, loop->sqes_size);
+    if (loop->buf_ring) munmap(loop->buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+    free(loop->recv_buffers);
+    free(loop->file_buffers);
+    free(loop);
+}
+
+// Create a ring with its listener, receive buffers and file buffers, all
+// registered. Returns NULL if this kernel cannot run the io_uring mode.
+static UringLoop *create_loop(int id, int port) {
+    UringLoop *loop = calloc(1, sizeof(UringLoop));
+    if (!loop) return NULL;
+    loop->id = id;
+    loop->ring_fd = loop->listen_fd = -1;
+    
+    // Prefer a single-issuer ring that only runs completion work when we
+    // ask for events; older kernels get a plain one
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                   IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    loop->ring_fd = uring_setup(URING_ENTRIES, &params);
+    if (loop->ring_fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        loop->ring_fd = uring_setup(URING_ENTRIES, &params);
+    }
+    if (loop->ring_fd < 0) {
+        perror("io_uring_setup failed");
+        destroy_loop(loop);
+        return NULL;
+    }
+    
+    unsigned int required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        printf("io_uring is missing features this server needs\n");
+        destroy_loop(loop);
+        return NULL;
+    }
+    loop->enter_fd = loop->ring_fd;
+    
+    // Submission and completion rings share one mapping
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    loop->ring_mem_size = sq_size > cq_size ? sq_size : cq_size;
+    loop->ring_mem = mmap(NULL, loop->ring_mem_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQ_RING);
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+    if (loop->ring_mem == MAP_FAILED || loop->sqes == MAP_FAILED) {
+        perror("Failed to map io_uring");
+        if (loop->ring_mem == MAP_FAILED) loop->ring_mem = NULL;
+        if (loop->sqes == MAP_FAILED) loop->sqes = NULL;
+        destroy_loop(loop);
+        return NULL;
+    }
+    
+    char *ring = loop->ring_mem;
+    loop->sq_head = (unsigned int *)(ring + params.sq_off.head);
+    loop->sq_tail = (unsigned int *)(ring + params.sq_off.tail);
+    loop->sq_mask = *(unsigned int *)(ring + params.sq_off.ring_mask);
+    loop->sq_entries = params.sq_entries;
+    loop->sq_local_tail = *loop->sq_tail;
+    loop->cq_head = (unsigned int *)(ring + params.cq_off.head);
+    loop->cq_tail = (unsigned int *)(ring + params.cq_off.tail);
+    loop->cq_mask = *(unsigned int *)(ring + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    
+    // Submission entry i always sits in array slot i
+    unsigned int *sq_array = (unsigned int *)(ring + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    
+    // Receive buffers, handed to the kernel through a buffer ring
+    loop->buf_ring = mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf),
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    loop->recv_buffers = malloc((size_t)URING_RECV_BUFFERS * BUFFER_SIZE);
+    if (loop->buf_ring == MAP_FAILED || !loop->recv_buffers) {
+        if (loop->buf_ring == MAP_FAILED) loop->buf_ring = NULL;
+        destroy_loop(loop);
+        return NULL;
+    }
+    struct io_uring_buf_reg buf_reg;
+    memset(&buf_reg, 0, sizeof(buf_reg));
+    buf_reg.ring_addr = (unsigned long long)(uintptr_t)loop->buf_ring;
+    buf_reg.ring_entries = URING_RECV_BUFFERS;
+    buf_reg.bgid = 0;
+    if (uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &buf_reg, 1) < 0) {
+        perror("Failed to register io_uring receive buffers");
+        destroy_loop(loop);
+        return NULL;
+    }
+    for (int i = 0; i < URING_RECV_BUFFERS; i++) {
+        recycle_buffer(loop, i);
+    }
+    
+    // Bounce buffers for streamed files, registered so reads skip the
+    // page pinning
+    loop->file_buffers = malloc((size_t)URING_FILE_BUFFERS * URING_FILE_CHUNK);
+    if (!loop->file_buffers) {
+        destroy_loop(loop);
+        return NULL;
+    }
+    struct iovec file_iov[URING_FILE_BUFFERS];
+    for (int i = 0; i < URING_FILE_BUFFERS; i++) {
+        file_iov[i].iov_base = loop->file_buffers + (size_t)i * URING_FILE_CHUNK;
+        file_iov[i].iov_len = URING_FILE_CHUNK;
+        loop->free_file_buffers[i] = i;
+    }
+    loop->num_free_file_buffers = URING_FILE_BUFFERS;
+    if (uring_register(loop->ring_fd, IORING_REGISTER_BUFFERS, file_iov, URING_FILE_BUFFERS) < 0) {
+        perror("Failed to register io_uring file buffers");
+        destroy_loop(loop);
+        return NULL;
+    }
+    
+    loop->listen_fd = create_listener(port, 1);
+    if (loop->listen_fd < 0 ||
+        uring_register(loop->ring_fd, IORING_REGISTER_FILES, &loop->listen_fd, 1) < 0) {
+        if (loop->listen_fd >= 0) perror("Failed to register io_uring listener");
+        destroy_loop(loop);
+        return NULL;
+    }
+    
+    return loop;
+}
+
+// Set up every ring before starting any thread, so that a kernel without
+// the features we need is found out while the epoll loops can still take
+// over. Returns -1 in that case.
+int start_uring_loops(int port, int num_loops, int pin_loops, pthread_t *threads) {
+    UringLoop **loops = calloc(num_loops, sizeof(UringLoop *));
+    if (!loops) return -1;
+    
+    for (int i = 0; i < num_loops; i++) {
+        loops[i] = create_loop(i, port);
+        if (!loops[i]) {
+            for (int j = 0; j < i; j++) {
+                destroy_loop(loops[j]);
+            }
+            free(loops);
+            return -1;
+        }
+    }
+    
+    for (int i = 0; i < num_loops; i++) {
+        if (pthread_create(&threads[i], NULL, uring_loop_thread, loops[i]) != 0) {
+            perror("Failed to create io_uring loop thread");
+            exit(1);
+        }
+        
+        // Keep each loop on its own core so its connections stay cache-warm
+        if (pin_loops) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % CPU_SETSIZE, &cpus);
+            pthread_setaffinity_np(threads[i], sizeof(cpus), &cpus);
+        }
+    }
+    
+    free(loops);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include "server.h"
+#include <ftw.h>
+
+// Startup cache warm-up. Paths from an optional manifest of hot files come
+// first, then everything servable under the document root. Loader threads
+// take paths in that order and fill the cache until the byte budget is
+// used up, without evicting what was loaded before.
+
+typedef struct {
+    char **paths;
+    int count;
+    int cap;
+    int next;                // Next path to load, shared by the loaders
+    int loaded;
+} WarmupList;
+
+// nftw() has no user argument
+static WarmupList *walk_list;
+
+static int add_path(WarmupList *list, const char *path) {
+    // Paths are relative to the document root, like request filenames
+    while (path[0] == '.' && path[1] == '/') path += 2;
+    while (*path == '/') path++;
+    if (!*path || strlen(path) >= MAX_FILENAME || strstr(path, "..")) return 0;
+    
+    if (list->count == list->cap) {
+        int new_cap = list->cap ? list->cap * 2 : 64;
+        char **paths = realloc(list->paths, new_cap * sizeof(char *));
+        if (!paths) return -1;
+        list->paths = paths;
+        list->cap = new_cap;
+    }
+    
+    list->paths[list->count] = strdup(path);
+    if (!list->paths[list->count]) return -1;
+    list->count++;
+    return 0;
+}
+
+// One path per line, blank lines and # comments ignored
+static void read_manifest(WarmupList *list, const char *manifest) {
+    FILE *file = fopen(manifest, "r");
+    if (!file) {
+        perror("Failed to open warm-up manifest");
+        return;
+    }
+    
+    char line[MAX_FILENAME + 2];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        add_path(list, line);
+    }
+    
+    fclose(file);
+}
+
+// Whether the walk should preload this file: only types we know how to
+// serve, skipping precompressed siblings (loaded with their original)
+static int is_servable(const char *path) {
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODING_COUNT; i++) {
+        size_t len = strlen(path);
+        size_t ext_len = strlen(encoding_extension(i));
+        if (len > ext_len && strcmp(path + len - ext_len, encoding_extension(i)) == 0) {
+            return 0;
+        }
+    }
+    return strcmp(get_content_type(path), "application/octet-stream") != 0;
+}
+
+static int walk_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    const char *name = path + ftw->base;
+    
+    // Skip hidden files and directories such as .git
+    if (ftw->level > 0 && name[0] == '.') {
+        return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    }
+    
+    if (type == FTW_F && S_ISREG(st->st_mode) && is_servable(path)) {
+        add_path(walk_list, path);
+    }
+    return FTW_CONTINUE;
+}
+
+static void *warmup_thread(void *arg) {
+    WarmupList *list = arg;
+    size_t budget = cache_capacity();
+    
+    while (1) {
+        int i = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED);
+        if (i >= list->count) break;
+        
+        // Every shard may still have a little room, but past the overall
+        // budget further loads are very unlikely to fit
+        if (cache_bytes_used() >= budget) break;
+        
+        const char *path = list->paths[i];
+        if (cache_contains(path)) continue;  // Listed in the manifest too
+        
+        struct stat st;
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+        if ((size_t)st.st_size >= sendfile_threshold || (size_t)st.st_size > cache_max_entry_size()) {
+            continue;  // Served with sendfile(), never cached
+        }
+        
+        CacheBlob *variants[ENCODING_COUNT];
+        if (load_file_variants(path, variants) < 0) continue;
+        
+        if (cache_preload(path, variants)) {
+            watch_cached_file(path);
+            __atomic_fetch_add(&list->loaded, 1, __ATOMIC_RELAXED);
+        }
+        release_variants(variants);
+    }
+    
+    return NULL;
+}
+
+// Fill the cache before the server starts accepting connections.
+// Returns the number of files loaded.
+int cache_warmup(const char *manifest, int num_threads) {
+    WarmupList list;
+    memset(&list, 0, sizeof(list));
+    
+    if (manifest) {
+        read_manifest(&list, manifest);
+    }
+    
+    walk_list = &list;
+    if (nftw(".", walk_entry, 16, FTW_PHYS | FTW_ACTIONRETVAL) < 0) {
+        perror("Document root walk failed");
+    }
+    walk_list = NULL;
+    
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > list.count) num_threads = list.count;
+    
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    int started = 0;
+    if (threads) {
+        for (; started < num_threads; started++) {
+            if (pthread_create(&threads[started], NULL, warmup_thread, &list) != 0) {
+                perror("Failed to create warm-up thread");
+                break;
+            }
+        }
+    }
+    
+    // Load on this thread too if no loader could be started
+    if (started == 0) {
+        warmup_thread(&list);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    
+    for (int i = 0; i < list.count; i++) {
+        free(list.paths[i]);
+    }
+    free(list.paths);
+    return list.loaded;
+}